@@ -12,11 +12,13 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <selector.h>
+#include <socket_options.h>
 
 #define A 1
 #define AAAA 28
 #define BUFF_SIZE 6000
 #define POST_SIZE 1024
+#define MAX_ANSWERS 128     // Addresses kept per family
 
 //DNS header structure
 struct DNS_HEADER {
@@ -74,6 +76,9 @@ int change_to_dns_format(char* dns, const char * host);
 int get_name(unsigned char * body);
 int create_post(int length, char * body, char * write_buffer, int space);
 int read_response(struct aibuf * out, int sin_port, int family, int ans_count, struct buffer buff);
+static int take_response(struct doh_client * doh);
+static int read_answers(struct doh_client * doh, uint8_t * body, size_t length, struct aibuf ** out);
+static void merge_answers(struct doh_client * doh);
 
 /*------------------- VARIABLES GLOBALES -------------------*/
 struct doh configurations;
@@ -91,15 +96,8 @@ int doh_client_init(struct selector_key * key) {
         return -1;
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-
     selector_fd_set_nio(s);
-    
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&timeout, sizeof(int)) < 0) {
-        log(ERROR, "set DoH socket options SO_REUSEADDR failed %s ", strerror(errno))
-    }
+    apply_socket_policy(s, SOCKET_CLASS_DOH);
 
     struct sockaddr_in dest;
 
@@ -130,76 +128,230 @@ int doh_client_init(struct selector_key * key) {
     }
 }
 
+void doh_disconnect(struct selector_key * key) {
+    int s = key->item->doh.server_socket;
+    if (s <= 0)
+        return;
+
+    FD_CLR(s, &key->s->master_r);
+    FD_CLR(s, &key->s->master_w);
+    close(s);
+
+    key->item->doh.server_socket = -1;
+    if (key->item->target_socket == s)
+        key->item->target_socket = -1;
+}
+
 void doh_kill(struct selector_key * key) {
-    FD_CLR(key->item->doh.server_socket, &key->s->master_r);
-    FD_CLR(key->item->doh.server_socket, &key->s->master_w);
-    close(key->item->doh.server_socket);
+    doh_disconnect(key);
     if (key->item->doh.target_address_list != NULL) {
         free(key->item->doh.target_address_list);
     }
+    for (int i = 0; i < DOH_QUERIES; i++) {
+        free(key->item->doh.answers[i]);
+    }
+    if (key->item->doh.parser != NULL) {
+        http_response_parser_destroy(key->item->doh.parser);
+    }
     free_buffer(&(key->item->doh.buff));
     memset(&(key->item->doh), 0, sizeof(struct doh_client));
 }
 
-int doh_client_read(struct selector_key * key) {
-    /*----------- Recivo el response DOH -----------*/
-    int dim = sizeof(struct sockaddr_in);
-    size_t nbyte;
-    buffer_reset(&(key->item->doh.buff));
-    memset(key->item->doh.buff.read, 0, BUFF_SIZE);
-    char *aux_buff = (char *)buffer_write_ptr(&(key->item->doh.buff), &nbyte);
+int doh_client_query(struct selector_key * key) {
+    struct doh_client * doh = &(key->item->doh);
 
-    ssize_t read_bytes;
-    struct sockaddr_in dest;
-    if ((read_bytes = recvfrom(key->item->doh.server_socket, aux_buff, nbyte, 0, (struct sockaddr *)&dest, (socklen_t *)&dim)) < 0) {
-        log(ERROR, "Getting response from DOH server")
-        free_buffer(&(key->item->doh.buff));
-        close(key->item->doh.server_socket);
+    doh->parser = malloc(sizeof(*(doh->parser)));
+    if (doh->parser == NULL) {
+        log(ERROR, "Doing malloc of DoH response parser")
         return -1;
     }
+    http_response_parser_init(doh->parser);
+
+    // Both families are asked at once, the server answers them in order.
+    // Without the A query the AAAA answer is all there is.
 
-    buffer_write_adv(&(key->item->doh.buff), read_bytes);
+    if (send_doh_request(key, AF_INET6) < 0)
+        return -1;
 
-    // Parsing of response
-    http_response_parser parser = {0};
-    http_response_parser_init(&parser);
-    http_response_parser_parse(&parser, &(key->item->doh.buff), false); // response is parsed
-    http_response response = parser.response;
+    doh->pending = send_doh_request(key, AF_INET) < 0 ? 1 : DOH_QUERIES;
+    doh->answered = 0;
+    buffer_reset(&(doh->buff));
+    return 0;
+}
 
-    key->item->doh.buff.read = (unsigned char *)response.message.body;
+int doh_client_read(struct selector_key * key) {
+    /*----------- Recivo los responses DOH -----------*/
+    struct doh_client * doh = &(key->item->doh);
 
-    struct DNS_HEADER *dns = calloc(1, sizeof(struct DNS_HEADER));
-    if (dns == NULL) {
-        log(ERROR, "Doing calloc of dns header")
+    size_t nbyte;
+    uint8_t * ptr = buffer_write_ptr(&(doh->buff), &nbyte);
+    if (nbyte == 0) {
+        log(ERROR, "DoH responses do not fit the buffer")
         return -1;
     }
 
-    memcpy(dns, buffer_read_ptr(&(key->item->doh.buff), &nbyte), sizeof(struct DNS_HEADER)); // Obtengo el DNS_HEADER
-    buffer_read_adv(&(key->item->doh.buff), sizeof(struct DNS_HEADER));
+    ssize_t read_bytes = recv(doh->server_socket, ptr, nbyte, 0);
+    if (read_bytes <= 0) {
+        if (doh->answered == 0) {
+            log(ERROR, "Getting response from DOH server")
+            return -1;
+        }
+        log(INFO, "DoH server stopped after %u answers, using those", doh->answered)
+        doh->pending = 0;
+    }
 
-    int ans_count = ntohs(dns->ans_count); // Cantidad de respuestas
-    free(dns);
+    if (read_bytes > 0)
+        buffer_write_adv(&(doh->buff), read_bytes);
 
-    if (ans_count == 0) {
-        return 0;
+    // Both responses may come in a single read, or one split across many
+
+    while (doh->pending > 0) {
+        int taken = take_response(doh);
+        if (taken < 0 && doh->answered == 0)
+            return -1;
+        if (taken < 0)
+            doh->pending = 0;
+        if (taken <= 0)
+            break;
+        doh->pending--;
     }
 
-    struct aibuf * out = calloc(1, ans_count * sizeof(*out) + 1); // Se usa para llenar la estructura de las answers
-    if (out == NULL) {
+    if (doh->pending == 0)
+        merge_answers(doh);
+
+    return doh->pending;
+}
+
+void doh_client_settle(struct selector_key * key) {
+    key->item->doh.pending = 0;
+    merge_answers(&(key->item->doh));
+}
+
+/*
+ * Consumes the next response from the buffer if it arrived whole. The
+ * head is parsed as it arrives, the body once it is complete. Returns 1
+ * if it did, 0 if more bytes are needed and -1 on failure.
+ */
+static int take_response(struct doh_client * doh) {
+    http_response_parser * parser = doh->parser;
+    http_message * message = &(parser->response.message);
+
+    if (message->body == NULL) {
+        parse_state state = http_response_parser_parse(parser, &(doh->buff), false);
+
+        if (state == FAILED) {
+            log(ERROR, "Malformed response from DoH server")
+            return -1;
+        }
+        if (state == PENDING)
+            return 0;
+    }
+
+    size_t available;
+    uint8_t * body = buffer_read_ptr(&(doh->buff), &available);
+    if (available < message->body_length)
+        return 0;
+
+    struct aibuf * out = NULL;
+    int count = parser->response.status == 200 ? read_answers(doh, body, message->body_length, &out) : 0;
+    if (count < 0)
+        return -1;
+
+    doh->answers[doh->answered++] = out == NULL ? NULL : &out->ai;
+    buffer_read_adv(&(doh->buff), message->body_length);
+    http_response_parser_reset(parser);
+
+    return 1;
+}
+
+/*
+ * Collects the A and AAAA records of a DNS message. Returns how many
+ * there were, leaving them in a list at `out`.
+ */
+static int read_answers(struct doh_client * doh, uint8_t * body, size_t length, struct aibuf ** out) {
+    size_t nbyte;
+
+    if (length < sizeof(struct DNS_HEADER))
+        return -1;
+
+    buffer dns;
+    buffer_init(&dns, length, body);
+    buffer_write_adv(&dns, length);
+
+    struct DNS_HEADER header;
+    memcpy(&header, buffer_read_ptr(&dns, &nbyte), sizeof(struct DNS_HEADER)); // Obtengo el DNS_HEADER
+    buffer_read_adv(&dns, sizeof(struct DNS_HEADER));
+
+    int ans_count = ntohs(header.ans_count); // Cantidad de respuestas
+    if (ans_count == 0)
+        return 0;
+
+    *out = calloc(1, ans_count * sizeof(**out) + 1); // Se usa para llenar la estructura de las answers
+    if (*out == NULL) {
         log(ERROR, "Doing calloc of out")
         return -1;
     }
 
-    int n = get_name(buffer_read_ptr(&(key->item->doh.buff), &nbyte)) + sizeof(struct QUESTION);
-    buffer_read_adv(&(key->item->doh.buff), n); // comienzo de las answers, me salteo la estructura QUESTION porque no me interesa
+    int n = get_name(buffer_read_ptr(&dns, &nbyte)) + sizeof(struct QUESTION);
+    buffer_read_adv(&dns, n); // comienzo de las answers, me salteo la estructura QUESTION porque no me interesa
 
     /*----------- Lectura del response DOH -----------*/
-    ans_count = read_response(out, key->item->doh.url.port, key->item->doh.family, ans_count, key->item->doh.buff);
+    int count = read_response(*out, doh->url.port, AF_UNSPEC, ans_count, dns);
+    if (count <= 0) {
+        free(*out);
+        *out = NULL;
+    }
+    return count;
+}
+
+/*
+ * Interleaves the answers of both queries into the target address list,
+ * IPv6 first, so consecutive attempts alternate between families.
+ */
+static void merge_answers(struct doh_client * doh) {
+    struct addrinfo * families[2][MAX_ANSWERS];
+    size_t counts[2] = {0, 0};
+
+    for (int i = 0; i < DOH_QUERIES; i++) {
+        for (struct addrinfo * ai = doh->answers[i]; ai != NULL; ai = ai->ai_next) {
+            int f = ai->ai_family == AF_INET6 ? 0 : 1;
+            if (counts[f] < MAX_ANSWERS)
+                families[f][counts[f]++] = ai;
+        }
+    }
+
+    size_t total = counts[0] + counts[1];
+    doh->target_address_list = NULL;
+    doh->current_target_addr = NULL;
+
+    if (total == 0)
+        return;
 
-    // Termine
-    key->item->doh.target_address_list = &out->ai;
-    key->item->doh.current_target_addr = key->item->doh.target_address_list;
-    return ans_count;
+    struct aibuf * out = calloc(total, sizeof(*out));
+    if (out == NULL) {
+        log(ERROR, "Doing calloc of merged answers")
+        return;
+    }
+
+    size_t taken[2] = {0, 0};
+    for (size_t k = 0, f = 0; k < total; k++, f = 1 - f) {
+        if (taken[f] == counts[f])
+            f = 1 - f;
+
+        struct addrinfo * src = families[f][taken[f]++];
+        out[k].ai = *src;
+        memcpy(&out[k].sa, src->ai_addr, src->ai_addrlen);
+        out[k].ai.ai_addr = (void *) &out[k].sa;
+        out[k].ai.ai_next = k + 1 < total ? &out[k + 1].ai : NULL;
+    }
+
+    doh->target_address_list = &out->ai;
+    doh->current_target_addr = doh->target_address_list;
+
+    for (int i = 0; i < DOH_QUERIES; i++) {
+        free(doh->answers[i]);
+        doh->answers[i] = NULL;
+    }
 }
 
 int create_post(int length, char * body, char * write_buffer, int space) {
@@ -302,7 +454,7 @@ int read_response(struct aibuf * out, int sin_port, int family, int ans_count, s
         else if (ntohs(data->type) == AAAA) sin_family = AF_INET6;
         else sin_family = -1;
 
-        if (family == sin_family) {
+        if (sin_family != -1 && (family == AF_UNSPEC || family == sin_family)) {
             out[cant].ai = (struct addrinfo) {
                     .ai_family = sin_family,
                     .ai_socktype = SOCK_STREAM,
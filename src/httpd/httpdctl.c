@@ -5,6 +5,7 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <client_argc.h>
+#include <socket_options.h>
 #include <sys/termios.h>
 
 union format {
@@ -12,6 +13,11 @@ union format {
     int time;
     unsigned char boolean :1;
     unsigned char level :2;
+    struct {
+        unsigned char socket_class;
+        unsigned char option;
+        int value;
+    } socket_option;
 };
 
 struct request_header {
@@ -42,12 +48,41 @@ struct method4 {
     unsigned long total_recieved;
 };
 
+#define ENDPOINT_UNREACHABLE 0x1
+#define ENDPOINT_EJECTED     0x2
+
+struct endpoint_stats {
+    unsigned char family;
+    unsigned char flags;
+    unsigned short port;
+    unsigned char address[16];
+    unsigned int connect_ms;
+    unsigned int first_byte_ms;
+    unsigned int connects;
+    unsigned int failures;
+};
+
+#define ORIGIN_STATS_HOST 48
+
+struct origin_stats {
+    unsigned char breaker;
+    unsigned char reserved;
+    unsigned short port;
+    unsigned int active;
+    unsigned int waiting;
+    unsigned int failures;
+    unsigned int trips;
+    unsigned int fast_failed;
+    char host[ORIGIN_STATS_HOST];
+};
+
 struct method5 {
     int timeout;
     int frequency;
     unsigned short max_clients :10;
     unsigned char disectors_enabled :1;
     unsigned char logLevel :2;
+    int socket_policy[SOCKET_CLASS_COUNT][SOCKOPT_COUNT];
 };
 
 enum req_status {
@@ -57,25 +92,29 @@ enum req_status {
 };
 
 #define BUFFER_SIZE 1024
-#define MAX_RETRIEVE_METHODS 6
+#define MAX_RETRIEVE_METHODS 8
 #define MAX_SET_METHODS 7
 #define MAX_CLIENT_METHODS 2
 #define MAX_STRING 20
 #define RETRIEVE 0
 #define SET 1
 #define CURRENT_VERSION 1
-#define COMMAND_SIZE 40
+#define COMMAND_SIZE 64
 
 char buffer[BUFFER_SIZE];
 char pass[32];
 char logLevels[4][6] = {"DEBUG", "INFO", "ERROR", "FATAL"};
 
-char retrieve_methods[MAX_RETRIEVE_METHODS][MAX_STRING] = {"totalConnections", "currentConnections", "totalSend", "totalRecieved", "allStats", "getConfigurations"};
-char set_methods[MAX_SET_METHODS][MAX_STRING] = {"setMaxClients", "setClientTimeout", "setStatsFrequency", "setDisector", "setLoggingLevel"};
+char retrieve_methods[MAX_RETRIEVE_METHODS][MAX_STRING] = {"totalConnections", "currentConnections", "totalSend", "totalRecieved", "allStats", "getConfigurations", "endpointStats", "originStats"};
+char set_methods[MAX_SET_METHODS][MAX_STRING] = {"setMaxClients", "setClientTimeout", "setStatsFrequency", "setDisector", "setLoggingLevel", "setSocketOption"};
+char socket_classes[SOCKET_CLASS_COUNT][MAX_STRING] = {"listener", "client", "target", "doh"};
+char socket_options[SOCKOPT_COUNT][MAX_STRING] = {"nodelay", "deferAccept", "notsentLowat", "sndbuf", "rcvbuf", "keepalive", "quickack"};
 char client_methods[MAX_CLIENT_METHODS][MAX_STRING] = {"help", "changePassword"};
 
 void process_response(struct response_header * res);
 int parse_command(char * command, struct request_header * res, char * buffer);
+int parse_socket_option(struct request_header * req);
+int find_name(char names[][MAX_STRING], int count, const char * name);
 void print_error(char * message);
 int is_number(const char * str);
 void print_help();
@@ -218,6 +257,49 @@ void process_response(struct response_header * res) {
                 printf("- Log Level: ");
                 reset();
                 printf("%s\n", logLevels[results->logLevel]);
+                cyan();
+                printf("- Opciones de socket:\n");
+                reset();
+                for (int c = 0; c < SOCKET_CLASS_COUNT; c++) {
+                    printf("    %-9s", socket_classes[c]);
+                    for (int o = 0; o < SOCKOPT_COUNT; o++) {
+                        if (results->socket_policy[c][o] == SOCKOPT_UNSET)
+                            printf(" %s=default", socket_options[o]);
+                        else
+                            printf(" %s=%d", socket_options[o], results->socket_policy[c][o]);
+                    }
+                    putchar('\n');
+                }
+            } else if (res->method == 6) {
+                struct endpoint_stats * results = (struct endpoint_stats *)(buffer + sizeof(struct response_header));
+                int count = res->length / sizeof(struct endpoint_stats);
+                if (count == 0)
+                    printf("Sin direcciones registradas\n");
+                for (int e = 0; e < count; e++) {
+                    char address[INET6_ADDRSTRLEN];
+                    inet_ntop(results[e].family == 6 ? AF_INET6 : AF_INET, results[e].address, address, sizeof(address));
+                    cyan();
+                    printf(results[e].family == 6 ? "- [%s]:%d" : "- %s:%d", address, results[e].port);
+                    reset();
+                    printf(" conexión %u ms, primer byte %u ms, %u conexiones, %u fallidas%s\n",
+                        results[e].connect_ms, results[e].first_byte_ms, results[e].connects, results[e].failures,
+                        results[e].flags & ENDPOINT_EJECTED ? " (expulsada)" : results[e].flags & ENDPOINT_UNREACHABLE ? " (inalcanzable)" : "");
+                }
+            } else if (res->method == 7) {
+                static const char * breaker_states[] = { "cerrado", "abierto", "semiabierto" };
+                struct origin_stats * results = (struct origin_stats *)(buffer + sizeof(struct response_header));
+                int count = res->length / sizeof(struct origin_stats);
+                if (count == 0)
+                    printf("Sin servidores registrados\n");
+                for (int o = 0; o < count; o++) {
+                    results[o].host[ORIGIN_STATS_HOST - 1] = '\0';
+                    cyan();
+                    printf("- %s:%d", results[o].host, results[o].port);
+                    reset();
+                    printf(" circuito %s, %u conexiones en uso, %u en espera, %u fallas seguidas, abierto %u veces, %u pedidos rechazados\n",
+                        breaker_states[results[o].breaker % 3], results[o].active, results[o].waiting, results[o].failures,
+                        results[o].trips, results[o].fast_failed);
+                }
             } else {
                 long value;
                 memcpy(&value, buffer + sizeof(struct response_header), sizeof(long));
@@ -268,6 +350,19 @@ int parse_command(char * command, struct request_header * req, char * buff) {
     char * token = strtok(command, " ");
     if (token == NULL)
         return -1;
+
+    if (strcmp(token, set_methods[5]) == 0) {
+        if (parse_socket_option(req) < 0)
+            return -1;
+        req->version = CURRENT_VERSION;
+        req->id = 0;
+        strcpy((char *)req->pass, pass);
+        req->type = SET;
+        req->method = 5;
+        req->length = sizeof(req->ft);
+        memcpy(buff, req, sizeof(struct request_header));
+        return 1;
+    }
         
     char * num = strtok(NULL, " ");
 
@@ -327,6 +422,41 @@ int parse_command(char * command, struct request_header * req, char * buff) {
 
 }
 
+int find_name(char names[][MAX_STRING], int count, const char * name) {
+    for (int i = 0; i < count; i++) {
+        if (name != NULL && strcmp(name, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// setSocketOption <clase> <opcion> <valor>, con el resto del comando ya en strtok
+int parse_socket_option(struct request_header * req) {
+    int socket_class = find_name(socket_classes, SOCKET_CLASS_COUNT, strtok(NULL, " "));
+    if (socket_class < 0) {
+        print_error("La clase debe ser listener, client, target o doh");
+        return -1;
+    }
+
+    int option = find_name(socket_options, SOCKOPT_COUNT, strtok(NULL, " "));
+    if (option < 0) {
+        print_error("Opción de socket desconocida, ver help");
+        return -1;
+    }
+
+    char * num = strtok(NULL, " ");
+    int value;
+    if (num == NULL || !is_number(num) || sscanf(num, "%d", &value) != 1 || value < SOCKOPT_UNSET) {
+        print_error("El valor debe ser un número positivo, o -1 para usar el valor por defecto");
+        return -1;
+    }
+
+    req->ft.socket_option.socket_class = socket_class;
+    req->ft.socket_option.option = option;
+    req->ft.socket_option.value = value;
+    return 0;
+}
+
 void print_error(char * message) {
     red();
     printf("Error: %s\n", message);
@@ -360,6 +490,10 @@ void print_help() {
            "                               recividas por el proxy.\n\n"
            "\033[0;36m> allStats    \033[0m                 retorna todos los valores estadísticos.\n\n"
            "\033[0;36m> getConfigurations \033[0m           retorna la configuración actual del proxy.\n\n"
+           "\033[0;36m> endpointStats \033[0m               retorna la latencia promedio de conexión y de\n"
+           "                               primer byte de cada dirección de destino usada.\n\n"
+           "\033[0;36m> originStats \033[0m                 retorna el estado del circuito y las conexiones\n"
+           "                               en uso de cada servidor destino.\n\n"
            "\033[0;36m> setMaxClients <valor> \033[0m       recive un valor númerico menor a 1000 utilizado\n"
            "                               para configurar la máxima cantidad de clientes\n"
            "                               concurrentes que puede tener el proxy.\n\n"
@@ -374,6 +508,12 @@ void print_help() {
            "                               habilitar/deshabilitar la inspección de credenciales.\n\n"
            "\033[0;36m> setLoggingLevel <valor> \033[0m     recive un valor númerico cuyo valor puede ser [0, 1, 2, 3],\n"
            "                               donde DEBUG = 0, INFO = 1, ERROR = 2, FATAL = 3\n\n"
+           "\033[0;36m> setSocketOption <clase> <opcion> <valor> \033[0m\n"
+           "                               configura una opción TCP para los sockets que se\n"
+           "                               creen de ahora en más. Las clases son listener,\n"
+           "                               client, target y doh. Las opciones son nodelay,\n"
+           "                               deferAccept, notsentLowat, sndbuf, rcvbuf, keepalive\n"
+           "                               y quickack. El valor -1 deja el default del kernel.\n\n"
            "\033[0;32mConsultar el RFC 20216 para más información\033[0m\n");
 }
 
@@ -12,6 +12,10 @@
 #include <http_response_parser.h>
 #include <proxy_stm.h>
 #include <udp_utils.h>
+#include <proxy_templates.h>
+#include <socket_options.h>
+#include <time.h>
+#include <backends.h>
 
 void handle_creates(struct selector_key *key);
 
@@ -34,6 +38,20 @@ int main(int argc, char **argv) {
 
     proxy_conf.proxyArgs = args;
 
+    if (args.connect_timeout > 0)
+        proxy_conf.connectTimeout = args.connect_timeout;
+
+    if (args.origin_max_conns > 0)
+        proxy_conf.originMaxConns = args.origin_max_conns;
+
+    if (args.origin_queue_timeout > 0)
+        proxy_conf.originQueueTimeout = args.origin_queue_timeout;
+
+    if (backends_init(args.upstreams, args.upstream_count) < 0) {
+        fprintf(stderr, "Upstreams must be given as host:port\n");
+        exit(1);
+    }
+
     close(0);
 
     log(INFO, "Welcome to HTTP Proxy!");
@@ -52,6 +70,14 @@ int main(int argc, char **argv) {
 
     initialize_statistics();
 
+    // Address ordering explores at random
+
+    srand(time(NULL));
+
+    // Build canned responses and resolve the Via token before serving
+
+    init_templates();
+
     // Start accepting connections
 
     int master_sockets[MASTER_SOCKET_SIZE] = {-1, -1};
@@ -164,6 +190,8 @@ void handle_creates(struct selector_key *key) {
     }
     add_connection();
 
+    apply_socket_policy(clientSocket, SOCKET_CLASS_CLIENT);
+
     key->item->client_socket = clientSocket;
     key->item->last_activity = time(NULL);
     key->item->client=address;
@@ -176,10 +204,26 @@ void handle_creates(struct selector_key *key) {
         item_kill(key->s, key->item);
     }
 
-    // Initialize connection buffers, state machine and HTTP parser
+    // Initialize connection buffers, state machine and HTTP parser. The
+    // pipelined request stash is only allocated once something is stashed.
+
+    uint8_t * read_data = malloc(CONN_BUFFER);
+    uint8_t * write_data = malloc(CONN_BUFFER);
+
+    if (read_data == NULL || write_data == NULL) {
+        log(ERROR, "Can't allocate buffers for client %d", clientSocket);
+        free(read_data);
+        free(write_data);
+        buffer_init(&(key->item->read_buffer), 0, NULL);
+        buffer_init(&(key->item->write_buffer), 0, NULL);
+        item_kill(key->s, key->item);
+        remove_conection();
+        return;
+    }
 
-    buffer_init(&(key->item->read_buffer), CONN_BUFFER, malloc(CONN_BUFFER));
-    buffer_init(&(key->item->write_buffer), CONN_BUFFER, malloc(CONN_BUFFER));
+    buffer_init(&(key->item->read_buffer), CONN_BUFFER, read_data);
+    buffer_init(&(key->item->write_buffer), CONN_BUFFER, write_data);
+    buffer_init(&(key->item->pipeline_buffer), 0, NULL);
 
     memcpy(&(key->item->stm), &proto_stm, sizeof(proto_stm));
     stm_init(&(key->item->stm));
@@ -188,6 +232,18 @@ void handle_creates(struct selector_key *key) {
     http_response_parser_init(&(key->item->res_parser));
     pop3_parser_init(&(key->item->pop3_parser));
 
+    splice_pipe_init(&(key->item->client_pipe));
+    splice_pipe_init(&(key->item->target_pipe));
+
+    zerocopy_init(&(key->item->client_zc));
+    zerocopy_init(&(key->item->target_zc));
+    key->item->target_fastopen = false;
+    key->item->target_pooled = false;
+    key->item->retried = false;
+    key->item->held_length = 0;
+    key->item->backend = -1;
+    key->item->origin = -1;
+
     // Set initial interests
 
     key->item->client_interest = OP_READ;
@@ -204,5 +260,7 @@ void sigterm_handler(int signal) {
 
 void sigpipe_handler(int signum) {
     printf("Caught signal SIGPIPE %d\n",signum);
+    // signal() handlers are one-shot here, rearm it for the next write
+    signal(SIGPIPE, sigpipe_handler);
 }
 
@@ -7,6 +7,10 @@
 #include <monitor.h>
 #include <statistics.h>
 #include <selector.h>
+#include <socket_options.h>
+#include <endpoints.h>
+#include <origins.h>
+#include <netinet/in.h>
 
 #define BUFFER_SIZE 1024
 
@@ -45,6 +49,11 @@ union format {
     short time;
     unsigned char boolean :1;
     unsigned char level :2;
+    struct {
+        unsigned char socket_class;
+        unsigned char option;
+        int value;
+    } socket_option;
 };
 
 struct method5 {
@@ -53,8 +62,44 @@ struct method5 {
     unsigned short max_clients :10;
     unsigned char disectors_enabled :1;
     unsigned char logLevel :2;
+    int socket_policy[SOCKET_CLASS_COUNT][SOCKOPT_COUNT];
 };
 
+// Bits de endpoint_stats.flags
+#define ENDPOINT_UNREACHABLE 0x1
+#define ENDPOINT_EJECTED     0x2
+
+struct endpoint_stats {
+    unsigned char family;       // 4 o 6
+    unsigned char flags;
+    unsigned short port;
+    unsigned char address[16];
+    unsigned int connect_ms;
+    unsigned int first_byte_ms;
+    unsigned int connects;
+    unsigned int failures;
+};
+
+// Las direcciones que entran en un datagrama, las usadas más recientemente
+#define MAX_ENDPOINT_STATS ((BUFFER_SIZE - sizeof(struct response_header)) / sizeof(struct endpoint_stats))
+
+// Los nombres más largos se truncan
+#define ORIGIN_STATS_HOST 48
+
+struct origin_stats {
+    unsigned char breaker;      // 0 cerrado, 1 abierto, 2 semiabierto
+    unsigned char reserved;
+    unsigned short port;
+    unsigned int active;
+    unsigned int waiting;
+    unsigned int failures;      // fallas seguidas
+    unsigned int trips;
+    unsigned int fast_failed;
+    char host[ORIGIN_STATS_HOST];
+};
+
+#define MAX_ORIGIN_STATS ((BUFFER_SIZE - sizeof(struct response_header)) / sizeof(struct origin_stats))
+
 struct method4 {
     unsigned long total_connections;
     unsigned long current_connections;
@@ -64,6 +109,10 @@ struct method4 {
 
 int process_request(char * body, struct request_header * request_header, int udp_socket);
 
+int fill_endpoint_stats(struct endpoint_stats * stats);
+
+int fill_origin_stats(struct origin_stats * stats);
+
 void send_retrieve_response(struct request_header * request_header, int body_length, int udp_socket);
 
 void send_success(struct request_header * request_header, int udp_socket);
@@ -82,7 +131,32 @@ Config proxy_conf = {
     .viaProxyName = "",
     .clientBlacklist = "",
     .targetBlacklist = "",
-    .logLevel = INFO
+    .logLevel = INFO,
+
+    // Heads and small bodies go out in one write, Nagle would only delay the tail
+    .socketPolicy = {
+        [SOCKET_CLASS_LISTENER] = SOCKET_POLICY(SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET),
+        [SOCKET_CLASS_CLIENT]   = SOCKET_POLICY(1, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET),
+        [SOCKET_CLASS_TARGET]   = SOCKET_POLICY(1, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET),
+        [SOCKET_CLASS_DOH]      = SOCKET_POLICY(1, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET, SOCKOPT_UNSET),
+    },
+
+    .upstreamPoolSize = 64,
+    .upstreamPoolPerOrigin = 8,
+    .upstreamIdleTimeout = 30,
+
+    .connectTimeout = 3000,
+    .unreachableTtl = 10,
+
+    .originMaxConns = 0,
+    .originQueueTimeout = 5000,
+
+    .breakerFailures = 5,
+    .breakerErrorRate = 50,
+    .breakerCooldown = 10,
+
+    .hedgePercentile = 95,
+    .hedgeMaxRate = 5,
 };
 
 int validate_client(char * pass) {
@@ -176,9 +250,16 @@ int process_request(char * body, struct request_header * req, int udp_socket) {
                 method5.frequency = proxy_conf.statisticsFrequency;
                 method5.disectors_enabled = proxy_conf.disectorsEnabled & 0x1;
                 method5.logLevel = proxy_conf.logLevel & 0x3;
+                memcpy(method5.socket_policy, proxy_conf.socketPolicy, sizeof(method5.socket_policy));
                 length = sizeof(struct method5);
                 memcpy(res_buffer + sizeof(struct response_header), &method5, length);
                 break;
+            case 6:
+                length = fill_endpoint_stats((struct endpoint_stats *) (res_buffer + sizeof(struct response_header)));
+                break;
+            case 7:
+                length = fill_origin_stats((struct origin_stats *) (res_buffer + sizeof(struct response_header)));
+                break;
             default:
                 return REQ_BAD_REQUEST;
         }
@@ -219,6 +300,13 @@ int process_request(char * body, struct request_header * req, int udp_socket) {
             case 4:
                 proxy_conf.logLevel = ft->level;
                 break;
+            case 5:
+                if (req->length < sizeof(ft->socket_option) || set_socket_policy(ft->socket_option.socket_class,
+                        ft->socket_option.option, ft->socket_option.value) < 0) {
+                    free(ft);
+                    return REQ_BAD_REQUEST;
+                }
+                break;
             default:
                 free(ft);
                 return REQ_BAD_REQUEST;
@@ -229,6 +317,94 @@ int process_request(char * body, struct request_header * req, int udp_socket) {
     return REQ_SUCCESS;
 }
 
+static int more_recent(const void * a, const void * b) {
+    time_t ta = (*(const endpoint * const *) a)->last_used;
+    time_t tb = (*(const endpoint * const *) b)->last_used;
+    return (tb > ta) - (tb < ta);
+}
+
+int fill_endpoint_stats(struct endpoint_stats * stats) {
+    const endpoint * used[ENDPOINT_TABLE_SIZE];
+    size_t count = 0;
+
+    for (size_t i = 0; i < ENDPOINT_TABLE_SIZE; i++) {
+        const endpoint * e = endpoint_at(i);
+        if (e != NULL)
+            used[count++] = e;
+    }
+
+    qsort(used, count, sizeof(used[0]), more_recent);
+    if (count > MAX_ENDPOINT_STATS)
+        count = MAX_ENDPOINT_STATS;
+
+    for (size_t i = 0; i < count; i++) {
+        const endpoint * e = used[i];
+        struct endpoint_stats * s = &stats[i];
+
+        if (e->addr.ss_family == AF_INET) {
+            const struct sockaddr_in * sin = (const struct sockaddr_in *) &e->addr;
+            s->family = 4;
+            s->port = ntohs(sin->sin_port);
+            memcpy(s->address, &sin->sin_addr, 4);
+        } else {
+            const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *) &e->addr;
+            s->family = 6;
+            s->port = ntohs(sin6->sin6_port);
+            memcpy(s->address, &sin6->sin6_addr, 16);
+        }
+
+        s->flags = 0;
+        if (e->unreachable_until > time(NULL))
+            s->flags |= ENDPOINT_UNREACHABLE;
+        if (e->ejected_until > time(NULL))
+            s->flags |= ENDPOINT_EJECTED;
+        s->connect_ms = (unsigned int) (e->connect_ms + 0.5);
+        s->first_byte_ms = (unsigned int) (e->first_byte_ms + 0.5);
+        s->connects = e->connects;
+        s->failures = e->connect_failures;
+    }
+
+    return count * sizeof(struct endpoint_stats);
+}
+
+static int more_recent_origin(const void * a, const void * b) {
+    time_t ta = (*(const origin * const *) a)->last_used;
+    time_t tb = (*(const origin * const *) b)->last_used;
+    return (tb > ta) - (tb < ta);
+}
+
+int fill_origin_stats(struct origin_stats * stats) {
+    const origin * used[ORIGIN_TABLE_SIZE];
+    size_t count = 0;
+
+    for (size_t i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        const origin * o = origin_at(i);
+        if (o != NULL)
+            used[count++] = o;
+    }
+
+    qsort(used, count, sizeof(used[0]), more_recent_origin);
+    if (count > MAX_ORIGIN_STATS)
+        count = MAX_ORIGIN_STATS;
+
+    for (size_t i = 0; i < count; i++) {
+        const origin * o = used[i];
+        struct origin_stats * s = &stats[i];
+
+        memset(s, 0, sizeof(*s));
+        s->breaker = o->breaker;
+        s->port = o->port;
+        s->active = o->active;
+        s->waiting = o->queue_length;
+        s->failures = o->consecutive_failures;
+        s->trips = o->trips;
+        s->fast_failed = o->fast_failed;
+        strncpy(s->host, o->host, ORIGIN_STATS_HOST - 1);
+    }
+
+    return count * sizeof(struct origin_stats);
+}
+
 void send_error(int status, int udp_socket) {
     if (status == REQ_BAD_REQUEST) {
         struct response_header res_header = {
@@ -1,6 +1,7 @@
 #include <logger.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <buffer.h>
 #include <stm.h>
 #include <tcp_utils.h>
@@ -17,6 +18,14 @@
 #include <netinet/in.h>
 #include <doh_client.h>
 #include <arpa/inet.h>
+#include <proxy_templates.h>
+#include <socket_options.h>
+#include <origins.h>
+#include <upstream_pool.h>
+#include <endpoints.h>
+#include <backends.h>
+#include <hedging.h>
+#include <time.h>
 
 // Many of the state transition handlers don't use the state param so we are ignoring this warning
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -36,11 +45,32 @@ enum proxy_state {
      *
      * Transitions:
      *   - REQUEST_READ         While request message is not over
-     *   - REQUEST_CONNECT      When request message is over
+     *   - ORIGIN_WAIT          When request message is over and the origin is at its cap
+     *   - DOH_CONNECT          When request message is over and the target must be resolved
+     *   - TRY_IPS              When request message is over and the target is an IP
+     *   - REQUEST_FORWARD      When request message is over and a pooled connection was taken
      *   - ERROR_STATE          Parsing/IO error
     */
     REQUEST_READ,
 
+    /*
+     * Waits in the origin queue until one of its connections is given
+     * back, for up to proxy_conf.originQueueTimeout ms. The timer fires
+     * early when the request is woken up.
+     *
+     * Interests:
+     *   - Client: OP_NOOP
+     *   - Target: OP_NOOP
+     *
+     * Transitions:
+     *   - ORIGIN_WAIT          While the origin has no connection for it
+     *   - DOH_CONNECT          Admitted and the target must be resolved
+     *   - TRY_IPS              Admitted and the target is an IP
+     *   - REQUEST_FORWARD      Admitted and a pooled connection was taken
+     *   - ERROR_STATE          The wait is over, 503
+    */
+    ORIGIN_WAIT,
+
     /*
      * Waits for the connection to DoH server to complete
      *
@@ -49,7 +79,7 @@ enum proxy_state {
      *   - Target: OP_WRITE
      *
      * Transitions:
-     *   - RESPONSE_DOH         Connection completed and request sent
+     *   - RESPONSE_DOH         Connection completed and AAAA and A queries sent
      *   - ERROR_STATE          IO error
     */
     DOH_CONNECT,
@@ -62,56 +92,79 @@ enum proxy_state {
      *   - Target (DoH): OP_READ
      *
      * Transitions:
-     *   - RESPONSE_DOH         While response message is not over
-     *   - TRY_IPS              When request message is over
-     *   - ERROR_STATE          Parsing/IO error
+     *   - RESPONSE_DOH         While either response is not over
+     *   - TRY_IPS              When both responses are over, or the server stopped
+     *                          after one, or the second is late past RESOLUTION_DELAY
+     *   - ERROR_STATE          Parsing/IO error or no addresses resolved
     */
     RESPONSE_DOH,
 
     /*
-     * Tries to connnect to a resolved target IP
+     * Races connects to the resolved target IPs (Happy Eyeballs, RFC 8305).
+     * A new attempt starts every CONNECTION_ATTEMPT_DELAY ms, or right away
+     * when one fails, and the first to complete becomes the target. Each
+     * attempt is given up after proxy_conf.connectTimeout ms, and addresses
+     * that failed recently are tried last.
      *
      * Interests:
      *   - Client: OP_NOOP
-     *   - Target: OP_NOOP
+     *   - Target (attempts): OP_WRITE
      *
      * Transitions:
-     *   - REQUEST_CONNECT      Initialized a connection to a target IP.
-     *   - RESPONSE_DOH         No IPv6s left to try. Sent IPv4 DoH request.
-     *   - ERROR_STATE          No IPv4s left to try. Game over.
+     *   - TRY_IPS              While no attempt completed
+     *   - REQUEST_FORWARD      An attempt completed, request processed
+     *   - CONNECT_RESPONSE     An attempt completed for a CONNECT request
+     *   - ERROR_STATE          Every address failed. Game over.
     */
     TRY_IPS,
 
     /*
-     * Waits for the connection to target to complete
+     * Forwards client HTTP request to target
      *
      * Interests:
      *   - Client: OP_NOOP
      *   - Target: OP_WRITE
      *
      * Transitions:
-     *   - REQUEST_FORWARD      When connection is completed
+     *   - REQUEST_FORWARD      While request message is not over
+     *   - RESPONSE_READ        When request message is over
+     *   - EXPECT_CONTINUE      When the body waits on Expect: 100-continue
+     *   - REQ_BODY_RELAY       When the body is not over
      *   - ERROR_STATE          IO error
     */
-    REQUEST_CONNECT,
+    REQUEST_FORWARD,
 
     /*
-     * Forwards client HTTP request to target
+     * Waits for whichever comes first after a head with Expect: the
+     * target's interim or final response, or the client giving up on
+     * waiting and sending the body anyway
      *
      * Interests:
-     *   - Client: OP_NOOP
-     *   - Target: OP_WRITE
+     *   - Client: OP_READ
+     *   - Target: OP_READ
      *
      * Transitions:
-     *   - REQUEST_FORWARD      While request message is not over
-     *   - RESPONSE_READ        When request message is over
+     *   - REQ_BODY_RELAY       When the client sends body bytes
+     *   - RESPONSE_READ        When the target starts answering
+     *   - RESPONSE_FORWARD     When the target answered at once
      *   - ERROR_STATE          IO error
     */
-    REQUEST_FORWARD,
-
-    REQ_BODY_READ,
+    EXPECT_CONTINUE,
 
-    REQ_BODY_FORWARD,
+    /*
+     * Relays the rest of the request body, reading from the client while
+     * earlier bytes are still being written to the target
+     *
+     * Interests:
+     *   - Client: OP_READ while the body is not over and there is room
+     *   - Target: OP_WRITE while there are scanned bytes to forward
+     *
+     * Transitions:
+     *   - REQ_BODY_RELAY       While request body is not over
+     *   - RESPONSE_READ        When request body is over
+     *   - ERROR_STATE          Malformed body
+    */
+    REQ_BODY_RELAY,
 
     /*
      * Recieves an HTTP request from target
@@ -137,13 +190,26 @@ enum proxy_state {
      * Transitions:
      *   - RESPONSE_FORWARD     While response message is not over
      *   - REQUEST_READ         When response message is over
+     *   - RESPONSE_READ        After an interim 1xx response
+     *   - REQ_BODY_RELAY       After a 100 Continue, while the body is owed
+     *   - END                  When the body the client owes was never sent
      *   - ERROR_STATE          IO error
     */
     RESPONSE_FORWARD,
 
-    RES_BODY_READ,
-
-    RES_BODY_FORWARD,
+    /*
+     * Relays the rest of the response body, reading from the target while
+     * earlier bytes are still being written to the client
+     *
+     * Interests:
+     *   - Client: OP_WRITE while there are scanned bytes to forward
+     *   - Target: OP_READ while the body is not over and there is room
+     *
+     * Transitions:
+     *   - RES_BODY_RELAY       While response body is not over
+     *   - REQUEST_READ         When response body is over
+    */
+    RES_BODY_RELAY,
 
     /*
      * Sends CONNECT response message to client
@@ -174,7 +240,7 @@ enum proxy_state {
      * Sends Clients last messages and gracefully shuts down
      *
      * Interests:
-     *   - Client: OP_READ
+     *   - Client: OP_NOOP
      *   - Target: OP_WRITE
      *
      * Transitions:
@@ -185,11 +251,12 @@ enum proxy_state {
     CLIENT_CLOSE_CONNECTION,
 
     /*
-     * Sends Target last messages and gracefully shuts down
+     * Sends Target last messages and gracefully shuts down, this is also
+     * how close-delimited response bodies end
      *
      * Interests:
      *   - Client: OP_WRITE
-     *   - Target: OP_READ 
+     *   - Target: OP_NOOP
      *
      * Transitions:
      *  
@@ -207,11 +274,27 @@ enum proxy_state {
 
 /* -------------------------------------- HANDLERS PROTOTYPES -------------------------------------- */
 
+/* ------------------------------------------------------------
+  Restores pipelined request bytes and processes them if any.
+------------------------------------------------------------ */
+static unsigned request_read_arrival(const unsigned int state, struct selector_key *key);
+
 /* ------------------------------------------------------------
   Reads HTTP requests message part from client.
 ------------------------------------------------------------ */
 static unsigned request_read_ready(unsigned int state, struct selector_key *key);
 
+/* ------------------------------------------------------------
+  Arms the timer for the end of the wait in the origin queue.
+------------------------------------------------------------ */
+static unsigned origin_wait_arrival(const unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Takes the origin connection if it is the request's turn, or
+  answers 503 once the wait is over.
+------------------------------------------------------------ */
+static unsigned origin_wait_timeout(unsigned int state, struct selector_key *key);
+
 /* ------------------------------------------------------------
   Handles the completion of connection to DoH.
 ------------------------------------------------------------ */
@@ -223,14 +306,26 @@ static unsigned doh_connect_write_ready(unsigned int state, struct selector_key
 static unsigned response_doh_read_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Tries to connect to a target resolved IP.
+  Stops waiting for the answer still pending once the first one
+  brought addresses, and tries those.
+------------------------------------------------------------ */
+static unsigned response_doh_timeout(unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Starts racing connects to the target resolved IPs.
 ------------------------------------------------------------ */
 static unsigned try_ips_arrival(const unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Handles the completion of connection to target.
+  Handles the completion of a racing connect.
 ------------------------------------------------------------ */
-static unsigned request_connect_write_ready(unsigned int state, struct selector_key *key);
+static unsigned try_ips_write_ready(unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Gives up the racing connects that ran out of time, and starts
+  the next one once the attempt delay is over.
+------------------------------------------------------------ */
+static unsigned try_ips_timeout(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
   Forwards HTTP requests message part to target.
@@ -238,40 +333,87 @@ static unsigned request_connect_write_ready(unsigned int state, struct selector_
 static unsigned request_forward_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Reads HTTP requests body part from client.
+  Moves on to the body relay, or reads the target's answer to Expect.
+------------------------------------------------------------ */
+static unsigned expect_continue_read_ready(unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Reads HTTP requests body part from client into the relay queue.
 ------------------------------------------------------------ */
 static unsigned req_body_read_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Forwards HTTP requests body part to target.
+  Forwards queued HTTP requests body part to target.
 ------------------------------------------------------------ */
 static unsigned req_body_forward_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Reads HTTP responses message part from target.
+  Moves on once the request body is over and its zero-copy sends
+  were released, otherwise refreshes relay interests.
+------------------------------------------------------------ */
+static unsigned req_body_relay_next(struct selector_key *key);
+
+
+/* ------------------------------------------------------------
+  Arms the hedge of a GET that may go to another address, to
+  fire once its answer is later than the address usually is.
+------------------------------------------------------------ */
+static unsigned response_read_arrival(const unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Reads HTTP responses message part from target, or settles the
+  race between the target and a hedge.
 ------------------------------------------------------------ */
 static unsigned response_read_ready(unsigned int state, struct selector_key *key);
 
+/* ------------------------------------------------------------
+  Calls off a hedge still running when the response is over
+  or failed.
+------------------------------------------------------------ */
+static void response_read_departure(const unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Sends the request again to the hedge address, if the budget
+  allows.
+------------------------------------------------------------ */
+static unsigned hedge_timeout(unsigned int state, struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Finishes the hedge connect and sends the request on it.
+------------------------------------------------------------ */
+static unsigned hedge_write_ready(unsigned int state, struct selector_key *key);
+
 /* ------------------------------------------------------------
   Forwards HTTP responses message part to client.
 ------------------------------------------------------------ */
 static unsigned response_forward_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Reads HTTP responses body part from target.
+  Reads HTTP responses body part from target into the relay queue.
 ------------------------------------------------------------ */
 static unsigned res_body_read_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Forwards HTTP responses body part to client.
+  Forwards queued HTTP responses body part to client.
 ------------------------------------------------------------ */
 static unsigned res_body_forward_ready(unsigned int state, struct selector_key *key);
 
+/* ------------------------------------------------------------
+  Moves on once the response body is over and its zero-copy sends
+  were released, otherwise refreshes relay interests.
+------------------------------------------------------------ */
+static unsigned res_body_relay_next(struct selector_key *key);
+
 /* ------------------------------------------------------------
   Sends connection response to client.
 ------------------------------------------------------------ */
 static unsigned connect_response_ready(unsigned int state, struct selector_key *key);
 
+/* ------------------------------------------------------------
+  Starts forwarding client bytes that arrived before the tunnel.
+------------------------------------------------------------ */
+static unsigned tcp_tunnel_arrival(const unsigned int state, struct selector_key *key);
+
 /* ------------------------------------------------------------
   Reads TCP traffic from client or target. 
 ------------------------------------------------------------ */
@@ -283,12 +425,29 @@ static unsigned tcp_tunnel_read_ready(unsigned int state, struct selector_key *k
 static unsigned tcp_tunnel_forward_ready(unsigned int state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Sends last messages from client to target then closes connection
+  Reclaims tunnel buffers once their zero-copy sends were released.
+------------------------------------------------------------ */
+static unsigned tcp_tunnel_release_ready(struct selector_key *key);
+
+/* ------------------------------------------------------------
+  Splices active socket bytes into the pipe headed to its peer.
+------------------------------------------------------------ */
+static unsigned tcp_tunnel_splice_in(struct selector_key *key, splice_pipe * pipe);
+
+/* ------------------------------------------------------------
+  Splices pending pipe bytes into the active socket.
+------------------------------------------------------------ */
+static unsigned tcp_tunnel_splice_out(struct selector_key *key, splice_pipe * pipe);
+
+/* ------------------------------------------------------------
+  Sends last messages from client to target then closes connection.
+  Also used as write handler until the last messages are sent.
 ------------------------------------------------------------ */
 static unsigned client_close_connection_arrival(const unsigned state, struct selector_key *key);
 
 /* ------------------------------------------------------------
-  Sends last messages from target to client then closes connection
+  Sends last messages from target to client then closes connection.
+  Also used as write handler until the last messages are sent.
 ------------------------------------------------------------ */
 static unsigned target_close_connection_arrival(const unsigned state, struct selector_key *key);
 
@@ -310,11 +469,220 @@ static unsigned error_write_ready(unsigned int state, struct selector_key *key);
 ------------------------------------------------------------ */
 static unsigned notify_error(struct selector_key *key, int status_code, unsigned next_state);
 
+/* ------------------------------------------------------------
+  Returns a view of the read buffer past the head bytes already parsed.
+  Parsers consume the view, so the raw head stays in place until forwarded.
+------------------------------------------------------------ */
+static buffer head_view(buffer * read_buffer, http_message * message);
+
+/* ------------------------------------------------------------
+  Exchanges the contents of two connection buffers.
+------------------------------------------------------------ */
+static void swap_buffers(buffer * a, buffer * b);
+
+/* ------------------------------------------------------------
+  Copies a prebuilt response into a connection buffer.
+------------------------------------------------------------ */
+static void write_template(buffer * b, const response_template * t);
+
+/* ------------------------------------------------------------
+  Consumes sent bytes from a buffer. While zero-copy sends are in
+  flight the buffer is not compacted, the kernel still reads them.
+------------------------------------------------------------ */
+static void release_sent(buffer * b, zerocopy_state * zc, ssize_t sent);
+
+/* ------------------------------------------------------------
+  Whether tunnel bytes headed to a peer can bypass user space.
+------------------------------------------------------------ */
+static bool tunnel_can_splice(struct item * item, buffer * buffer, splice_pipe * pipe);
+
+/* ------------------------------------------------------------
+  Feeds freshly read tunnel bytes to the POP3 dissector and closes
+  its window once credentials were found or it saw enough traffic.
+------------------------------------------------------------ */
+static void dissect_tunnel_bytes(struct selector_key *key, uint8_t * data, size_t length);
+
+/* ------------------------------------------------------------
+  Whether the rest of a body can be spliced: it is delimited by
+  Content-Length, long enough and nothing is left in the buffer.
+------------------------------------------------------------ */
+static bool body_can_splice(buffer * read_buffer, http_message_parser * parser, http_message * message, splice_pipe * pipe);
+
+/* ------------------------------------------------------------
+  Splices body bytes from a socket into a pipe, never past the
+  end of the body, and counts them as scanned.
+------------------------------------------------------------ */
+static ssize_t body_splice_in(struct selector_key *key, int socket, splice_pipe * pipe, http_message_parser * parser, http_message * message);
+
+/* ------------------------------------------------------------
+  Sets body relay interests: read from the source while the body
+  goes on and the queue has room, write while bytes are queued.
+------------------------------------------------------------ */
+static unsigned body_relay_interests(struct selector_key *key, int source, http_message_parser * parser, splice_pipe * pipe, unsigned state);
+
+/* ------------------------------------------------------------
+  Stashes pipelined request bytes and returns the response read
+  state. Interim responses go back to reading without it.
+------------------------------------------------------------ */
+static unsigned await_response(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Picks what follows a forwarded interim (1xx) response.
+------------------------------------------------------------ */
+static unsigned interim_response_sent(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Prepares for the next request once a final response was sent.
+------------------------------------------------------------ */
+static unsigned response_sent(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Whether the target connection can serve another request once
+  the current response is over.
+------------------------------------------------------------ */
+static bool target_reusable(struct item * item);
+
+/* ------------------------------------------------------------
+  Hands the target connection over to the upstream pool.
+------------------------------------------------------------ */
+static void release_target(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Prepares the request for a target connection that is ready,
+  fresh or pooled, and returns next state.
+------------------------------------------------------------ */
+static unsigned target_connected(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Starts a non blocking connect to the target. With fast open and
+  a cached cookie the handshake waits for the request, which then
+  rides on the SYN. Returns -1 if the connect failed right away.
+------------------------------------------------------------ */
+static int target_connect(struct selector_key * key, int sock, const struct addrinfo * addr);
+
+/* ------------------------------------------------------------
+  Whether a target I/O error is a fast open handshake that failed
+  after connect(2) had already returned.
+------------------------------------------------------------ */
+static bool fastopen_failed(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Counts whether the origin took the fast open SYN data.
+------------------------------------------------------------ */
+static void fastopen_count(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Times the first response byte of the request against the
+  address the target connection goes to.
+------------------------------------------------------------ */
+static void first_byte_count(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Connects to the next resolved address, if any is left, and
+  returns the state the race goes on in.
+------------------------------------------------------------ */
+static unsigned race_step(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Starts a racing connect to the next resolved address. Returns
+  -1 if it was not started, or the proxy's own address on error.
+------------------------------------------------------------ */
+static int start_attempt(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Closes a racing connect and frees its slot.
+------------------------------------------------------------ */
+static void drop_attempt(struct selector_key * key, int slot);
+
+/* ------------------------------------------------------------
+  Arms the connection timer for the next racing connect to start,
+  or the first one in flight to run out of time.
+------------------------------------------------------------ */
+static void arm_race_timer(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Picks an address the origin resolved to other than the target's,
+  and not failing its connects, for a hedge. Returns false if there
+  is none.
+------------------------------------------------------------ */
+static bool pick_hedge_address(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  How long the request may wait for its first byte before it is
+  hedged, or -1 if it can't be: hedging off, not a GET without a
+  body, too few first bytes timed on the target to tell, or no
+  other address to go to.
+------------------------------------------------------------ */
+static long hedge_delay(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Gives back the origin connection taken for the hedge.
+------------------------------------------------------------ */
+static void give_back_hedge(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Closes the hedge, if any, counting it as lost or failed.
+------------------------------------------------------------ */
+static void drop_hedge(struct selector_key * key, bool failed);
+
+/* ------------------------------------------------------------
+  Makes the hedge the target, closing the late one.
+------------------------------------------------------------ */
+static void hedge_wins(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Takes the ejected addresses out of the list left to try.
+------------------------------------------------------------ */
+static void leave_out_ejected(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Moves the addresses that failed a connect recently to the end
+  of the list left to try.
+------------------------------------------------------------ */
+static void defer_unreachable(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Sorts the addresses left to try by their observed latency, the
+  ones never measured first. Now and then the resolver's order is
+  kept instead, so averages of slower addresses stay fresh.
+------------------------------------------------------------ */
+static void order_by_latency(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Monotonic clock in milliseconds.
+------------------------------------------------------------ */
+static long long now_ms(void);
+
 /* ------------------------------------------------------------
   Processes an HTTP request and returns next state.
 ------------------------------------------------------------ */
 static unsigned process_request(struct selector_key * key);
 
+/* ------------------------------------------------------------
+  Gets a connection to the request target, from the pool or by
+  resolving it, and returns next state.
+------------------------------------------------------------ */
+static unsigned open_target(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Whether the request may be resent if its pooled connection
+  turns out stale: idempotent, not resent yet and with its whole
+  body in the buffer.
+------------------------------------------------------------ */
+static bool retryable(struct item * item);
+
+/* ------------------------------------------------------------
+  Drops the stale target and processes the request again from
+  its raw bytes, on a fresh connection.
+------------------------------------------------------------ */
+static unsigned retry_request(struct selector_key * key);
+
+/* ------------------------------------------------------------
+  Gives back the origin connection the request holds, or its
+  place in the queue, waking up whoever is next.
+------------------------------------------------------------ */
+static void origin_done(struct selector_key * key);
+
 /* ------------------------------------------------------------
   Processes request headers according to RFC 7230 specs.
 ------------------------------------------------------------ */
@@ -343,10 +711,19 @@ static const struct state_definition state_defs[] = {
         .state            = REQUEST_READ,
         .client_interest  = OP_READ,
         .target_interest  = OP_NOOP,
-        .rst_buffer       = READ_BUFFER | WRITE_BUFFER,
+        .rst_buffer       = WRITE_BUFFER,
         .description      = "REQUEST_READ",
+        .on_arrival       = request_read_arrival,
         .on_read_ready    = request_read_ready,
     },
+    {
+        .state            = ORIGIN_WAIT,
+        .client_interest  = OP_NOOP,
+        .target_interest  = OP_NOOP,
+        .description      = "ORIGIN_WAIT",
+        .on_arrival       = origin_wait_arrival,
+        .on_timeout       = origin_wait_timeout,
+    },
     {
         .state            = DOH_CONNECT,
         .client_interest  = OP_NOOP,
@@ -360,20 +737,16 @@ static const struct state_definition state_defs[] = {
         .target_interest  = OP_READ,
         .description      = "RESPONSE_DOH",
         .on_read_ready    = response_doh_read_ready,
+        .on_timeout       = response_doh_timeout,
     },
     {
         .state            = TRY_IPS,
         .client_interest  = OP_NOOP,
-        .target_interest  = OP_NOOP,
+        .target_interest  = OP_WRITE,
         .description      = "TRY_IPS",
         .on_arrival       = try_ips_arrival,
-    },
-    {
-        .state            = REQUEST_CONNECT,
-        .client_interest  = OP_NOOP,
-        .target_interest  = OP_WRITE,
-        .description      = "REQUEST_CONNECT",
-        .on_write_ready   = request_connect_write_ready
+        .on_write_ready   = try_ips_write_ready,
+        .on_timeout       = try_ips_timeout,
     },
     {
         .state            = REQUEST_FORWARD,
@@ -383,26 +756,32 @@ static const struct state_definition state_defs[] = {
         .on_write_ready   = request_forward_ready,
     },
     {
-        .state            = REQ_BODY_READ,
+        .state            = EXPECT_CONTINUE,
         .client_interest  = OP_READ,
-        .target_interest  = OP_NOOP,
-        .description      = "REQ_BODY_READ",
-        .on_read_ready    = req_body_read_ready,
+        .target_interest  = OP_READ,
+        .description      = "EXPECT_CONTINUE",
+        .on_read_ready    = expect_continue_read_ready,
     },
     {
-        .state            = REQ_BODY_FORWARD,
-        .client_interest  = OP_NOOP,
-        .target_interest  = OP_WRITE,
-        .description      = "REQ_BODY_FORWARD",
+        .state            = REQ_BODY_RELAY,
+        .client_interest  = OP_READ,
+        .target_interest  = OP_NOOP,
+        .description      = "REQ_BODY_RELAY",
+        .on_read_ready    = req_body_read_ready,
         .on_write_ready   = req_body_forward_ready,
+        .on_block_ready   = req_body_relay_next,
     },
     {
         .state            = RESPONSE_READ,
         .client_interest  = OP_NOOP,
         .target_interest  = OP_READ,
-        .rst_buffer       = READ_BUFFER | WRITE_BUFFER,
+        .rst_buffer       = WRITE_BUFFER,
         .description      = "RESPONSE_READ",
+        .on_arrival       = response_read_arrival,
         .on_read_ready    = response_read_ready,
+        .on_write_ready   = hedge_write_ready,
+        .on_timeout       = hedge_timeout,
+        .on_departure     = response_read_departure,
     },
     {
         .state            = RESPONSE_FORWARD,
@@ -412,18 +791,13 @@ static const struct state_definition state_defs[] = {
         .on_write_ready   = response_forward_ready,
     },
     {
-        .state            = RES_BODY_READ,
+        .state            = RES_BODY_RELAY,
         .client_interest  = OP_NOOP,
         .target_interest  = OP_READ,
-        .description      = "RES_BODY_READ",
+        .description      = "RES_BODY_RELAY",
         .on_read_ready    = res_body_read_ready,
-    },
-    {
-        .state            = RES_BODY_FORWARD,
-        .client_interest  = OP_WRITE,
-        .target_interest  = OP_NOOP,
-        .description      = "RES_BODY_FORWARD",
         .on_write_ready   = res_body_forward_ready,
+        .on_block_ready   = res_body_relay_next,
     },
     {
         .state            = CONNECT_RESPONSE,
@@ -437,22 +811,26 @@ static const struct state_definition state_defs[] = {
         .client_interest  = OP_READ,
         .target_interest  = OP_READ,
         .description      = "TCP_TUNNEL",
+        .on_arrival       = tcp_tunnel_arrival,
         .on_read_ready    = tcp_tunnel_read_ready,
         .on_write_ready   = tcp_tunnel_forward_ready,
+        .on_block_ready   = tcp_tunnel_release_ready,
     },
     {
         .state            = CLIENT_CLOSE_CONNECTION,
-        .client_interest  = OP_READ,
+        .client_interest  = OP_NOOP,
         .target_interest  = OP_WRITE,
         .description      = "CLIENT_CLOSE_CONNECTION",
-        .on_arrival       = client_close_connection_arrival
+        .on_arrival       = client_close_connection_arrival,
+        .on_write_ready   = client_close_connection_arrival
     },
     {
         .state            = TARGET_CLOSE_CONNECTION,
         .client_interest  = OP_WRITE,
-        .target_interest  = OP_READ,
+        .target_interest  = OP_NOOP,
         .description      = "TARGET_CLOSE_CONNECTION",
-        .on_arrival       = target_close_connection_arrival
+        .on_arrival       = target_close_connection_arrival,
+        .on_write_ready   = target_close_connection_arrival
     },
     {
         .state            = END,
@@ -483,19 +861,57 @@ state_machine proto_stm = {
 #define log_error(_description) \
     log(ERROR, "At state %u: %s", key->item->stm.current->state, _description);
 
-#define remove_array_elem(array, pos, size) \
-    memcpy(array+pos, array+pos+1, size-pos-1)
+#define ADDR_BUFFER_SIZE 1024
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
 
-#define rtrim(s) \
-    char* back = s + strlen(s); \
-    while(isspace(*--back)); \
-    *(back+1) = 0;
+// Tunnel bytes the POP3 dissector looks at before the tunnel switches to splice
+#define POP3_DISSECT_WINDOW (16 * 1024)
 
-#define ADDR_BUFFER_SIZE 1024
+// First byte of a TLS record carrying a handshake message
+#define TLS_HANDSHAKE 0x16
+
+// Shorter body remainders are not worth the extra splice syscalls
+#define SPLICE_BODY_THRESHOLD (16 * 1024)
+
+// Wait for the second DoH answer once the first one arrived, RFC 8305 section 3
+#define RESOLUTION_DELAY 50
+
+// Head start of each racing connect over the next one, RFC 8305 section 5
+#define CONNECTION_ATTEMPT_DELAY 250
+
+// start_attempt found the resolved address to be the proxy itself
+#define ATTEMPT_LOOP -2
+
+// Percentage of races that try addresses in the resolver's order
+#define LATENCY_EXPLORATION 10
+
+// Shortest wait before a request is hedged, below it hedges are mostly noise
+#define HEDGE_MIN_DELAY 10
 
 
 /* -------------------------------------- HANDLERS IMPLEMENTATIONS -------------------------------------- */
 
+static unsigned request_read_arrival(const unsigned int state, struct selector_key *key) {
+
+    // Drop whatever is left from the previous exchange
+
+    buffer_reset(&(key->item->read_buffer));
+
+    // Restore the pipelined request bytes stashed while the response was relayed
+
+    if (! buffer_can_read(&(key->item->pipeline_buffer)))
+        return REQUEST_READ;
+
+    swap_buffers(&(key->item->read_buffer), &(key->item->pipeline_buffer));
+
+    log(DEBUG, "Processing pipelined request from socket %d", key->item->client_socket);
+
+    return process_request(key);
+
+}
+
+
 static unsigned request_read_ready(unsigned int state, struct selector_key *key) {
 
     key->item->last_activity = time(NULL);
@@ -509,7 +925,8 @@ static unsigned request_read_ready(unsigned int state, struct selector_key *key)
 
     size_t space;
     uint8_t * raw_req = buffer_write_ptr(&(key->item->read_buffer), &space);
-    ssize_t readBytes = read(key->item->client_socket, raw_req, space);
+    ssize_t readBytes = read(key->item->client_socket, raw_req, selector_read_quota(key, space));
+    selector_charge_read(key, readBytes);
 
     if(readBytes <= 0) {
         if(readBytes < 0 && errno != EBADF && errno != EPIPE)
@@ -532,6 +949,29 @@ static unsigned request_read_ready(unsigned int state, struct selector_key *key)
 }
 
 
+static unsigned origin_wait_arrival(const unsigned int state, struct selector_key *key) {
+    selector_set_timer(key, (long) (key->item->queued_until - now_ms()));
+    return ORIGIN_WAIT;
+}
+
+
+static unsigned origin_wait_timeout(unsigned int state, struct selector_key *key) {
+    if (origin_admit(key->item->origin, key->item->client_socket))
+        return open_target(key);
+
+    // Woken up behind someone else, or too early
+
+    long long left = key->item->queued_until - now_ms();
+    if (left > 0) {
+        selector_set_timer(key, (long) left);
+        return ORIGIN_WAIT;
+    }
+
+    log(INFO, "No connection to %s:%d freed up in time", key->item->doh.url.hostname, key->item->doh.url.port);
+    return notify_error(key, SERVICE_UNAVAILABLE, REQUEST_READ);
+}
+
+
 static unsigned doh_connect_write_ready(unsigned int state, struct selector_key *key) {
 
     int socket_error;
@@ -547,7 +987,7 @@ static unsigned doh_connect_write_ready(unsigned int state, struct selector_key
         return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
     }
 
-    if (send_doh_request(key, key->item->doh.family) < 0) {
+    if (doh_client_query(key) < 0) {
         return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
     }
     
@@ -558,26 +998,28 @@ static unsigned doh_connect_write_ready(unsigned int state, struct selector_key
 
 static unsigned response_doh_read_ready(unsigned int state, struct selector_key *key) {
 
-    int ans_count = doh_client_read(key);
-    if (ans_count == -1) {
+    unsigned answered = key->item->doh.answered;
+
+    int pending = doh_client_read(key);
+    if (pending == -1) {
 
         log(ERROR, "Failed to read response from DoH server")
+        doh_kill(key);
         return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
 
-    } else if (ans_count == 0) {
-        if (key->item->doh.family == AF_INET) {
-            free(key->item->doh.target_address_list);
-            key->item->doh.family = AF_INET6;
+    } else if (pending > 0) {
 
-            if (send_doh_request(key, key->item->doh.family) < 0)
-                return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
-            return RESPONSE_DOH;
-        } else {
-            doh_kill(key);
-            log(ERROR, "Connecting to target")
+        // A late answer holds the race back for a short while only
 
-            return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
-        }
+        if (answered == 0 && key->item->doh.answers[0] != NULL)
+            selector_set_timer(key, RESOLUTION_DELAY);
+        return RESPONSE_DOH;
+
+    } else if (key->item->doh.target_address_list == NULL) {
+        doh_kill(key);
+        log(ERROR, "No addresses resolved for %s", key->item->req_parser.request.parsed_url.hostname)
+
+        return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
     } else { // Salio todo joya
         return TRY_IPS;
     }
@@ -585,721 +1027,1896 @@ static unsigned response_doh_read_ready(unsigned int state, struct selector_key
 }
 
 
-static unsigned try_ips_arrival(const unsigned int state, struct selector_key *key) {
-    char addrBuffer[ADDR_BUFFER_SIZE];
+static unsigned response_doh_timeout(unsigned int state, struct selector_key *key) {
 
-    struct addrinfo * current_addr = key->item->doh.current_target_addr;
-    struct addrinfo * address_list = key->item->doh.target_address_list;
+    log(DEBUG, "Answer for %s still pending, racing the addresses at hand", key->item->doh.url.hostname)
+    doh_client_settle(key);
 
-    // Try to connect to an address
-    int target_socket = -1;
-    while (current_addr != NULL && target_socket == -1) {
-        if (is_proxy_host(current_addr->ai_addr) && key->item->doh.url.port == proxy_conf.proxyArgs.proxy_port) {
-            log(INFO, "Prevented proxy loop")
-            free(address_list);
-            return notify_error(key, FORBIDDEN, REQUEST_READ);
-        }
+    if (key->item->doh.target_address_list == NULL) {
+        doh_kill(key);
+        return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
+    }
 
-        target_socket = socket(current_addr->ai_family, current_addr->ai_socktype, current_addr->ai_protocol);
+    return TRY_IPS;
+}
 
-        selector_fd_set_nio(target_socket);
 
-        if (target_socket < 0) {
-            sockaddr_print(current_addr->ai_addr, addrBuffer);
-            log(DEBUG, "Can't create target socket on %s", addrBuffer) 
-            current_addr = current_addr->ai_next;
-            continue;
-        }
+static unsigned try_ips_arrival(const unsigned int state, struct selector_key *key) {
 
-        if (connect(target_socket, current_addr->ai_addr, current_addr->ai_addrlen) == -1) {
-            if (errno == EINPROGRESS) {
-                current_addr = current_addr->ai_next;
-                break;
-            } else {
-                current_addr = current_addr->ai_next;
-                continue;
-            }
-        } else {
-            abort(); // Such a thing can't happen!
-        }
-    }
+    // The DoH connection is done, the resolved addresses are kept for the race
 
-    // Release address resource
+    doh_disconnect(key);
 
-    key->item->doh.current_target_addr = current_addr;
+    // The origin keeps all of them, later requests on a pooled connection
+    // hedge to another one
 
-    if (target_socket < 0) {
-        if (key->item->doh.family == AF_INET) {
-            free(address_list);
-            key->item->doh.family = AF_INET6;
-            key->item->target_socket = key->item->doh.server_socket; 
-            // Esto último es provisional, por compatibilidad con los permisos de la STM
+    origin_resolved(key->item->origin, key->item->doh.current_target_addr);
 
-            if (send_doh_request(key, key->item->doh.family) < 0)
-                return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
+    leave_out_ejected(key);
+    order_by_latency(key);
+    defer_unreachable(key);
 
-            return RESPONSE_DOH;
-        } else {
-            doh_kill(key);
-            log(ERROR, "Connecting to target")
-            return notify_error(key, INTERNAL_SERVER_ERROR, REQUEST_READ);
-        }
-    } else {
-        key->item->target_socket = target_socket;
-        return REQUEST_CONNECT;
-    }
+    key->item->next_attempt = now_ms();
+    return race_step(key);
 }
 
 
-static unsigned request_connect_write_ready(unsigned int state, struct selector_key *key) {
+static unsigned try_ips_write_ready(unsigned int state, struct selector_key *key) {
+    int slot = 0;
+    while (slot < SELECTOR_ATTEMPTS && key->item->attempts[slot] != key->active_fd)
+        slot++;
+
+    if (slot == SELECTOR_ATTEMPTS)
+        return TRY_IPS;
 
     int socket_error;
     socklen_t socket_error_len = sizeof(socket_error);
-    int sock_opt = getsockopt(key->item->target_socket, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len);
-    if (sock_opt != 0) {
-        log(ERROR, "Target getsockopt(%d) failed", key->item->target_socket)
-        perror("reason");
-    }
+    if (getsockopt(key->active_fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len) != 0)
+        socket_error = errno;
 
     if (socket_error != 0) {
-        close(key->item->target_socket);
-        if (key->item->doh.server_socket > 0)
-            return TRY_IPS;
-        else
-            return notify_error(key, BAD_GATEWAY, REQUEST_READ);
-    } else { // la conexión funciono
-        memcpy(&(key->item->last_target_url), &(key->item->doh.url), sizeof(struct url));
-        if (key->item->doh.server_socket > 0)
-            doh_kill(key);
-        // int aux = key->item->doh.target_socket;
-        // key->item->target_socket = aux;
-    }
+        char addrBuffer[ADDR_BUFFER_SIZE];
+        sockaddr_print(key->item->attempt_addrs[slot]->ai_addr, addrBuffer);
+        log(INFO, "Connect to %s failed: %s", addrBuffer, strerror(socket_error))
 
-    // Update last connection
+        // Failures don't wait for the attempt delay
 
-    http_request * request = &(key->item->req_parser.request);
+        endpoint_failed(key->item->attempt_addrs[slot]->ai_addr);
+        drop_attempt(key, slot);
+        return race_step(key);
+    }
 
-    // Check for request method
+    endpoint_connected(key->item->attempt_addrs[slot]->ai_addr, now_ms() - key->item->attempt_started[slot]);
 
-    if (request->method == CONNECT) {
+    // The winner becomes the target, the rest of the race is called off
 
-        // The request method is CONNECT, a response shall be sent
-        // and TCP tunnel be established
-        
-        // Write response bytes into write buffer
+    int winner = key->item->attempts[slot];
+    FD_CLR(winner, &key->s->master_w);
+    key->item->attempts[slot] = -1;
 
-        size_t space;
-        char * ptr = (char *) buffer_write_ptr(&(key->item->write_buffer), &space);
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+        if (key->item->attempts[i] >= 0)
+            drop_attempt(key, i);
+    }
 
-        http_response res = { .status = RESPONSE_OK };
-        int written = write_response(&res, ptr, space, false);
+    selector_clear_timer(key);
 
-        buffer_write_adv(&(key->item->write_buffer), written);
+    key->item->target_socket = winner;
+    zerocopy_init(&(key->item->target_zc));
+    doh_kill(key);
 
-        print_Access(inet_ntoa(key->item->client.sin_addr), ntohs(key->item->client.sin_port), key->item->req_parser.request.url, key->item->req_parser.request.method, 200);
+    return target_connected(key);
+}
 
-        // Go to send response state
 
-        return CONNECT_RESPONSE;
+static unsigned try_ips_timeout(unsigned int state, struct selector_key *key) {
+    char addrBuffer[ADDR_BUFFER_SIZE];
+    long long now = now_ms();
+    bool in_flight = false;
 
-    } else { 
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+        if (key->item->attempts[i] < 0)
+            continue;
 
-        // The request method is a traditional one, request shall be proccessed
-        // and then forwarded
-        
-        if (request->method == OPTIONS && strlen(key->item->last_target_url.path) == 0)
-            sprintf(request->url, "*");
+        if (key->item->attempt_started[i] + proxy_conf.connectTimeout > now) {
+            in_flight = true;
+            continue;
+        }
 
-        // Process request headers
+        sockaddr_print(key->item->attempt_addrs[i]->ai_addr, addrBuffer);
+        log(INFO, "Connect to %s timed out", addrBuffer)
 
-        char proxy_hostname[VIA_PROXY_NAME_SIZE] = {0};
-        if(strlen(proxy_conf.viaProxyName) > 0) {
-            strncpy(proxy_hostname, proxy_conf.viaProxyName, VIA_PROXY_NAME_SIZE);
-        } else {
-            get_machine_fqdn(proxy_hostname);
-        }
-        
-        process_request_headers(request, key->item->last_target_url.hostname, proxy_hostname);
+        endpoint_failed(key->item->attempt_addrs[i]->ai_addr);
+        drop_attempt(key, i);
+    }
 
-        // Extract credentials if present
+    // Time ran out for the attempt delay, or for every attempt in flight
 
-        if (proxy_conf.disectorsEnabled)
-            extract_http_credentials(request);
+    if (! in_flight || key->item->next_attempt <= now)
+        return race_step(key);
 
-        // Write processed request bytes into write buffer
+    arm_race_timer(key);
+    return TRY_IPS;
+}
 
-        size_t space;
-        char * ptr = (char *) buffer_write_ptr(&(key->item->write_buffer), &space);
 
-        int written = write_request(request, ptr, space, false);
+static unsigned race_step(struct selector_key * key) {
 
-        buffer_write_adv(&(key->item->write_buffer), written);
+    int started = start_attempt(key);
+    if (started == 0)
+        key->item->next_attempt = now_ms() + CONNECTION_ATTEMPT_DELAY;
 
-        // Go to forward request state
+    if (started == ATTEMPT_LOOP) {
+        log(INFO, "Prevented proxy loop")
+        for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+            if (key->item->attempts[i] >= 0)
+                drop_attempt(key, i);
+        }
+        doh_kill(key);
+        return notify_error(key, FORBIDDEN, REQUEST_READ);
+    }
 
-        return REQUEST_FORWARD;
+    bool in_flight = false;
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++)
+        in_flight |= key->item->attempts[i] >= 0;
 
+    if (! in_flight) {
+        log(ERROR, "Connecting to target %s", key->item->req_parser.request.parsed_url.hostname)
+        doh_kill(key);
+        return notify_error(key, BAD_GATEWAY, REQUEST_READ);
     }
+
+    arm_race_timer(key);
+    return TRY_IPS;
 }
 
 
-static unsigned request_forward_ready(unsigned int state, struct selector_key *key) {
+static void arm_race_timer(struct selector_key * key) {
+    long long when = -1;
 
-    if (! buffer_can_read(&(key->item->write_buffer)))
-        return REQUEST_FORWARD;
+    // The next address gets its turn when the attempt delay is over, if
+    // there is a slot for it
 
-    // Read request bytes from write buffer
+    bool free_slot = false;
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++)
+        free_slot |= key->item->attempts[i] < 0;
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
-    ssize_t sentBytes = write(key->item->target_socket, ptr, size);
+    if (free_slot && key->item->doh.current_target_addr != NULL)
+        when = key->item->next_attempt;
 
-    if (sentBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write request to target");
-        return TARGET_CLOSE_CONNECTION;
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+        long long deadline = key->item->attempt_started[i] + proxy_conf.connectTimeout;
+        if (key->item->attempts[i] >= 0 && (when < 0 || deadline < when))
+            when = deadline;
     }
 
-    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+    if (when < 0) {
+        selector_clear_timer(key);
+        return;
+    }
 
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
+    long long now = now_ms();
+    selector_set_timer(key, when > now ? when - now : 0);
+}
 
-    // Calculate statistics
 
-    add_sent_bytes(sentBytes);
+static bool pick_hedge_address(struct selector_key * key) {
+    struct item * item = key->item;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
 
-    if ((size_t) sentBytes < size)
-        return REQUEST_FORWARD;
- 
-    if (key->item->req_parser.request.message.body_length == 0) {
-        return RESPONSE_READ;
-    } else if (buffer_can_read(&(key->item->read_buffer))) {
-        // Body present, read some bytes
-        size_t remaining;
-        buffer_read_ptr(&(key->item->read_buffer), &remaining);
-        key->item->req_parser.message_parser.current_body_length += remaining;
-        return REQ_BODY_FORWARD;
-    } else {
-        // Body present, didn't read bytes
-        return key->item->req_parser.request.message.hasExpect
-            ? TCP_TUNNEL : REQ_BODY_READ;
+    item->hedge_addr_len = 0;
+
+    if (getpeername(item->target_socket, (struct sockaddr *) &peer, &peer_len) != 0)
+        return false;
+
+    socklen_t length;
+    const struct sockaddr * addr;
+
+    for (size_t i = 0; (addr = origin_address(item->origin, i, &length)) != NULL; i++) {
+        if (sockaddr_equal(addr, (struct sockaddr *) &peer) || endpoint_unreachable(addr))
+            continue;
+
+        memcpy(&(item->hedge_addr), addr, length);
+        item->hedge_addr_len = length;
+        return true;
     }
 
+    return false;
 }
 
 
-static unsigned req_body_read_ready(unsigned int state, struct selector_key *key) {
+static long hedge_delay(struct selector_key * key) {
+    http_request * request = &(key->item->req_parser.request);
 
-    key->item->last_activity = time(NULL);
+    if (! proxy_conf.proxyArgs.hedge || request->method != GET || request->message.framing != FRAMING_NONE)
+        return -1;
 
-    if (! buffer_can_write(&(key->item->read_buffer)))
-        return REQ_BODY_FORWARD;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
 
-    // Read body bytes into read buffer
+    if (getpeername(key->item->target_socket, (struct sockaddr *) &peer, &peer_len) != 0)
+        return -1;
 
-    size_t space;
-    uint8_t * body = buffer_write_ptr(&(key->item->read_buffer), &space);
-    ssize_t readBytes = read(key->item->client_socket, body, space);
+    long delay = endpoint_first_byte_percentile((struct sockaddr *) &peer, proxy_conf.hedgePercentile);
+    if (delay < 0 || ! pick_hedge_address(key))
+        return -1;
 
-    if(readBytes <= 0) {
-        if(readBytes < 0 && errno != EBADF && errno != EPIPE)
-            log_error("Failed to read from client");
-        return CLIENT_CLOSE_CONNECTION;
-    }
+    return delay > HEDGE_MIN_DELAY ? delay : HEDGE_MIN_DELAY;
+}
 
-    buffer_write_adv(&(key->item->read_buffer), readBytes);
 
-    log(DEBUG, "Received %lu body bytes from socket %d", (size_t) readBytes, key->item->client_socket);
+static void give_back_hedge(struct selector_key * key) {
+    int waiting = origin_give_back(key->item->origin);
+    if (waiting > 0)
+        selector_wake(key->s, waiting);
+}
 
-    // Calculate statistics
 
-    add_bytes_recieved(readBytes);
+static void drop_hedge(struct selector_key * key, bool failed) {
+    struct item * item = key->item;
 
-    http_request_parser * rp = &(key->item->req_parser);
+    FD_CLR(item->hedge_socket, &key->s->master_r);
+    FD_CLR(item->hedge_socket, &key->s->master_w);
+    close(item->hedge_socket);
 
-    if ((rp->message_parser.current_body_length += readBytes) < rp->request.message.body_length)
-        return REQ_BODY_READ;
-    else
-        return REQ_BODY_FORWARD;
+    item->hedge_socket = -1;
+    item->hedge_interest = OP_NOOP;
+    give_back_hedge(key);
 
+    if (failed)
+        hedge_failed();
+    else
+        hedge_lost();
 }
 
 
-static unsigned req_body_forward_ready(unsigned int state, struct selector_key *key) {
-
-    // Will read the content directly from read buffer
+static void hedge_wins(struct selector_key * key) {
+    struct item * item = key->item;
+    char addrBuffer[ADDR_BUFFER_SIZE];
 
-    // Read body bytes from read buffer
+    sockaddr_print((struct sockaddr *) &(item->hedge_addr), addrBuffer);
+    log(DEBUG, "Hedge to %s answered first", addrBuffer)
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
-    ssize_t sentBytes = write(key->item->target_socket, ptr, size);
+    // The selector must forget the socket before the item does
 
-    if (sentBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write body to target");
-        return TARGET_CLOSE_CONNECTION;
-    }
+    FD_CLR(item->target_socket, &key->s->master_r);
+    FD_CLR(item->target_socket, &key->s->master_w);
+    close(item->target_socket);
 
-    buffer_read_adv(&(key->item->read_buffer), sentBytes);
+    item->target_socket = item->hedge_socket;
+    item->target_fastopen = false;
+    zerocopy_init(&(item->target_zc));
 
-    log(DEBUG, "Sent %lu body bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
+    // The first byte is timed against the hedge
 
-    // Calculate statistics
+    item->request_ready = item->hedge_ready;
 
-    add_sent_bytes(sentBytes);
+    item->hedge_socket = -1;
+    item->hedge_interest = OP_NOOP;
+    selector_update_fdset(key->s, item);
 
-    http_request_parser * rp = &(key->item->req_parser);
+    // The late connection was the request's, the one the hedge took goes back
 
-    if ((size_t) sentBytes < size)
-        return REQ_BODY_FORWARD;
-    else if ((rp->message_parser.current_body_length) < rp->request.message.body_length)
-        return REQ_BODY_READ;
-    else
-        return RESPONSE_READ;
+    give_back_hedge(key);
 
+    hedge_won();
 }
 
 
-static unsigned response_read_ready(unsigned int state, struct selector_key *key) {
-
-    if (! buffer_can_write(&(key->item->read_buffer))) {
-        log_error("Read buffer limit reached")
-        return notify_error(key, BAD_GATEWAY, REQUEST_READ);
-    }
+static void leave_out_ejected(struct selector_key * key) {
+    char addrBuffer[ADDR_BUFFER_SIZE];
+    struct addrinfo ** link = &(key->item->doh.current_target_addr);
 
-    // Read response bytes into read buffer
+    // The nodes stay in the resolved list, which is freed as a whole
 
-    size_t space;
-    uint8_t * raw_res = buffer_write_ptr(&(key->item->read_buffer), &space);
-    ssize_t readBytes = read(key->item->target_socket, raw_res, space);
+    while (*link != NULL) {
+        if (! endpoint_ejected((*link)->ai_addr)) {
+            link = &((*link)->ai_next);
+            continue;
+        }
 
-    if(readBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to read response from target");
-        return TARGET_CLOSE_CONNECTION;
+        sockaddr_print((*link)->ai_addr, addrBuffer);
+        log(DEBUG, "Leaving out ejected address %s", addrBuffer)
+        *link = (*link)->ai_next;
     }
+}
 
-    if (readBytes == 0)
-        return TARGET_CLOSE_CONNECTION;
-
-    buffer_write_adv(&(key->item->read_buffer), readBytes);
 
-    log(DEBUG, "Received %lu bytes from socket %d", (size_t) readBytes, key->item->target_socket);
+static void defer_unreachable(struct selector_key * key) {
+    struct addrinfo * reachable = NULL, ** reachable_tail = &reachable;
+    struct addrinfo * unreachable = NULL, ** unreachable_tail = &unreachable;
 
-    // Calculate statistics
+    for (struct addrinfo * addr = key->item->doh.current_target_addr; addr != NULL; addr = addr->ai_next) {
+        if (endpoint_unreachable(addr->ai_addr)) {
+            *unreachable_tail = addr;
+            unreachable_tail = &(addr->ai_next);
+        } else {
+            *reachable_tail = addr;
+            reachable_tail = &(addr->ai_next);
+        }
+    }
 
-    add_bytes_recieved(readBytes);
+    // Still tried, in case no address is doing better
 
-    // Process the response
+    *unreachable_tail = NULL;
+    *reachable_tail = unreachable;
+    key->item->doh.current_target_addr = reachable;
+}
 
-    return process_response(key);
 
-}
+static void order_by_latency(struct selector_key * key) {
+    if (rand() % 100 < LATENCY_EXPLORATION)
+        return;
 
+    // Insertion sort, lists are short and equal latencies keep their order
 
-static unsigned response_forward_ready(unsigned int state, struct selector_key *key) {
+    struct addrinfo * sorted = NULL;
+    struct addrinfo * next;
 
-    // Read response bytes from write buffer
+    for (struct addrinfo * addr = key->item->doh.current_target_addr; addr != NULL; addr = next) {
+        next = addr->ai_next;
+        double latency = endpoint_latency(addr->ai_addr);
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
-    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+        struct addrinfo ** pos = &sorted;
+        while (*pos != NULL && endpoint_latency((*pos)->ai_addr) <= latency)
+            pos = &((*pos)->ai_next);
 
-    if (sentBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write response to client");
-        return CLIENT_CLOSE_CONNECTION;
+        addr->ai_next = *pos;
+        *pos = addr;
     }
 
-    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+    key->item->doh.current_target_addr = sorted;
+}
 
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
 
-    // Calculate statistics
+static long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    add_sent_bytes(sentBytes);
 
-    if ((size_t) sentBytes < size)
-        return RESPONSE_FORWARD;
+static int start_attempt(struct selector_key * key) {
+    char addrBuffer[ADDR_BUFFER_SIZE];
 
-       
-    if (key->item->res_parser.response.message.body_length == 0) {
-        // No body
-        http_request_parser_reset(&(key->item->req_parser));
-        http_response_parser_reset(&(key->item->res_parser));
-        return REQUEST_READ;
-    } else if (buffer_can_read(&(key->item->read_buffer))) {
-        // Body present, read some bytes
-        size_t remaining;
-        buffer_read_ptr(&(key->item->read_buffer), &remaining);
-        key->item->res_parser.message_parser.current_body_length += remaining;
-        return RES_BODY_FORWARD;
-    } else {
-        // Body present, didn't read bytes
-        return RES_BODY_READ;
-    }
-    
+    int slot = 0;
+    while (slot < SELECTOR_ATTEMPTS && key->item->attempts[slot] >= 0)
+        slot++;
 
-}
+    // Addresses that can't be connected to are skipped right away
 
+    while (slot < SELECTOR_ATTEMPTS && key->item->doh.current_target_addr != NULL) {
+        struct addrinfo * addr = key->item->doh.current_target_addr;
+        key->item->doh.current_target_addr = addr->ai_next;
 
-static unsigned res_body_read_ready(unsigned int state, struct selector_key *key) {
+        if (is_proxy_host(addr->ai_addr) && key->item->doh.url.port == proxy_conf.proxyArgs.proxy_port)
+            return ATTEMPT_LOOP;
 
-    key->item->last_activity = time(NULL);
+        sockaddr_print(addr->ai_addr, addrBuffer);
 
-    if (! buffer_can_write(&(key->item->read_buffer)))
-        return RES_BODY_FORWARD;
+        // A half open address is claimed as a probe only by the connect
+        // that tries it, another race may have claimed it since the list
+        // was filtered
 
-    // Read body bytes into read buffer
+        if (! endpoint_admit(addr->ai_addr)) {
+            log(DEBUG, "Leaving out ejected address %s", addrBuffer)
+            continue;
+        }
 
-    size_t space;
-    uint8_t * body = buffer_write_ptr(&(key->item->read_buffer), &space);
-    ssize_t readBytes = read(key->item->target_socket, body, space);
+        int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sock < 0) {
+            log(DEBUG, "Can't create target socket on %s", addrBuffer)
+            continue;
+        }
 
-    if(readBytes <= 0) {
-        if(readBytes < 0 && errno != EBADF && errno != EPIPE)
-            log_error("Failed to read from target");
-        return TARGET_CLOSE_CONNECTION;
-    }
+        selector_fd_set_nio(sock);
+        apply_socket_policy(sock, SOCKET_CLASS_TARGET);
 
-    buffer_write_adv(&(key->item->read_buffer), readBytes);
+        if (target_connect(key, sock, addr) == -1) {
+            log(INFO, "Connect to %s failed: %s", addrBuffer, strerror(errno))
+            endpoint_failed(addr->ai_addr);
+            close(sock);
+            continue;
+        }
 
-    log(DEBUG, "Received %lu body bytes from socket %d", (size_t) readBytes, key->item->target_socket);
+        log(DEBUG, "Racing connect to %s", addrBuffer)
 
-    // Calculate statistics
+        key->item->attempts[slot] = sock;
+        key->item->attempt_addrs[slot] = addr;
+        key->item->attempt_started[slot] = now_ms();
+        selector_update_fdset(key->s, key->item);
+        return 0;
+    }
 
-    add_bytes_recieved(readBytes);
+    return -1;
+}
 
-    http_response_parser * rp = &(key->item->res_parser);
 
-    rp->message_parser.current_body_length += readBytes;
+static void drop_attempt(struct selector_key * key, int slot) {
+    int sock = key->item->attempts[slot];
 
-    if ((rp->message_parser.current_body_length) < rp->response.message.body_length)
-        return RES_BODY_READ;
-    else
-        return RES_BODY_FORWARD;
+    FD_CLR(sock, &key->s->master_r);
+    FD_CLR(sock, &key->s->master_w);
+    close(sock);
 
+    key->item->attempts[slot] = -1;
+    key->item->attempt_addrs[slot] = NULL;
 }
 
 
-static unsigned res_body_forward_ready(unsigned int state, struct selector_key *key) {
+static unsigned target_connected(struct selector_key * key) {
 
-    // Will read the content directly from read buffer
+    // Update last connection
 
-    // Read body bytes from read buffer
+    memcpy(&(key->item->last_target_url), &(key->item->req_parser.request.parsed_url), sizeof(struct url));
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
-    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+    key->item->request_ready = now_ms();
 
-    if (sentBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write body to client");
-        return CLIENT_CLOSE_CONNECTION;
-    }
+    http_request * request = &(key->item->req_parser.request);
 
-    buffer_read_adv(&(key->item->read_buffer), sentBytes);
+    // Check for request method
 
-    log(DEBUG, "Sent %lu body bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+    if (request->method == CONNECT) {
 
-    // Calculate statistics
+        // The request method is CONNECT, a response shall be sent
+        // and TCP tunnel be established
 
-    add_sent_bytes(sentBytes);
+        buffer_read_adv(&(key->item->read_buffer), request->message.head_length);
 
-    http_response_parser * rp = &(key->item->res_parser);
+        // A tunnel has no response to judge the origin by, the connect is all
 
-    if ((size_t) sentBytes < size) {
-        return RES_BODY_FORWARD;
-    } else if ((rp->message_parser.current_body_length) < rp->response.message.body_length) {
-        return RES_BODY_READ;
-    } else {
-        http_request_parser_reset(&(key->item->req_parser));
-        http_response_parser_reset(&(key->item->res_parser));
-        return REQUEST_READ;
-    }
+        origin_succeeded(key->item->origin);
+        
+        // Write response bytes into write buffer
 
-}
+        write_template(&(key->item->write_buffer), template_connect_established());
 
+        print_Access(inet_ntoa(key->item->client.sin_addr), ntohs(key->item->client.sin_port), key->item->req_parser.request.url, key->item->req_parser.request.method, 200);
 
-static unsigned connect_response_ready(unsigned int state, struct selector_key *key) {
+        // Go to send response state
+
+        return CONNECT_RESPONSE;
+
+    } else { 
+
+        // The request method is a traditional one, request shall be proccessed
+        // and then forwarded
+
+        // The Host header carries the URL authority, brackets and port included
+
+        struct url * url = &(request->parsed_url);
+        char authority[HOST_LENGTH + 8] = {0};
+
+        if (url->host.length > 0) {
+            size_t begin = url->host.offset;
+            if (begin > 0 && request->url[begin - 1] == '[')
+                begin--;
+            size_t length = MIN(url->path.offset - begin, sizeof(authority) - 1);
+            memcpy(authority, request->url + begin, length);
+        }
+
+        if (request->method == OPTIONS && url->path.length == 0)
+            sprintf(request->url, "*");
+
+        // Process request headers
+
+        char proxy_hostname[VIA_PROXY_NAME_SIZE];
+        via_token(proxy_hostname);
+        
+        process_request_headers(request, authority, proxy_hostname);
+
+        // Extract credentials if present
+
+        if (proxy_conf.disectorsEnabled)
+            extract_http_credentials(request);
+
+        // Point the writer at the processed request, body bytes that arrived
+        // along with the head go out in the same send
+
+        http_writer_request(&(key->item->writer), request);
+
+        if (request->message.framing != FRAMING_NONE) {
+            http_request_parser * rp = &(key->item->req_parser);
+
+            size_t remaining;
+            uint8_t * body = buffer_read_ptr(&(key->item->read_buffer), &remaining) + request->message.head_length;
+            remaining -= request->message.head_length;
+
+            parse_state body_state = http_message_parser_body(
+                &(rp->message_parser), &(rp->request.message), body, &remaining
+            );
+
+            if (body_state == FAILED)
+                return notify_error(key, rp->message_parser.error_code, REQUEST_READ);
+
+            http_writer_body(&(key->item->writer), body, rp->message_parser.pending_body_length);
+        }
+
+        // Go to forward request state
+
+        return REQUEST_FORWARD;
+
+    }
+}
+
+
+static unsigned request_forward_ready(unsigned int state, struct selector_key *key) {
+
+    // Send request head and body prefix straight from the parser
+
+    http_writer * writer = &(key->item->writer);
+    ssize_t sentBytes = http_writer_send(writer, key->item->target_socket);
+
+    if (sentBytes < 0) {
+        // A fast open connect without room for the data in the SYN
+        // finishes the handshake first, the request goes out after it
+
+        if (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK)
+            return REQUEST_FORWARD;
+        if (fastopen_failed(key))
+            return notify_error(key, BAD_GATEWAY, REQUEST_READ);
+
+        // The request is still whole in the read buffer
+
+        if ((errno == EPIPE || errno == ECONNRESET) && retryable(key->item))
+            return retry_request(key);
+
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to write request to target");
+        return TARGET_CLOSE_CONNECTION;
+    }
+
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
+
+    // Calculate statistics
+
+    add_sent_bytes(sentBytes);
+
+    if (! http_writer_done(writer))
+        return REQUEST_FORWARD;
+
+    // The head and body prefix were sent, release them from the read buffer.
+    // A request that may be resent, if its pooled connection turns out stale
+    // or to a hedge that may fire, is held unread instead, until the first
+    // response byte.
+
+    http_request_parser * rp = &(key->item->req_parser);
+    size_t sent = rp->request.message.head_length + writer->body_length;
+
+    key->item->held_length = retryable(key->item) || hedge_delay(key) >= 0 ? sent : 0;
+
+    if (key->item->held_length == 0)
+        buffer_read_adv(&(key->item->read_buffer), sent);
+    rp->message_parser.pending_body_length -= writer->body_length;
+
+    if (rp->request.message.framing == FRAMING_NONE || rp->message_parser.body_state == SUCCESS)
+        return await_response(key);
+
+    // Body not over, wait for more bytes. With Expect the client holds it
+    // back until the target says 100 Continue, or until it tires of waiting.
+
+    return rp->request.message.hasExpect ? EXPECT_CONTINUE : REQ_BODY_RELAY;
+
+}
+
+
+static unsigned expect_continue_read_ready(unsigned int state, struct selector_key *key) {
+
+    // The client tired of waiting, the relay reads the body from the next
+    // pass on, once jumping to it has set its interests
+
+    if (key->active_fd == key->item->client_socket)
+        return REQ_BODY_RELAY;
+
+    // The target answered first, either 100 Continue or a final response
+
+    await_response(key);
+    return response_read_ready(state, key);
+
+}
+
+
+static unsigned req_body_read_ready(unsigned int state, struct selector_key *key) {
+
+    key->item->last_activity = time(NULL);
+
+    // Long Content-Length bodies skip user space once the buffer is flushed
+
+    http_request_parser * rp = &(key->item->req_parser);
+    splice_pipe * pipe = &(key->item->target_pipe);
+
+    if (body_can_splice(&(key->item->read_buffer), &(rp->message_parser), &(rp->request.message), pipe)) {
+        ssize_t readBytes = body_splice_in(key, key->item->client_socket, pipe, &(rp->message_parser), &(rp->request.message));
+
+        if (readBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), pipe, REQ_BODY_RELAY);
+
+        if (readBytes <= 0) {
+            if(readBytes < 0 && errno != EBADF && errno != EPIPE)
+                log_error("Failed to splice from client");
+            return CLIENT_CLOSE_CONNECTION;
+        }
+
+        log(DEBUG, "Spliced %lu body bytes from socket %d", (size_t) readBytes, key->item->client_socket);
+
+        add_bytes_recieved(readBytes);
+
+        return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), pipe, REQ_BODY_RELAY);
+    }
+
+    if (! buffer_can_write(&(key->item->read_buffer)))
+        return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), pipe, REQ_BODY_RELAY);
+
+    // Read body bytes into read buffer
+
+    size_t space;
+    uint8_t * body = buffer_write_ptr(&(key->item->read_buffer), &space);
+    ssize_t readBytes = read(key->item->client_socket, body, selector_read_quota(key, space));
+    selector_charge_read(key, readBytes);
+
+    if(readBytes <= 0) {
+        if(readBytes < 0 && errno != EBADF && errno != EPIPE)
+            log_error("Failed to read from client");
+        return CLIENT_CLOSE_CONNECTION;
+    }
+
+    buffer_write_adv(&(key->item->read_buffer), readBytes);
+
+    log(DEBUG, "Received %lu body bytes from socket %d", (size_t) readBytes, key->item->client_socket);
+
+    // Calculate statistics
+
+    add_bytes_recieved(readBytes);
+
+    // Scan the new bytes to find where the body ends
+
+    size_t scanned = readBytes;
+    parse_state body_state = http_message_parser_body(
+        &(rp->message_parser), &(rp->request.message), body, &scanned
+    );
+
+    if (body_state == FAILED)
+        return notify_error(key, rp->message_parser.error_code, END);
+
+    return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), pipe, REQ_BODY_RELAY);
+
+}
+
+
+static unsigned req_body_forward_ready(unsigned int state, struct selector_key *key) {
+
+    // Will read the content directly from read buffer
+
+    http_request_parser * rp = &(key->item->req_parser);
+
+    // Spliced body bytes are queued in the pipe, never both in it and the buffer
+
+    splice_pipe * pipe = &(key->item->target_pipe);
+    ssize_t sentBytes;
+
+    if (pipe->pending > 0) {
+        sentBytes = splice_pipe_drain(pipe, key->item->target_socket);
+    } else {
+        // Read scanned body bytes from read buffer
+
+        size_t size;
+        uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
+        size = MIN(size, rp->message_parser.pending_body_length);
+        sentBytes = zerocopy_send(&(key->item->target_zc), key->item->target_socket, ptr, size, proxy_conf.proxyArgs.zerocopy);
+
+        if (sentBytes > 0)
+            release_sent(&(key->item->read_buffer), &(key->item->target_zc), sentBytes);
+    }
+
+    if (sentBytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), pipe, REQ_BODY_RELAY);
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to write body to target");
+        return TARGET_CLOSE_CONNECTION;
+    }
+
+    log(DEBUG, "Sent %lu body bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
+
+    // Calculate statistics
+
+    add_sent_bytes(sentBytes);
+
+    rp->message_parser.pending_body_length -= sentBytes;
+
+    return req_body_relay_next(key);
+
+}
+
+
+static unsigned response_read_arrival(const unsigned int state, struct selector_key *key) {
+    struct item * item = key->item;
+
+    // Only a request that was never answered, and could go out twice. The
+    // hedge is written from the parsed head, whose lines point into the
+    // held request.
+
+    if (item->held_length == 0 || item->request_ready == 0)
+        return state;
+
+    long delay = hedge_delay(key);
+    if (delay < 0)
+        return state;
+
+    hedge_eligible();
+
+    long long elapsed = now_ms() - item->request_ready;
+    selector_set_timer(key, delay > elapsed ? delay - elapsed : 0);
+    return state;
+}
+
+
+static unsigned hedge_timeout(unsigned int state, struct selector_key *key) {
+    struct item * item = key->item;
+    char addrBuffer[ADDR_BUFFER_SIZE];
+
+    if (item->request_ready == 0 || item->held_length == 0)
+        return RESPONSE_READ;
+
+    // The address may have failed a connect since the hedge was armed
+
+    if (! pick_hedge_address(key))
+        return RESPONSE_READ;
+
+    struct sockaddr * addr = (struct sockaddr *) &(item->hedge_addr);
+    sockaddr_print(addr, addrBuffer);
+
+    // The hedge is one more connection to the origin, within its cap
+
+    if (! origin_take_extra(item->origin)) {
+        log(DEBUG, "Not hedging to %s, its origin has no connection to spare", addrBuffer)
+        return RESPONSE_READ;
+    }
+
+    if (! endpoint_admit(addr) || ! hedge_take()) {
+        give_back_hedge(key);
+        return RESPONSE_READ;
+    }
+
+    int sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        log(DEBUG, "Can't create hedge socket on %s", addrBuffer)
+        give_back_hedge(key);
+        hedge_failed();
+        return RESPONSE_READ;
+    }
+
+    selector_fd_set_nio(sock);
+    apply_socket_policy(sock, SOCKET_CLASS_TARGET);
+
+    if (connect(sock, addr, item->hedge_addr_len) != 0 && errno != EINPROGRESS) {
+        log(INFO, "Hedge connect to %s failed: %s", addrBuffer, strerror(errno))
+        endpoint_failed(addr);
+        close(sock);
+        give_back_hedge(key);
+        hedge_failed();
+        return RESPONSE_READ;
+    }
+
+    log(DEBUG, "Hedging request to %s after %lld ms", addrBuffer, now_ms() - item->request_ready)
+
+    item->hedge_socket = sock;
+    item->hedge_interest = OP_WRITE;
+    item->hedge_sent = false;
+    item->hedge_ready = now_ms();
+    selector_update_fdset(key->s, item);
+
+    return RESPONSE_READ;
+}
+
+
+static unsigned hedge_write_ready(unsigned int state, struct selector_key *key) {
+    struct item * item = key->item;
+
+    if (key->active_fd != item->hedge_socket || item->hedge_socket < 0)
+        return RESPONSE_READ;
+
+    // The first write readiness is the connect being over
+
+    if (! item->hedge_sent && http_writer_done(&(item->writer))) {
+        int socket_error;
+        socklen_t socket_error_len = sizeof(socket_error);
+        if (getsockopt(item->hedge_socket, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len) != 0)
+            socket_error = errno;
+
+        if (socket_error != 0) {
+            endpoint_failed((struct sockaddr *) &(item->hedge_addr));
+            drop_hedge(key, true);
+            return RESPONSE_READ;
+        }
+
+        // The request went out already, its head is still parsed
+
+        http_writer_request(&(item->writer), &(item->req_parser.request));
+    }
+
+    ssize_t sentBytes = http_writer_send(&(item->writer), item->hedge_socket);
+
+    if (sentBytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RESPONSE_READ;
+        drop_hedge(key, true);
+        return RESPONSE_READ;
+    }
+
+    add_sent_bytes(sentBytes);
+
+    if (! http_writer_done(&(item->writer)))
+        return RESPONSE_READ;
+
+    item->hedge_sent = true;
+    item->hedge_interest = OP_READ;
+    item->hedge_ready = now_ms();
+    selector_update_fdset(key->s, item);
+
+    return RESPONSE_READ;
+}
+
+
+static void response_read_departure(const unsigned int state, struct selector_key *key) {
+    if (key->item->hedge_socket >= 0)
+        drop_hedge(key, false);
+}
+
+
+static unsigned response_read_ready(unsigned int state, struct selector_key *key) {
+
+    // The hedge answered first, the late connection is given up
+
+    if (key->item->hedge_socket >= 0 && key->active_fd == key->item->hedge_socket) {
+        uint8_t peek;
+        if (recv(key->item->hedge_socket, &peek, 1, MSG_PEEK) <= 0) {
+            drop_hedge(key, true);
+            return RESPONSE_READ;
+        }
+        hedge_wins(key);
+    } else if (key->item->hedge_socket >= 0 && key->active_fd == key->item->target_socket) {
+        drop_hedge(key, false);
+    }
+
+    if (! buffer_can_write(&(key->item->read_buffer))) {
+        log_error("Read buffer limit reached")
+        return notify_error(key, BAD_GATEWAY, REQUEST_READ);
+    }
+
+    // Read response bytes into read buffer
+
+    size_t space;
+    uint8_t * raw_res = buffer_write_ptr(&(key->item->read_buffer), &space);
+    ssize_t readBytes = read(key->item->target_socket, raw_res, selector_read_quota(key, space));
+    selector_charge_read(key, readBytes);
+
+    // A pooled connection closed before any response byte most likely
+    // raced its idle close with this request
+
+    bool unanswered = key->item->held_length > 0 && retryable(key->item);
+
+    if(readBytes < 0) {
+        if (fastopen_failed(key))
+            return notify_error(key, BAD_GATEWAY, REQUEST_READ);
+        if (errno == ECONNRESET && unanswered)
+            return retry_request(key);
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to read response from target");
+        return TARGET_CLOSE_CONNECTION;
+    }
+
+    if (readBytes == 0)
+        return unanswered ? retry_request(key) : TARGET_CLOSE_CONNECTION;
+
+    // Answered, the held request is done with
+
+    buffer_read_adv(&(key->item->pipeline_buffer), key->item->held_length);
+    key->item->held_length = 0;
+
+    fastopen_count(key);
+    first_byte_count(key);
+
+    buffer_write_adv(&(key->item->read_buffer), readBytes);
+
+    log(DEBUG, "Received %lu bytes from socket %d", (size_t) readBytes, key->item->target_socket);
+
+    // Calculate statistics
+
+    add_bytes_recieved(readBytes);
+
+    // Process the response
+
+    return process_response(key);
+
+}
+
+
+static unsigned response_forward_ready(unsigned int state, struct selector_key *key) {
+
+    // Send response head and body prefix straight from the parser
+
+    http_writer * writer = &(key->item->writer);
+    ssize_t sentBytes = http_writer_send(writer, key->item->client_socket);
+
+    if (sentBytes < 0) {
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to write response to client");
+        return CLIENT_CLOSE_CONNECTION;
+    }
+
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+
+    // Calculate statistics
+
+    add_sent_bytes(sentBytes);
+
+    if (! http_writer_done(writer))
+        return RESPONSE_FORWARD;
+
+    // The head and body prefix were sent, release them from the read buffer
+
+    http_response_parser * rp = &(key->item->res_parser);
+
+    buffer_read_adv(&(key->item->read_buffer), rp->response.message.head_length + writer->body_length);
+    rp->message_parser.pending_body_length -= writer->body_length;
+
+    if (HTTP_STATUS_INTERIM(rp->response.status))
+        return interim_response_sent(key);
+
+    // Upgrade is never forwarded, yet the origin switched protocols. Neither
+    // connection speaks HTTP anymore, so both are closed.
+
+    if (rp->response.status == SWITCHING_PROTOCOLS) {
+        log(INFO, "Closing client %d, its target switched protocols", key->item->client_socket);
+        return END;
+    }
+
+    if (rp->response.message.framing == FRAMING_NONE || rp->message_parser.body_state == SUCCESS)
+        return response_sent(key);
+
+    // Body not over, wait for more bytes
+
+    return RES_BODY_RELAY;
+
+}
+
+
+static unsigned res_body_read_ready(unsigned int state, struct selector_key *key) {
+
+    key->item->last_activity = time(NULL);
+
+    // Long Content-Length bodies skip user space once the buffer is flushed
+
+    http_response_parser * rp = &(key->item->res_parser);
+    splice_pipe * pipe = &(key->item->client_pipe);
+
+    if (body_can_splice(&(key->item->read_buffer), &(rp->message_parser), &(rp->response.message), pipe)) {
+        ssize_t readBytes = body_splice_in(key, key->item->target_socket, pipe, &(rp->message_parser), &(rp->response.message));
+
+        if (readBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), pipe, RES_BODY_RELAY);
+
+        if (readBytes <= 0) {
+            if(readBytes < 0 && errno != EBADF && errno != EPIPE)
+                log_error("Failed to splice from target");
+            return TARGET_CLOSE_CONNECTION;
+        }
+
+        log(DEBUG, "Spliced %lu body bytes from socket %d", (size_t) readBytes, key->item->target_socket);
+
+        add_bytes_recieved(readBytes);
+
+        return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), pipe, RES_BODY_RELAY);
+    }
+
+    if (! buffer_can_write(&(key->item->read_buffer)))
+        return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), pipe, RES_BODY_RELAY);
+
+    // Read body bytes into read buffer
+
+    size_t space;
+    uint8_t * body = buffer_write_ptr(&(key->item->read_buffer), &space);
+    ssize_t readBytes = read(key->item->target_socket, body, selector_read_quota(key, space));
+    selector_charge_read(key, readBytes);
+
+    if(readBytes <= 0) {
+        if(readBytes < 0 && errno != EBADF && errno != EPIPE)
+            log_error("Failed to read from target");
+        return TARGET_CLOSE_CONNECTION;
+    }
+
+    buffer_write_adv(&(key->item->read_buffer), readBytes);
+
+    log(DEBUG, "Received %lu body bytes from socket %d", (size_t) readBytes, key->item->target_socket);
+
+    // Calculate statistics
+
+    add_bytes_recieved(readBytes);
+
+    // Scan the new bytes to find where the body ends
+
+    size_t scanned = readBytes;
+    parse_state body_state = http_message_parser_body(
+        &(rp->message_parser), &(rp->response.message), body, &scanned
+    );
+
+    if (body_state == FAILED) {
+        log_error("Malformed response body from target")
+        return END;
+    }
+
+    return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), pipe, RES_BODY_RELAY);
+
+}
+
+
+static unsigned res_body_forward_ready(unsigned int state, struct selector_key *key) {
+
+    // Will read the content directly from read buffer
+
+    http_response_parser * rp = &(key->item->res_parser);
+
+    // Spliced body bytes are queued in the pipe, never both in it and the buffer
+
+    splice_pipe * pipe = &(key->item->client_pipe);
+    ssize_t sentBytes;
+
+    if (pipe->pending > 0) {
+        sentBytes = splice_pipe_drain(pipe, key->item->client_socket);
+    } else {
+        // Read scanned body bytes from read buffer
+
+        size_t size;
+        uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
+        size = MIN(size, rp->message_parser.pending_body_length);
+        sentBytes = zerocopy_send(&(key->item->client_zc), key->item->client_socket, ptr, size, proxy_conf.proxyArgs.zerocopy);
+
+        if (sentBytes > 0)
+            release_sent(&(key->item->read_buffer), &(key->item->client_zc), sentBytes);
+    }
+
+    if (sentBytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), pipe, RES_BODY_RELAY);
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to write body to client");
+        return CLIENT_CLOSE_CONNECTION;
+    }
+
+    log(DEBUG, "Sent %lu body bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+
+    // Calculate statistics
+
+    add_sent_bytes(sentBytes);
+
+    rp->message_parser.pending_body_length -= sentBytes;
+
+    return res_body_relay_next(key);
+
+}
+
+
+static unsigned req_body_relay_next(struct selector_key *key) {
+
+    http_request_parser * rp = &(key->item->req_parser);
+
+    // The buffer is reused for the response, so pinned pages must be back
+
+    if (rp->message_parser.pending_body_length == 0 && rp->message_parser.body_state != PENDING
+        && ! zerocopy_pending(&(key->item->target_zc)))
+        return await_response(key);
+
+    return body_relay_interests(key, key->item->client_socket, &(rp->message_parser), &(key->item->target_pipe), REQ_BODY_RELAY);
+
+}
+
+
+static unsigned res_body_relay_next(struct selector_key *key) {
+
+    http_response_parser * rp = &(key->item->res_parser);
+
+    // The buffer is reused for the next request, so pinned pages must be back
+
+    if (rp->message_parser.pending_body_length == 0 && rp->message_parser.body_state != PENDING
+        && ! zerocopy_pending(&(key->item->client_zc)))
+        return response_sent(key);
+
+    return body_relay_interests(key, key->item->target_socket, &(rp->message_parser), &(key->item->client_pipe), RES_BODY_RELAY);
+
+}
+
+
+static unsigned connect_response_ready(unsigned int state, struct selector_key *key) {
+
+    if (! buffer_can_read(&(key->item->write_buffer)))
+        return CONNECT_RESPONSE;
+
+    // write response bytes to socket
+
+    size_t size;
+    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
+    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+
+    if (sentBytes < 0) {
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to write connect response to client");
+        return END;
+    }
+
+    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+
+    //statistics
+    add_sent_bytes(sentBytes);
+
+    if ((size_t) sentBytes < size)
+        return CONNECT_RESPONSE;
+
+    // Bytes sent by the client right after the CONNECT head belong to the tunnel,
+    // where the write buffer holds the bytes for the target
+
+    swap_buffers(&(key->item->read_buffer), &(key->item->write_buffer));
+
+    memset(&(key->item->pop3_parser), 0, sizeof(pop3_parser_data));
+    pop3_parser_init(&(key->item->pop3_parser));
+
+    return TCP_TUNNEL;
+
+}
+
+
+static unsigned tcp_tunnel_arrival(const unsigned int state, struct selector_key *key) {
+
+    // Tunnel bytes go through the dissector until its window closes
+
+    key->item->tunnel_dissect = proxy_conf.disectorsEnabled;
+    key->item->tunnel_inspected = 0;
+
+    if (buffer_can_read(&(key->item->write_buffer))) {
+        key->item->target_interest |= OP_WRITE;
+        selector_update_fdset(key->s, key->item);
+    }
+
+    return TCP_TUNNEL;
+
+}
+
+
+static unsigned tcp_tunnel_read_ready(unsigned int state, struct selector_key *key) {
+
+    // On this context: read_buffer = client_buffer, write_buffer = target_buffer
+
+    // Choose peer socket buffer for writing to it
+
+    int peer_fd = key->active_fd == key->item->client_socket
+        ? key->item->target_socket : key->item->client_socket;
+
+    buffer * buffer = peer_fd == key->item->client_socket
+        ? &(key->item->read_buffer) : &(key->item->write_buffer);
+
+    splice_pipe * pipe = peer_fd == key->item->client_socket
+        ? &(key->item->client_pipe) : &(key->item->target_pipe);
+
+    // Once buffered bytes are gone and nothing needs to inspect them,
+    // they move between sockets without leaving the kernel
+
+    if (tunnel_can_splice(key->item, buffer, pipe))
+        return tcp_tunnel_splice_in(key, pipe);
+
+    // If the buffer is full wait for it to be consumed
+
+    if (! buffer_can_write(buffer)) {
+        if (key->active_fd == key->item->client_socket)
+            key->item->client_interest &= ~OP_READ;
+        else
+            key->item->target_interest &= ~OP_READ;
+        selector_update_fdset(key->s, key->item);
+        return TCP_TUNNEL;
+    }
+
+    // Copy active socket bytes into peer socket buffer
+
+    size_t space;
+    uint8_t * ptr = buffer_write_ptr(buffer, &space);
+    ssize_t readBytes = read(key->active_fd, ptr, selector_read_quota(key, space));
+    selector_charge_read(key, readBytes);
+
+    if (readBytes < 0) {
+        if(errno != EBADF && errno != EPIPE)
+            log_error("Failed to read from active socket");
+        return END;
+    }
+
+    if (readBytes == 0)
+        return END;
+
+    buffer_write_adv(buffer, readBytes);
+
+    log(DEBUG, "Received %lu bytes from socket %d", (size_t) readBytes, key->active_fd);
+
+    if (key->item->tunnel_dissect && proxy_conf.disectorsEnabled)
+        dissect_tunnel_bytes(key, ptr, readBytes);
+
+    // Calculate statistics
+
+    add_bytes_recieved(readBytes);
+
+    // Declare interest on writing to peer and return
+
+    if (key->active_fd == key->item->client_socket)
+        key->item->target_interest |= OP_WRITE;
+    else
+        key->item->client_interest |= OP_WRITE;
+
+    selector_update_fdset(key->s, key->item);
+
+    return TCP_TUNNEL;
+}
+
+
+static unsigned tcp_tunnel_forward_ready(unsigned int state, struct selector_key *key) {
+
+    // On this context: read_buffer = client_buffer, write_buffer = target_buffer
+
+    // Choose active socket buffer for reading from it
+
+    buffer * buffer = key->active_fd == key->item->client_socket
+        ? &(key->item->read_buffer) : &(key->item->write_buffer);
+
+    splice_pipe * pipe = key->active_fd == key->item->client_socket
+        ? &(key->item->client_pipe) : &(key->item->target_pipe);
+
+    // Buffered bytes always precede spliced ones
+
+    if (! buffer_can_read(buffer) && pipe->pending > 0)
+        return tcp_tunnel_splice_out(key, pipe);
+
+    // If the buffer is empty wait for it to be filled
+
+    if (! buffer_can_read(buffer))
+        return TCP_TUNNEL;
 
-    if (! buffer_can_read(&(key->item->write_buffer)))
-        return CONNECT_RESPONSE;
+    // Copy bytes from peer socket buffer to active socket
 
-    // write response bytes to socket
+    zerocopy_state * zc = key->active_fd == key->item->client_socket
+        ? &(key->item->client_zc) : &(key->item->target_zc);
 
     size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
-    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+    uint8_t *ptr = buffer_read_ptr(buffer, &size);
+    ssize_t sentBytes = zerocopy_send(zc, key->active_fd, ptr, size, proxy_conf.proxyArgs.zerocopy);
 
     if (sentBytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return TCP_TUNNEL;
         if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write connect response to client");
+            log_error("Failed to write to active socket");
         return END;
     }
 
-    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+    release_sent(buffer, zc, sentBytes);
 
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->active_fd);
 
     //statistics
     add_sent_bytes(sentBytes);
 
-    if ((size_t) sentBytes < size)
-        return CONNECT_RESPONSE;
+    // If write is over turn off interest on writing on active socket, then return
 
-    memset(&(key->item->pop3_parser), 0, sizeof(pop3_parser_data));
-    pop3_parser_init(&(key->item->pop3_parser));
+    if (((size_t) sentBytes) == size) {
+        if (key->active_fd == key->item->client_socket)
+            key->item->client_interest &= ~OP_WRITE;
+        else
+            key->item->target_interest &= ~OP_WRITE;
+    }
+
+    // Space was freed, resume reading from both sockets
+
+    key->item->client_interest |= OP_READ;
+    key->item->target_interest |= OP_READ;
+
+    selector_update_fdset(key->s, key->item);
 
     return TCP_TUNNEL;
 
 }
 
 
-static unsigned tcp_tunnel_read_ready(unsigned int state, struct selector_key *key) {
+static unsigned tcp_tunnel_release_ready(struct selector_key *key) {
 
-    // On this context: read_buffer = client_buffer, write_buffer = target_buffer
+    // Bytes already sent stayed in the buffers while the kernel held them
 
-    // Choose peer socket buffer for writing to it
+    buffer_compact(&(key->item->read_buffer));
+    buffer_compact(&(key->item->write_buffer));
 
-    int peer_fd = key->active_fd == key->item->client_socket
-        ? key->item->target_socket : key->item->client_socket;
+    key->item->client_interest |= OP_READ;
+    key->item->target_interest |= OP_READ;
 
-    buffer * buffer = peer_fd == key->item->client_socket
-        ? &(key->item->read_buffer) : &(key->item->write_buffer);
+    selector_update_fdset(key->s, key->item);
 
-    // If the buffer is full wait for it to be consumed
+    return TCP_TUNNEL;
 
-    if (! buffer_can_write(buffer)) {
-        if (key->active_fd == key->item->client_socket)
-            key->item->client_interest &= ~OP_READ;
-        else
-            key->item->target_interest &= ~OP_READ;
+}
+
+
+static unsigned tcp_tunnel_splice_in(struct selector_key *key, splice_pipe * pipe) {
+
+    if (! splice_pipe_acquired(pipe) && splice_pipe_acquire(pipe) < 0)
+        return END;
+
+    fd_interest * active_interest = key->active_fd == key->item->client_socket
+        ? &(key->item->client_interest) : &(key->item->target_interest);
+
+    fd_interest * peer_interest = key->active_fd == key->item->client_socket
+        ? &(key->item->target_interest) : &(key->item->client_interest);
+
+    ssize_t readBytes = splice_pipe_fill(pipe, key->active_fd, selector_read_quota(key, SPLICE_CHUNK));
+    selector_charge_read(key, readBytes);
+
+    if (readBytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("Failed to splice from active socket");
+            return END;
+        }
+
+        // The pipe is full, wait for the peer to drain it
+
+        if (pipe->pending > 0) {
+            *active_interest &= ~OP_READ;
+            selector_update_fdset(key->s, key->item);
+        }
         return TCP_TUNNEL;
     }
 
-    // Copy active socket bytes into peer socket buffer
+    if (readBytes == 0)
+        return END;
 
-    size_t space;
-    uint8_t * ptr = buffer_write_ptr(buffer, &space);
-    ssize_t readBytes = read(key->active_fd, ptr, space);
+    log(DEBUG, "Spliced %lu bytes from socket %d", (size_t) readBytes, key->active_fd);
 
-    if (readBytes < 0) {
+    add_bytes_recieved(readBytes);
+
+    if (pipe->pending >= SPLICE_CHUNK)
+        *active_interest &= ~OP_READ;
+
+    *peer_interest |= OP_WRITE;
+    selector_update_fdset(key->s, key->item);
+
+    return TCP_TUNNEL;
+
+}
+
+
+static unsigned tcp_tunnel_splice_out(struct selector_key *key, splice_pipe * pipe) {
+
+    ssize_t sentBytes = splice_pipe_drain(pipe, key->active_fd);
+
+    if (sentBytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return TCP_TUNNEL;
         if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to read from active socket");
+            log_error("Failed to splice to active socket");
+        return END;
+    }
+
+    log(DEBUG, "Spliced %lu bytes to socket %d", (size_t) sentBytes, key->active_fd);
+
+    add_sent_bytes(sentBytes);
+
+    if (pipe->pending == 0) {
+        if (key->active_fd == key->item->client_socket)
+            key->item->client_interest &= ~OP_WRITE;
+        else
+            key->item->target_interest &= ~OP_WRITE;
+    }
+
+    key->item->client_interest |= OP_READ;
+    key->item->target_interest |= OP_READ;
+
+    selector_update_fdset(key->s, key->item);
+
+    return TCP_TUNNEL;
+
+}
+
+
+static unsigned error_write_ready(unsigned int state, struct selector_key *key) {
+
+    size_t size;
+    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
+    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+
+    if (sentBytes < 0) {
+        log(ERROR, "Failed to notify error to client");
+        return END;
+    }
+
+    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+
+    //statistics
+    add_sent_bytes(sentBytes);
+
+    if ((size_t) sentBytes < size)
+        return ERROR_STATE;
+
+    #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+    return (unsigned) key->item->data;
+
+}
+
+
+static unsigned client_close_connection_arrival(const unsigned state, struct selector_key *key) {
+
+    log(DEBUG, "Client closed connection from socket %d", key->item->client_socket);
+
+    // Read last bytes from write buffer
+
+    size_t size;
+    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
+    ssize_t sentBytes = write(key->item->target_socket, ptr, size);
+
+    if (sentBytes < 0){
+        return END;
+    }
+
+    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
+
+    //statistics
+    add_sent_bytes(sentBytes);
+
+    if ((size_t) sentBytes < size)
+        return CLIENT_CLOSE_CONNECTION;
+
+    return END;
+
+}
+
+
+static unsigned target_close_connection_arrival(const unsigned state, struct selector_key *key) {
+
+    log(DEBUG, "Target Closed connection from socket %d", key->item->target_socket);
+
+    // Read last bytes from write buffer
+
+    size_t size;
+    uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
+    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+
+    if (sentBytes < 0){
         return END;
     }
+    buffer_read_adv(&(key->item->read_buffer), sentBytes);
+
+    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
+    
+    //statistics
+    add_sent_bytes(sentBytes);
+
+
+    if ((size_t) sentBytes < size)
+        return TARGET_CLOSE_CONNECTION;
+
+    return END;
+
+}
+
+
+static unsigned end_arrival(const unsigned state, struct selector_key *key){
+
+    item_kill(key->s, key->item);
+    remove_conection();
+    return END;
+    
+}
+
+
+/* -------------------------------------- AUXILIARS IMPLEMENTATIONS -------------------------------------- */
+
+static unsigned notify_error(struct selector_key *key, int status_code, unsigned next_state) {
+    
+    print_Access(inet_ntoa(key->item->client.sin_addr),ntohs(key->item->client.sin_port), key->item->req_parser.request.url,  key->item->req_parser.request.method,status_code);
+    http_request_parser_reset(&(key->item->req_parser));
+    http_response_parser_reset(&(key->item->res_parser));
+
+    backend_done(key->item->backend);
+    key->item->backend = -1;
+
+    // Errors of the origin or on the way to it count against its breaker,
+    // unlike those of the client or of the proxy turning it away
+
+    if (status_code == INTERNAL_SERVER_ERROR || status_code == BAD_GATEWAY || status_code == GATEWAY_TIMEOUT)
+        origin_failed(key->item->origin);
+
+    origin_done(key);
+
+    key->item->retried = false;
+    key->item->held_length = 0;
+
+    // Pipelined requests are not processed after an error
+
+    buffer_reset(&(key->item->pipeline_buffer));
+
+    const response_template * canned = template_for_status(status_code);
+
+    if (canned != NULL) {
+        write_template(&(key->item->write_buffer), canned);
+    } else {
+        size_t space;
+        char * ptr = (char *) buffer_write_ptr(&(key->item->write_buffer), &space);
+
+        http_response res = { .status = status_code };
+        int written = write_response(&res, ptr, space, false);
+
+        buffer_write_adv(&(key->item->write_buffer), written);
+    }
+
+    #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
+    key->item->data = (void *) next_state;
+
+    return ERROR_STATE;
+
+}
+
+
+static buffer head_view(buffer * read_buffer, http_message * message) {
+    buffer view = *read_buffer;
+    view.read += message->head_length;
+    return view;
+}
+
+
+static void swap_buffers(buffer * a, buffer * b) {
+    buffer aux = *a;
+    *a = *b;
+    *b = aux;
+}
+
+
+static bool tunnel_can_splice(struct item * item, buffer * buffer, splice_pipe * pipe) {
+    if (pipe->pending > 0)
+        return true;
+
+    return ! buffer_can_read(buffer) && ! (item->tunnel_dissect && proxy_conf.disectorsEnabled);
+}
+
+
+static void dissect_tunnel_bytes(struct selector_key *key, uint8_t * data, size_t length) {
+
+    // TLS traffic can not carry plain text credentials
+
+    if (key->item->tunnel_inspected == 0 && key->active_fd == key->item->client_socket && data[0] == TLS_HANDSHAKE) {
+        key->item->tunnel_dissect = false;
+        return;
+    }
+
+    buffer fresh;
+    buffer_init(&fresh, length, data);
+    buffer_write_adv(&fresh, length);
+
+    pop3_state state = pop3_parse(&fresh, &(key->item->pop3_parser));
+
+    if (state == POP3_SUCCESS) {
+        if (key->item->pop3_parser.user [0]!= 0 && key->item->pop3_parser.pass [0]!= 0) {
+            log(DEBUG, "User: %s", key->item->pop3_parser.user);
+            log(DEBUG, "Pass: %s", key->item->pop3_parser.pass);
+            print_credentials(
+                POP3,key->item->last_target_url.hostname, key->item->last_target_url.port,
+                key->item->pop3_parser.user, key->item->pop3_parser.pass
+            );
+            memset(key->item->pop3_parser.user, 0, MAX_USER_LENGTH);
+            memset(key->item->pop3_parser.pass, 0, MAX_PASS_LENGTH);
+
+            key->item->tunnel_dissect = false;
+        }            
+    }
+
+    key->item->tunnel_inspected += length;
+    if (key->item->tunnel_inspected > POP3_DISSECT_WINDOW)
+        key->item->tunnel_dissect = false;
+
+}
+
+
+static bool body_can_splice(buffer * read_buffer, http_message_parser * parser, http_message * message, splice_pipe * pipe) {
+    if (message->framing != FRAMING_LENGTH || parser->body_state != PENDING)
+        return false;
+
+    // Queued bytes live either in the pipe or in the buffer, never in both
+
+    if (pipe->pending > 0)
+        return true;
+
+    // Buffered bytes go first, spliced ones would overtake them
+
+    if (parser->pending_body_length > 0 || buffer_can_read(read_buffer))
+        return false;
+
+    if (message->body_length - parser->current_body_length < SPLICE_BODY_THRESHOLD)
+        return false;
+
+    return splice_pipe_acquired(pipe) || splice_pipe_acquire(pipe) == 0;
+}
+
+
+static ssize_t body_splice_in(struct selector_key *key, int socket, splice_pipe * pipe, http_message_parser * parser, http_message * message) {
+    size_t remaining = message->body_length - parser->current_body_length;
+    ssize_t moved = splice_pipe_fill(pipe, socket, selector_read_quota(key, MIN(remaining, SPLICE_CHUNK - pipe->pending)));
+    selector_charge_read(key, moved);
+
+    // Content-Length scanning only counts bytes, it never looks at them
+
+    if (moved > 0) {
+        size_t scanned = moved;
+        http_message_parser_body(parser, message, NULL, &scanned);
+    }
 
-    if (readBytes == 0)
-        return END;
+    return moved;
+}
 
-    buffer_write_adv(buffer, readBytes);
 
-    log(DEBUG, "Received %lu bytes from socket %d", (size_t) readBytes, key->active_fd);
+static unsigned body_relay_interests(struct selector_key *key, int source, http_message_parser * parser, splice_pipe * pipe, unsigned state) {
+    struct item * item = key->item;
+    buffer * queue = &(item->read_buffer);
 
-    struct buffer aux_buffer;
-    memcpy(&aux_buffer, buffer, sizeof(struct buffer));
-
-    if (proxy_conf.disectorsEnabled) {
-        pop3_state state = pop3_parse(&aux_buffer, &(key->item->pop3_parser));
-
-        if (state == POP3_SUCCESS) {
-            if (key->item->pop3_parser.user [0]!= 0 && key->item->pop3_parser.pass [0]!= 0) {
-                log(DEBUG, "User: %s", key->item->pop3_parser.user);
-                log(DEBUG, "Pass: %s", key->item->pop3_parser.pass);
-                print_credentials(
-                    POP3,key->item->last_target_url.hostname, key->item->last_target_url.port,
-                    key->item->pop3_parser.user, key->item->pop3_parser.pass
-                );
-                memset(key->item->pop3_parser.user, 0, MAX_USER_LENGTH);
-                memset(key->item->pop3_parser.pass, 0, MAX_PASS_LENGTH);
-            }            
-        }
-    }
+    fd_interest * source_interest = source == item->client_socket ? &(item->client_interest) : &(item->target_interest);
+    fd_interest * sink_interest = source == item->client_socket ? &(item->target_interest) : &(item->client_interest);
+    zerocopy_state * sink_zc = source == item->client_socket ? &(item->target_zc) : &(item->client_zc);
 
-    // Calculate statistics
+    // Reclaim the consumed front of a full buffer, only when the move is
+    // at most as large as the space it frees. Pages pinned by zero-copy
+    // sends wait for their completion.
 
-    add_bytes_recieved(readBytes);
+    size_t queued;
+    buffer_read_ptr(queue, &queued);
+    if (! zerocopy_pending(sink_zc)) {
+        if (queued == 0 || (! buffer_can_write(queue) && queued <= (size_t) (queue->read - queue->data)))
+            buffer_compact(queue);
+    }
 
-    // Declare interest on writing to peer and return
+    bool room = pipe->pending > 0 ? pipe->pending < SPLICE_CHUNK : buffer_can_write(queue);
 
-    if (key->active_fd == key->item->client_socket)
-        key->item->target_interest |= OP_WRITE;
+    if (parser->body_state == PENDING && room)
+        *source_interest |= OP_READ;
     else
-        key->item->client_interest |= OP_WRITE;
+        *source_interest &= ~OP_READ;
 
-    selector_update_fdset(key->s, key->item);
+    if (parser->pending_body_length > 0)
+        *sink_interest |= OP_WRITE;
+    else
+        *sink_interest &= ~OP_WRITE;
 
-    return TCP_TUNNEL;
+    selector_update_fdset(key->s, item);
+
+    return state;
 }
 
 
-static unsigned tcp_tunnel_forward_ready(unsigned int state, struct selector_key *key) {
+static unsigned await_response(struct selector_key * key) {
+    struct item * item = key->item;
 
-    // On this context: read_buffer = client_buffer, write_buffer = target_buffer
+    // Nothing is left to keep, the response is read into the same buffer
 
-    // Choose active socket buffer for reading from it
+    if (! buffer_can_read(&(item->read_buffer))) {
+        buffer_reset(&(item->read_buffer));
+        return RESPONSE_READ;
+    }
 
-    buffer * buffer = key->active_fd == key->item->client_socket
-        ? &(key->item->read_buffer) : &(key->item->write_buffer);
+    // The stash is allocated the first time a connection needs one. Without
+    // it the request is not held, and pipelined bytes can't be kept.
 
-    // If the buffer is empty wait for it to be filled
+    if (item->pipeline_buffer.data == NULL) {
+        uint8_t * data = malloc(CONN_BUFFER);
 
-    if (! buffer_can_read(buffer))
-        return TCP_TUNNEL;
+        if (data == NULL) {
+            buffer_read_adv(&(item->read_buffer), item->held_length);
+            item->held_length = 0;
 
-    // Copy bytes from peer socket buffer to active socket
+            if (buffer_can_read(&(item->read_buffer))) {
+                log_error("Can't allocate the pipelined request stash")
+                return END;
+            }
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(buffer, &size);
-    ssize_t sentBytes = write(key->active_fd, ptr, size);
+            buffer_reset(&(item->read_buffer));
+            return RESPONSE_READ;
+        }
 
-    if (sentBytes < 0) {
-        if(errno != EBADF && errno != EPIPE)
-            log_error("Failed to write to active socket");
-        return END;
+        buffer_init(&(item->pipeline_buffer), CONN_BUFFER, data);
     }
 
-    buffer_read_adv(buffer, sentBytes);
-
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->active_fd);
+    // Bytes after the request are the start of the next pipelined ones,
+    // keep them aside, behind a held request, and read the response into
+    // an empty buffer
 
-    //statistics
-    add_sent_bytes(sentBytes);
+    swap_buffers(&(item->read_buffer), &(item->pipeline_buffer));
+    buffer_reset(&(item->read_buffer));
 
-    // If write is over turn off interest on writing on active socket, then return
+    return RESPONSE_READ;
+}
 
-    if (((size_t) sentBytes) == size) {
-        if (key->active_fd == key->item->client_socket)
-            key->item->client_interest &= ~OP_WRITE;
-        else
-            key->item->target_interest &= ~OP_WRITE;
 
-        selector_update_fdset(key->s, key->item);
-    }
+static int target_connect(struct selector_key * key, int sock, const struct addrinfo * addr) {
 
-    key->item->client_interest |= OP_READ;
-    key->item->target_interest |= OP_READ;
+    // Tunnels are not tried, the origin may be the one to speak first
 
-    return TCP_TUNNEL;
+    bool fastopen = proxy_conf.proxyArgs.fastopen && key->item->req_parser.request.method != CONNECT
+        && socket_fastopen_connect(sock) == 0;
 
-}
+    key->item->target_fastopen = fastopen;
 
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+        return 0;   // Deferred fast open, the handshake starts on the first send
 
-static unsigned error_write_ready(unsigned int state, struct selector_key *key) {
+    return errno == EINPROGRESS ? 0 : -1;
+}
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
-    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
 
-    if (sentBytes < 0) {
-        log(ERROR, "Failed to notify error to client");
-        return END;
+static bool fastopen_failed(struct selector_key * key) {
+    if (! key->item->target_fastopen)
+        return false;
+
+    switch (errno) {
+        case ECONNREFUSED:
+        case ETIMEDOUT:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+            log(INFO, "Fast open connect to %s:%d failed: %s", key->item->last_target_url.hostname, key->item->last_target_url.port, strerror(errno));
+            key->item->target_fastopen = false;
+            return true;
+        default:
+            return false;
     }
+}
 
-    buffer_read_adv(&(key->item->write_buffer), sentBytes);
 
-    //statistics
-    add_sent_bytes(sentBytes);
+static void first_byte_count(struct selector_key * key) {
+    if (key->item->request_ready == 0)
+        return;
 
-    if ((size_t) sentBytes < size)
-        return ERROR_STATE;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
 
-    #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
-    return (unsigned) key->item->data;
+    if (getpeername(key->item->target_socket, (struct sockaddr *) &peer, &peer_len) == 0)
+        endpoint_first_byte((struct sockaddr *) &peer, now_ms() - key->item->request_ready);
 
+    key->item->request_ready = 0;
 }
 
 
-static unsigned client_close_connection_arrival(const unsigned state, struct selector_key *key) {
+static void fastopen_count(struct selector_key * key) {
+    if (! key->item->target_fastopen)
+        return;
 
-    log(DEBUG, "Client closed connection from socket %d", key->item->client_socket);
+    key->item->target_fastopen = false;
 
-    // Read last bytes from write buffer
+    // Once the origin answered the handshake is over for sure
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->write_buffer), &size);
-    ssize_t sentBytes = write(key->item->target_socket, ptr, size);
+    int accepted = socket_fastopen_accepted(key->item->target_socket);
+    if (accepted < 0)
+        return;
 
-    if (sentBytes < 0){
-        return END;
-    }
+    origin * o = origin_get(key->item->last_target_url.hostname, key->item->last_target_url.port);
+    if (o == NULL)
+        return;
 
-    buffer_read_adv(&(key->item->write_buffer), sentBytes);
+    if (accepted)
+        o->tfo_accepted++;
+    else
+        o->tfo_fallback++;
+}
 
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->target_socket);
 
-    //statistics
-    add_sent_bytes(sentBytes);
+static unsigned interim_response_sent(struct selector_key * key) {
+    http_request_parser * req = &(key->item->req_parser);
 
-    if ((size_t) sentBytes < size)
-        return CLIENT_CLOSE_CONNECTION;
+    http_response_parser_reset(&(key->item->res_parser));
 
-    return END;
+    // The final response may have come right behind the interim one
 
-}
+    if (buffer_can_read(&(key->item->read_buffer)))
+        return process_response(key);
 
+    // After 100 Continue the client sends the body it held back, the
+    // buffer is empty and the pipelined bytes stay stashed
 
-static unsigned target_close_connection_arrival(const unsigned state, struct selector_key *key) {
+    if (req->request.message.framing != FRAMING_NONE && req->message_parser.body_state == PENDING) {
+        buffer_reset(&(key->item->read_buffer));
+        return REQ_BODY_RELAY;
+    }
 
-    log(DEBUG, "Target Closed connection from socket %d", key->item->target_socket);
+    return RESPONSE_READ;
+}
 
-    // Read last bytes from write buffer
 
-    size_t size;
-    uint8_t *ptr = buffer_read_ptr(&(key->item->read_buffer), &size);
-    ssize_t sentBytes = write(key->item->client_socket, ptr, size);
+static unsigned response_sent(struct selector_key * key) {
+    http_request_parser * req = &(key->item->req_parser);
 
-    if (sentBytes < 0){
+    // A final response ahead of the body leaves the client mid upload,
+    // its next bytes could not be told apart from a new request
+
+    if (req->request.message.framing != FRAMING_NONE && req->message_parser.body_state == PENDING) {
+        log(DEBUG, "Closing client %d, its request body was never sent", key->item->client_socket);
         return END;
     }
-    buffer_read_adv(&(key->item->read_buffer), sentBytes);
 
-    log(DEBUG, "Sent %lu bytes to socket %d", (size_t) sentBytes, key->item->client_socket);
-    
-    //statistics
-    add_sent_bytes(sentBytes);
+    if (target_reusable(key->item))
+        release_target(key);
 
+    backend_done(key->item->backend);
+    key->item->backend = -1;
+    origin_done(key);
 
-    if ((size_t) sentBytes < size)
-        return TARGET_CLOSE_CONNECTION;
+    key->item->retried = false;
+    key->item->held_length = 0;
 
-    return END;
+    // Either side asked for the connection to end with this exchange,
+    // pipelined requests behind it are dropped
+
+    if (req->request.message.close || key->item->res_parser.response.message.close) {
+        log(DEBUG, "Closing client %d, the exchange announced close", key->item->client_socket);
+        return END;
+    }
 
+    http_request_parser_reset(req);
+    http_response_parser_reset(&(key->item->res_parser));
+    return REQUEST_READ;
 }
 
 
-static unsigned end_arrival(const unsigned state, struct selector_key *key){
+static bool target_reusable(struct item * item) {
+    http_request * req = &(item->req_parser.request);
+    http_response * res = &(item->res_parser.response);
 
-    item_kill(key->s, key->item);
-    remove_conection();
-    return END;
-    
+    if (item->target_socket <= 0 || req->message.close || res->message.close)
+        return false;
+
+    // An upgraded connection, or one the client tried to upgrade, is not HTTP anymore
+
+    if (res->status == SWITCHING_PROTOCOLS || http_has_header(&(req->message), HEADER_UPGRADE))
+        return false;
+
+    // HTTP/1.0 origins close unless told otherwise, which is not worth parsing.
+    // The version fills its whole field, it is not NUL terminated.
+
+    if (strncmp(res->version, "HTTP/1.1", VERSION_LENGTH) != 0 || res->message.framing == FRAMING_CLOSE)
+        return false;
+
+    // Nothing of this exchange may still be in flight
+
+    return item->target_pipe.pending == 0 && !zerocopy_pending(&(item->target_zc));
 }
 
 
-/* -------------------------------------- AUXILIARS IMPLEMENTATIONS -------------------------------------- */
+static void release_target(struct selector_key * key) {
+    struct item * item = key->item;
 
-static unsigned notify_error(struct selector_key *key, int status_code, unsigned next_state) {
-    
-    print_Access(inet_ntoa(key->item->client.sin_addr),ntohs(key->item->client.sin_port), key->item->req_parser.request.url,  key->item->req_parser.request.method,status_code);
-    http_request_parser_reset(&(key->item->req_parser));
-    http_response_parser_reset(&(key->item->res_parser));
+    // The selector must forget the socket before the item does
 
-    size_t space;
-    char * ptr = (char *) buffer_write_ptr(&(key->item->write_buffer), &space);
+    item->target_interest = OP_NOOP;
+    selector_update_fdset(key->s, item);
 
-    http_response res = { .status = status_code };
-    int written = write_response(&res, ptr, space, false);
+    upstream_pool_put(item->target_socket, item->last_target_url.hostname, item->last_target_url.port);
+    item->target_socket = -1;
+}
 
-    buffer_write_adv(&(key->item->write_buffer), written);
 
-    #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
-    key->item->data = (void *) next_state;
+static void release_sent(buffer * b, zerocopy_state * zc, ssize_t sent) {
+    if (zerocopy_pending(zc))
+        b->read += sent;
+    else
+        buffer_read_adv(b, sent);
+}
 
-    return ERROR_STATE;
 
+static void write_template(buffer * b, const response_template * t) {
+    size_t space;
+    uint8_t * ptr = buffer_write_ptr(b, &space);
+
+    size_t length = MIN(t->length, space);
+    memcpy(ptr, t->data, length);
+    buffer_write_adv(b, length);
 }
 
 
@@ -1307,9 +2924,16 @@ static unsigned process_request(struct selector_key * key) {
 
     // Parse the request and check for pending and failure cases
 
-    parse_state parser_state = http_request_parser_parse(
-        &(key->item->req_parser), &(key->item->read_buffer)
-    );
+    http_message * message = &(key->item->req_parser.request.message);
+    buffer view = head_view(&(key->item->read_buffer), message);
+
+    size_t unparsed, left;
+    buffer_read_ptr(&view, &unparsed);
+
+    parse_state parser_state = http_request_parser_parse(&(key->item->req_parser), &view);
+
+    buffer_read_ptr(&view, &left);
+    message->head_length += unparsed - left;
 
     if (parser_state == PENDING)
         return REQUEST_READ;
@@ -1322,12 +2946,30 @@ static unsigned process_request(struct selector_key * key) {
     // Parse the request target URL
 
     memset(&(key->item->doh), 0, sizeof(struct doh_client));
-    int r = parse_url(request->url, &(key->item->doh.url));
-    // TODO: Move parsed URL to another structure
 
-    if (r < 0)
+    if (parse_url(request->url, &(request->parsed_url)) < 0)
         return notify_error(key, BAD_REQUEST, REQUEST_READ);
 
+    // Credentials in the URL are not forwarded
+
+    url_drop_userinfo(request->url, &(request->parsed_url));
+
+    // As a reverse proxy the upstream group stands in for the origin,
+    // origin-form requests keep the Host header the client sent
+
+    if (backend_count() > 0) {
+        if (request->method == CONNECT)
+            return notify_error(key, METHOD_NOT_ALLOWED, REQUEST_READ);
+
+        key->item->backend = backend_pick();
+        const backend * chosen = backend_at(key->item->backend);
+
+        strcpy(request->parsed_url.hostname, chosen->host);
+        request->parsed_url.port = chosen->port;
+    }
+
+    memcpy(&(key->item->doh.url), &(request->parsed_url), sizeof(struct url));
+
     if (strlen(request->url) == 0)
         return notify_error(key, BAD_REQUEST, REQUEST_READ);
 
@@ -1343,6 +2985,7 @@ static unsigned process_request(struct selector_key * key) {
 
     if (key->item->target_socket > 0) {
         close(key->item->target_socket);
+        key->item->target_socket = -1;
     }
 
     // Prepare to connect to new target
@@ -1356,37 +2999,59 @@ static unsigned process_request(struct selector_key * key) {
         return notify_error(key, FORBIDDEN, REQUEST_READ);
     }
 
-    // Prepare to resolve target address
+    // Origins that keep failing are not tried until their breaker cools down
 
-    /*--------- Chequeo si el target esta en formato IP o es Localhost ---------*/
-    struct addrinfo * addrinfo;
-    if (resolve_string(&(addrinfo), key->item->doh.url.hostname, key->item->doh.url.port) >= 0) {
+    if (! origin_allow(key->item->doh.url.hostname, key->item->doh.url.port, key->item->client_socket)) {
+        log(INFO, "Rejected request to %s:%d, its circuit is open", key->item->doh.url.hostname, key->item->doh.url.port);
+        return notify_error(key, SERVICE_UNAVAILABLE, REQUEST_READ);
+    }
 
-        if (is_proxy_host(addrinfo->ai_addr) && key->item->doh.url.port == proxy_conf.proxyArgs.proxy_port) {
-            log(INFO, "Prevented proxy loop")
-            free(addrinfo);
-            return notify_error(key, FORBIDDEN, REQUEST_READ);
-        }
+    // Each origin takes a bounded number of connections, the requests
+    // over it wait their turn
+
+    switch (origin_acquire(key->item->doh.url.hostname, key->item->doh.url.port, key->item->client_socket, &(key->item->origin))) {
+        case ORIGIN_FULL:
+            log(INFO, "Rejected request to %s:%d, too many waiting for a connection", key->item->doh.url.hostname, key->item->doh.url.port);
+            return notify_error(key, SERVICE_UNAVAILABLE, REQUEST_READ);
+        case ORIGIN_QUEUED:
+            key->item->queued_until = now_ms() + proxy_conf.originQueueTimeout;
+            return ORIGIN_WAIT;
+        default:
+            return open_target(key);
+    }
+}
 
-        int sock = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
 
-        selector_fd_set_nio(sock);
+static unsigned open_target(struct selector_key * key) {
+    http_request * request = &(key->item->req_parser.request);
 
-        if (sock < 0) 
-            return notify_error(key, BAD_GATEWAY, REQUEST_READ);
+    // An idle connection to the origin skips resolution and the handshake.
+    // A retry skips the pool, the next idle connection may be as stale.
 
-        if (connect(sock, addrinfo->ai_addr, addrinfo->ai_addrlen) == -1) {
-            if (errno == EINPROGRESS) {
-                key->item->target_socket = sock;
-                free(addrinfo);
-                return REQUEST_CONNECT;
-            } else {
-                free(addrinfo);
-                return notify_error(key, BAD_GATEWAY, REQUEST_READ);
-            }
-        } else {
-            abort(); // Such a thing can't happen!
+    key->item->target_pooled = false;
+
+    if (request->method != CONNECT && ! key->item->retried) {
+        int pooled = upstream_pool_get(key->item->doh.url.hostname, key->item->doh.url.port, AF_UNSPEC);
+        if (pooled > 0) {
+            key->item->target_socket = pooled;
+            key->item->target_pooled = true;
+            key->item->target_fastopen = false;
+            zerocopy_init(&(key->item->target_zc));
+            return target_connected(key);
         }
+    }
+
+    // Prepare to resolve target address
+
+    /*--------- Chequeo si el target esta en formato IP o es Localhost ---------*/
+    struct addrinfo * addrinfo;
+    if (resolve_string(&(addrinfo), key->item->doh.url.hostname, key->item->doh.url.port) >= 0) {
+
+        // A race of one, for the connect deadline
+
+        key->item->doh.target_address_list = addrinfo;
+        key->item->doh.current_target_addr = addrinfo;
+        return TRY_IPS;
 
     } else {
         if (doh_client_init(key) < 0) {
@@ -1399,51 +3064,142 @@ static unsigned process_request(struct selector_key * key) {
 }
 
 
+static bool retryable(struct item * item) {
+    http_request_parser * rp = &(item->req_parser);
+    methods method = rp->request.method;
+
+    if (! item->target_pooled || item->retried)
+        return false;
+
+    if (method != GET && method != HEAD && method != OPTIONS)
+        return false;
+
+    return rp->request.message.framing == FRAMING_NONE || rp->message_parser.body_state == SUCCESS;
+}
+
+
+static unsigned retry_request(struct selector_key * key) {
+    struct item * item = key->item;
+
+    log(INFO, "Pooled connection to %s:%d was stale, retrying on a fresh one", item->doh.url.hostname, item->doh.url.port);
+    upstream_pool_retried();
+
+    item->target_interest = OP_NOOP;
+    selector_update_fdset(key->s, item);
+    close(item->target_socket);
+    item->target_socket = -1;
+
+    // The held request waits unread in the pipeline buffer, ahead of any
+    // pipelined bytes. Both go back to be processed again.
+
+    if (item->held_length > 0) {
+        swap_buffers(&(item->read_buffer), &(item->pipeline_buffer));
+        buffer_reset(&(item->pipeline_buffer));
+    }
+
+    item->held_length = 0;
+    item->retried = true;
+
+    backend_done(item->backend);
+    item->backend = -1;
+    origin_done(key);
+
+    http_request_parser_reset(&(item->req_parser));
+    http_response_parser_reset(&(item->res_parser));
+
+    return process_request(key);
+}
+
+
+static void origin_done(struct selector_key * key) {
+
+    // A hedge still running holds a connection of the same origin
+
+    if (key->item->hedge_socket >= 0)
+        drop_hedge(key, false);
+
+    int waiting = origin_release(key->item->origin, key->item->client_socket);
+    key->item->origin = -1;
+
+    if (waiting > 0)
+        selector_wake(key->s, waiting);
+}
+
+
 static void process_request_headers(http_request * req, char * target_host, char * proxy_host) {
 
     bool replaced_host_header = false;
     bool replaced_via_header = false;
     bool close_detected = false;
 
-    for (size_t i=0; i < req->message.header_count; i++) {
+    http_message * message = &(req->message);
+    char value[HEADER_LENGTH];
 
-        // Right trim header names
+    for (size_t i=0; i < message->header_count; i++) {
 
-        rtrim(req->message.headers[i][0]);
+        if (message->edits[i] == EDIT_DELETE)
+            continue;
 
-        // Replace Host header if target hostname is not empty
+        switch (message->header_ids[i]) {
 
-        if (strcmp(req->message.headers[i][0], "Host") == 0 && strlen(target_host) > 0) {
-            strcpy(req->message.headers[i][1], " ");
-            strcpy(req->message.headers[i][1] + 1, target_host);
-            replaced_host_header = true;
-        }
+            // Replace Host header if target hostname is not empty
 
-        // Replace Via header appending proxy hostname
+            case HEADER_HOST:
+                if (strlen(target_host) > 0) {
+                    snprintf(value, HEADER_LENGTH, " %s", target_host);
+                    http_edit_replace(message, i, value);
+                    replaced_host_header = true;
+                }
+                break;
 
-        if (strcmp(req->message.headers[i][0], "Via") == 0) {
-            char new_token[128];
-            sprintf(new_token, ", 1.1 %s", proxy_host);
+            // Replace Via header appending proxy hostname
 
-            strcat(req->message.headers[i][1], new_token);
-            
-            replaced_via_header = true;
-        }
+            case HEADER_VIA:
+                snprintf(value, HEADER_LENGTH, "%.*s, 1.1 %s", HEADER_LENGTH / 2, message->headers[i][1], proxy_host);
+                http_edit_replace(message, i, value);
+                replaced_via_header = true;
+                break;
+
+            // Content-Length is meaningless next to a chunked Transfer-Encoding
+
+            case HEADER_CONTENT_LENGTH:
+                if (message->framing == FRAMING_CHUNKED)
+                    http_edit_delete(message, i);
+                break;
 
-        // Remove headers listed on Connection header
+            // Remove headers listed on Connection header
 
-        if (strcmp(req->message.headers[i][0], "Connection") == 0) {
-            char * connection_headers = req->message.headers[i][1];
+            case HEADER_CONNECTION: {
+                char * connection_headers = message->headers[i][1];
 
-            if (strstr(connection_headers, "Close"))
-                close_detected = true;
+                if (http_list_contains(connection_headers, "close"))
+                    close_detected = true;
 
-            for(size_t j=0; j < req->message.header_count; j++) {
-                if (strstr(connection_headers, req->message.headers[j][0])) {
-                    remove_array_elem(req->message.headers, j, req->message.header_count);
-                    req->message.header_count -= 1;
+                for(size_t j=0; j < message->header_count; j++) {
+                    if (j != i && http_list_contains(connection_headers, message->headers[j][0]))
+                        http_edit_delete(message, j);
                 }
+                break;
             }
+
+            // Older clients talk to proxies through Proxy-Connection instead
+
+            case HEADER_PROXY_CONNECTION:
+                if (http_list_contains(message->headers[i][1], "close"))
+                    close_detected = true;
+                http_edit_delete(message, i);
+                break;
+
+            // Hop-by-hop headers end here even when Connection does not list them
+
+            case HEADER_KEEP_ALIVE:
+            case HEADER_TE:
+            case HEADER_UPGRADE:
+                http_edit_delete(message, i);
+                break;
+
+            default:
+                break;
         }
 
     }
@@ -1451,25 +3207,18 @@ static void process_request_headers(http_request * req, char * target_host, char
     // If a Host header was not present but a hostname was given, add it
 
     if(!replaced_host_header && strlen(target_host) > 0) {
-        req->message.header_count += 1;
-        strcpy(req->message.headers[req->message.header_count - 1][0], "Host");
-        strcpy(req->message.headers[req->message.header_count - 1][1], " ");
-        strcpy(req->message.headers[req->message.header_count - 1][1] + 1, target_host);
+        snprintf(value, HEADER_LENGTH, " %s", target_host);
+        http_edit_insert(message, HEADER_HOST, "Host", value);
     }
 
     // If a Via header was not present, add it
 
     if(!replaced_via_header) {
-        req->message.header_count += 1;
-        sprintf(req->message.headers[req->message.header_count - 1][0], "Via");
-        sprintf(req->message.headers[req->message.header_count - 1][1], " 1.1 %s", proxy_host);
+        snprintf(value, HEADER_LENGTH, " 1.1 %s", proxy_host);
+        http_edit_insert(message, HEADER_VIA, "Via", value);
     }
 
-    /// TODO: Handle close detected
-
-    if (close_detected) {
-        log(DEBUG, "Should close connection");
-    }
+    message->close = close_detected;
 
 }
 
@@ -1480,7 +3229,7 @@ static int extract_http_credentials(http_request * request) {
     int found=0;
 
     for (size_t i = 0; i < request->message.header_count&&!found; i++){
-        if (strcmp(request->message.headers[i][0],"Authorization")==0){
+        if (request->message.header_ids[i] == HEADER_AUTHORIZATION){
             strncpy(raw_authorization,request->message.headers[i][1], HEADER_LENGTH);
             int k=0;
             while (isspace(raw_authorization[k]))
@@ -1488,7 +3237,7 @@ static int extract_http_credentials(http_request * request) {
                 k++;
             }
             
-            if(strncmp(&raw_authorization[k],"Basic ",6)==0){
+            if(strncasecmp(&raw_authorization[k],"Basic ",6)==0){
                 // strcpy(raw_authorization,&raw_authorization[7]);
                 //max header length minus the chars in "Basic "
                 for (int j = 0; j < (HEADER_LENGTH-6-k); j++)
@@ -1521,9 +3270,7 @@ static int extract_http_credentials(http_request * request) {
         }
         strcpy(pass,(char*)&user_pass[j]);
         
-        struct url url;
-        parse_url(request->url, &url);
-        print_credentials(HTTP,url.hostname, url.port,user,pass);
+        print_credentials(HTTP, request->parsed_url.hostname, request->parsed_url.port, user, pass);
     }
     
 
@@ -1537,9 +3284,16 @@ static unsigned process_response(struct selector_key * key) {
 
     bool ignore_length = key->item->req_parser.request.method == HEAD ? true : false;
 
-    parse_state parser_state = http_response_parser_parse(
-        &(key->item->res_parser), &(key->item->read_buffer), ignore_length
-    );
+    http_message * message = &(key->item->res_parser.response.message);
+    buffer view = head_view(&(key->item->read_buffer), message);
+
+    size_t unparsed, left;
+    buffer_read_ptr(&view, &unparsed);
+
+    parse_state parser_state = http_response_parser_parse(&(key->item->res_parser), &view, ignore_length);
+
+    buffer_read_ptr(&view, &left);
+    message->head_length += unparsed - left;
 
     if (parser_state == PENDING)
         return RESPONSE_READ;
@@ -1553,25 +3307,41 @@ static unsigned process_response(struct selector_key * key) {
 
     http_response * response = &(key->item->res_parser.response);
 
+    if (! HTTP_STATUS_INTERIM(response->status)) {
+        if (response->status >= INTERNAL_SERVER_ERROR)
+            origin_failed(key->item->origin);
+        else
+            origin_succeeded(key->item->origin);
+    }
+
     // Process response headers
 
-    char proxy_hostname[VIA_PROXY_NAME_SIZE] = {0};
-    if(strlen(proxy_conf.viaProxyName) > 0) {
-        strncpy(proxy_hostname, proxy_conf.viaProxyName, VIA_PROXY_NAME_SIZE);
-    } else {
-        get_machine_fqdn(proxy_hostname);
-    }
+    char proxy_hostname[VIA_PROXY_NAME_SIZE];
+    via_token(proxy_hostname);
 
     process_response_headers(response, proxy_hostname);
 
-    // Write processed response bytes into write buffer
+    // Point the writer at the processed response, body bytes that arrived
+    // along with the head go out in the same send
 
-    size_t space;
-    char * ptr = (char *) buffer_write_ptr(&(key->item->write_buffer), &space);
+    http_writer_response(&(key->item->writer), response);
+
+    if (response->message.framing != FRAMING_NONE) {
+        http_response_parser * rp = &(key->item->res_parser);
+
+        size_t remaining;
+        uint8_t * body = buffer_read_ptr(&(key->item->read_buffer), &remaining) + message->head_length;
+        remaining -= message->head_length;
 
-    int written = write_response(response, ptr, space, false);
+        parse_state body_state = http_message_parser_body(
+            &(rp->message_parser), &(rp->response.message), body, &remaining
+        );
 
-    buffer_write_adv(&(key->item->write_buffer), written);
+        if (body_state == FAILED)
+            return notify_error(key, BAD_GATEWAY, REQUEST_READ);
+
+        http_writer_body(&(key->item->writer), body, rp->message_parser.pending_body_length);
+    }
 
     // Go to forward response state
 
@@ -1585,37 +3355,64 @@ static void process_response_headers(http_response * res, char * proxy_host) {
     bool replaced_via_header = false;
     bool close_detected = false;
 
-    for (size_t i=0; i < res->message.header_count; i++) {
+    http_message * message = &(res->message);
+    char value[HEADER_LENGTH];
+
+    for (size_t i=0; i < message->header_count; i++) {
 
-        // Right trim header names
+        if (message->edits[i] == EDIT_DELETE)
+            continue;
 
-        rtrim(res->message.headers[i][0]);
+        switch (message->header_ids[i]) {
 
-        // Replace Via header appending proxy hostname
+            // Replace Via header appending proxy hostname
 
-        if (strcmp(res->message.headers[i][0], "Via") == 0) {
-            char new_token[128];
-            sprintf(new_token, ", 1.1 %s", proxy_host);
+            case HEADER_VIA:
+                snprintf(value, HEADER_LENGTH, "%.*s, 1.1 %s", HEADER_LENGTH / 2, message->headers[i][1], proxy_host);
+                http_edit_replace(message, i, value);
+                replaced_via_header = true;
+                break;
 
-            strcat(res->message.headers[i][1], new_token);
-            
-            replaced_via_header = true;
-        }
+            // Content-Length is meaningless next to a chunked Transfer-Encoding
+
+            case HEADER_CONTENT_LENGTH:
+                if (message->framing == FRAMING_CHUNKED)
+                    http_edit_delete(message, i);
+                break;
+
+            // Remove headers listed on Connection header
+
+            case HEADER_CONNECTION: {
+                char * connection_headers = message->headers[i][1];
 
-        // Remove headers listed on Connection header
+                if (http_list_contains(connection_headers, "close"))
+                    close_detected = true;
 
-        if (strcmp(res->message.headers[i][0], "Connection") == 0) {
-            char * connection_headers = res->message.headers[i][1];
+                for(size_t j=0; j < message->header_count; j++) {
+                    if (j != i && http_list_contains(connection_headers, message->headers[j][0]))
+                        http_edit_delete(message, j);
+                }
 
-            if (strstr(connection_headers, "Close"))
-                close_detected = true;
+                // The client connection is closed after a close-delimited body
 
-            for(size_t j=0; j < res->message.header_count; j++) {
-                if (strstr(connection_headers, res->message.headers[j][0])) {
-                    remove_array_elem(res->message.headers, j, res->message.header_count);
-                    res->message.header_count -= 1;
+                if (message->framing == FRAMING_CLOSE) {
+                    http_edit_replace(message, i, " close");
+                    close_detected = true;
                 }
+                break;
             }
+
+            // Hop-by-hop headers end here even when Connection does not list them
+
+            case HEADER_KEEP_ALIVE:
+            case HEADER_PROXY_CONNECTION:
+            case HEADER_TE:
+            case HEADER_UPGRADE:
+                http_edit_delete(message, i);
+                break;
+
+            default:
+                break;
         }
 
     }
@@ -1623,15 +3420,17 @@ static void process_response_headers(http_response * res, char * proxy_host) {
     // If a Via header was not present, add it
 
     if(!replaced_via_header) {
-        res->message.header_count += 1;
-        sprintf(res->message.headers[res->message.header_count - 1][0], "Via");
-        sprintf(res->message.headers[res->message.header_count - 1][1], "1.1 %s", proxy_host);
+        snprintf(value, HEADER_LENGTH, " 1.1 %s", proxy_host);
+        http_edit_insert(message, HEADER_VIA, "Via", value);
     }
 
-    /// TODO: Handle close detected
+    // If the body is close-delimited and the target did not say so, tell the client
 
-    if (close_detected) {
-        log(DEBUG, "Should close connection");
+    if (message->framing == FRAMING_CLOSE && !close_detected) {
+        http_edit_insert(message, HEADER_CONNECTION, "Connection", " close");
+        close_detected = true;
     }
 
+    message->close = close_detected;
+
 }
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <http.h>
+#include <config.h>
+#include <address.h>
+#include <logger.h>
+#include <proxy_templates.h>
+
+/*-----------------------------------------
+ *          CANNED RESPONSES
+ *-----------------------------------------
+ *  Every status notify_error may send, serialized with write_response so
+ *  the bytes match what used to be formatted on each error.
+ */
+
+static const int canned_statuses[] = {
+    BAD_REQUEST, FORBIDDEN, METHOD_NOT_ALLOWED, CONFLICT, PAYLOAD_TOO_LARGE, URI_TOO_LONG,
+    INTERNAL_SERVER_ERROR, NOT_IMPLEMENTED, BAD_GATEWAY, SERVICE_UNAVAILABLE, GATEWAY_TIMEOUT
+};
+
+#define CANNED_COUNT (sizeof(canned_statuses) / sizeof(canned_statuses[0]))
+#define TEMPLATE_SIZE 128
+
+static char canned_bytes[CANNED_COUNT][TEMPLATE_SIZE];
+static response_template canned[CANNED_COUNT];
+
+// A 2xx response to CONNECT must not carry Content-Length (RFC 7231 - Section 4.3.6)
+static const char connect_bytes[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+static const response_template connect_established = { connect_bytes, sizeof(connect_bytes) - 1 };
+
+static const char continue_bytes[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static const response_template continue_response = { continue_bytes, sizeof(continue_bytes) - 1 };
+
+
+/*-----------------------------------------
+ *          VIA TOKEN
+ *-----------------------------------------
+ *  getaddrinfo blocks, so it never runs on the event loop. Unless the
+ *  name is configured, the token is resolved once before accepting
+ *  connections and then refreshed by a detached thread, readers copy it
+ *  under the mutex.
+ */
+
+static char fqdn[VIA_PROXY_NAME_SIZE];
+static pthread_mutex_t fqdn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void resolve_fqdn(void) {
+    static bool failing = false;
+    char resolved[1024] = {0};
+
+    // A lookup that keeps failing is only reported once
+
+    if (get_machine_fqdn(resolved) < 0) {
+        if (! failing)
+            log(INFO, "Can't resolve the proxy FQDN, Via uses the host name");
+        failing = true;
+
+        if (gethostname(resolved, sizeof(resolved) - 1) < 0)
+            return;
+    } else {
+        failing = false;
+    }
+
+    pthread_mutex_lock(&fqdn_mutex);
+    strncpy(fqdn, resolved, VIA_PROXY_NAME_SIZE - 1);
+    pthread_mutex_unlock(&fqdn_mutex);
+}
+
+static void * refresh_fqdn(void * arg) {
+    (void) arg;
+    while (1) {
+        sleep(VIA_REFRESH_INTERVAL);
+        resolve_fqdn();
+    }
+    return NULL;
+}
+
+
+void init_templates(void) {
+    for (size_t i = 0; i < CANNED_COUNT; i++) {
+        http_response res = { .status = canned_statuses[i] };
+        int written = write_response(&res, canned_bytes[i], TEMPLATE_SIZE, false);
+
+        canned[i].data = canned_bytes[i];
+        canned[i].length = written > 0 ? (size_t) written : 0;
+    }
+
+    if (proxy_conf.viaProxyName[0] != '\0')
+        return;
+
+    resolve_fqdn();
+
+    pthread_t refresher;
+    if (pthread_create(&refresher, NULL, refresh_fqdn, NULL) != 0) {
+        log(ERROR, "Creating Via token refresh thread");
+        return;
+    }
+    pthread_detach(refresher);
+}
+
+
+const response_template * template_for_status(int status) {
+    for (size_t i = 0; i < CANNED_COUNT; i++) {
+        if (canned_statuses[i] == status)
+            return &canned[i];
+    }
+    return NULL;
+}
+
+
+const response_template * template_connect_established(void) {
+    return &connect_established;
+}
+
+
+const response_template * template_continue(void) {
+    return &continue_response;
+}
+
+
+void via_token(char * out) {
+    if (proxy_conf.viaProxyName[0] != '\0') {
+        strncpy(out, proxy_conf.viaProxyName, VIA_PROXY_NAME_SIZE - 1);
+        out[VIA_PROXY_NAME_SIZE - 1] = '\0';
+        return;
+    }
+
+    pthread_mutex_lock(&fqdn_mutex);
+    memcpy(out, fqdn, VIA_PROXY_NAME_SIZE);
+    pthread_mutex_unlock(&fqdn_mutex);
+}
@@ -5,17 +5,24 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netdb.h>
-#include <http.h>
-#include <netdb.h>
 
-#define LINK_LENGTH 100
-#define PATH_LENGTH 100
-#define PROTOCOL_LENGTH 6
+// Longest DNS name is 253 chars (RFC 1035 - Section 2.3.4), also fits any IPv6 literal
+#define HOST_LENGTH 256
+
+// Part of the text a URL was parsed from
+struct url_span {
+    size_t offset;
+    size_t length;
+};
+
 struct url {
-    char hostname[LINK_LENGTH];
+    struct url_span scheme;         // Empty on authority-form and origin-form
+    struct url_span userinfo;       // Without the trailing '@', at offset 0 if the URL has none
+    struct url_span host;           // Without the brackets of IPv6 literals
+    struct url_span path;           // Path and query, empty if the URL has none
+
+    char hostname[HOST_LENGTH];     // NUL terminated copy of the host
     int port;
-    char path[PATH_LENGTH];
-    char protocol[PROTOCOL_LENGTH];
 };
 
 int sockaddr_print(const struct sockaddr *address, char * addrBuffer);
@@ -25,7 +32,15 @@ int sockaddr_equal(const struct sockaddr *addr1, const struct sockaddr *addr2);
 // Gets machine FQDN if available, or unqualified hostname otherwise
 int get_machine_fqdn(char * fqdn);
 
-int parse_url(char * text, struct url * url);
+/*
+ * Parses a request target in origin, absolute, authority or asterisk form
+ * (RFC 7230 - Section 5.3) in a single pass without allocating.
+ * Spans refer to `text`, which must outlive them. Returns -1 if malformed.
+ */
+int parse_url(const char * text, struct url * url);
+
+// Cuts the userinfo and its '@' out of `text`, shifting the spans after it
+void url_drop_userinfo(char * text, struct url * url);
 /* returns 1 if it shares the ip with some interface of the proxy if not return 0*/
 int is_proxy_host(const struct sockaddr * input);
 
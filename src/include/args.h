@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 
+// Members of the upstream group a reverse proxy may have
+#define MAX_UPSTREAMS 16
+
 struct doh {
     char           *host;
     char           *ip;
@@ -19,6 +22,15 @@ struct proxy_args {
     unsigned short  mng_port;
 
     bool            disectors_enabled;
+    bool            zerocopy;
+    bool            fastopen;
+    bool            hedge;
+    int             connect_timeout;    // ms, 0 keeps the configured default
+    int             origin_max_conns;   // 0 keeps the configured default
+    int             origin_queue_timeout; // ms, 0 keeps the configured default
+
+    char *          upstreams[MAX_UPSTREAMS]; // host:port of each member, reverse proxy mode if any
+    int             upstream_count;
 
     struct doh      doh;
 };
@@ -0,0 +1,41 @@
+#ifndef BACKENDS_H
+#define BACKENDS_H
+
+#include <address.h>
+
+/**
+ * backends.c -- Upstream group of the reverse proxy mode.
+ *
+ * When the group has members every request goes to one of them instead of
+ * the origin its URL names. Members are picked with the power of two
+ * choices: two of them at random, the one with fewer requests in flight.
+ */
+
+typedef struct backend {
+    char            host[HOST_LENGTH];
+    int             port;
+
+    unsigned        in_flight;          // requests picked for it and not yet over
+    unsigned long   requests;           // requests picked for it since start
+} backend;
+
+/*
+ * Sets up the group from `host:port` specs. Returns -1 if one of them is
+ * malformed or there are more than MAX_UPSTREAMS.
+ */
+int backends_init(char ** specs, int count);
+
+// Members of the group, 0 when not in reverse proxy mode
+int backend_count(void);
+
+/*
+ * Picks the member for a new request, counting it as in flight until
+ * backend_done is called with the returned index.
+ */
+int backend_pick(void);
+
+void backend_done(int index);
+
+const backend * backend_at(int index);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <args.h>
+#include <socket_options.h>
 
 #define VIA_PROXY_NAME_SIZE 128
 #define BLACKLIST_SIZE 1024
@@ -20,6 +21,25 @@ typedef struct Config {
 
     int logLevel;                               // Minimum log level to display of [DEBUG, INFO, ERROR, FATAL]. Default is DEBUG.
 
+    int socketPolicy[SOCKET_CLASS_COUNT][SOCKOPT_COUNT]; // TCP options per socket class, SOCKOPT_UNSET keeps the kernel default.
+
+    int upstreamPoolSize;                       // Idle origin connections kept for reuse, or 0 to disable pooling. Default is 64.
+    int upstreamPoolPerOrigin;                  // Idle connections kept for a single origin. Default is 8.
+    int upstreamIdleTimeout;                    // Seconds an idle origin connection is kept. Default is 30.
+
+    int connectTimeout;                         // Milliseconds a connect to a single target address may take. Default is 3000.
+    int unreachableTtl;                         // Seconds an address that failed a connect is tried last. Default is 10.
+
+    int originMaxConns;                         // Connections in use to a single origin, or 0 for no cap. Default is 0.
+    int originQueueTimeout;                     // Milliseconds a request may wait for an origin connection. Default is 5000.
+
+    int breakerFailures;                        // Failures in a row that open an origin circuit or eject an address, or 0 to disable them. Default is 5.
+    int breakerErrorRate;                       // Percentage of failed requests in a window that opens an origin circuit. Default is 50.
+    int breakerCooldown;                        // Seconds a circuit stays open or an address ejected before a probe. Default is 10.
+
+    int hedgePercentile;                        // Percentile of the address first byte times a GET waits before it is hedged. Default is 95.
+    int hedgeMaxRate;                           // Percentage of the eligible requests that may be hedged. Default is 5.
+
     struct proxy_args proxyArgs;                // This is not modifiable on runtime, but its here for allowing global access to args.
 } Config;
 
@@ -10,15 +10,24 @@
 #include <netdb.h>
 #include <args.h>
 #include <address.h>
+#include <buffer.h>
 #include <sys/time.h>
+#include <http_response_parser.h>
+
+// Queries sent for each resolution, AAAA and A
+#define DOH_QUERIES 2
 
 struct doh_client {
     int                 family;
-    struct addrinfo *   target_address_list;
-    struct addrinfo *   current_target_addr;
+    struct addrinfo *   target_address_list;    // Both families interleaved, IPv6 first
+    struct addrinfo *   current_target_addr;    // Next address to try
     struct url          url;
     int                 server_socket;
     buffer              buff;
+    unsigned            pending;                // Queries still unanswered
+    unsigned            answered;
+    struct addrinfo *   answers[DOH_QUERIES];   // Addresses of each answer, merged once all arrived
+    http_response_parser * parser;              // Parses the answer being read, reset after each one
 };
 
 struct selector_key * selector_key;
@@ -27,14 +36,27 @@ void config_doh_client(struct doh * args);
 
 int send_doh_request(struct selector_key *key, int type);
 
+// Sends the AAAA and A queries back to back. Returns 0 on success, -1 on failure
+int doh_client_query(struct selector_key *key);
+
 // Returns 0 on success, -1 on failure
 int doh_client_init(struct selector_key *key);
 
-// Returns the amount of answers obtained
+// Reads the answers that arrived. Returns how many queries are still
+// pending, or -1 on failure. At 0 the target address list is ready. If
+// the server closes or fails after an answer, the ones that arrived are
+// used.
 int doh_client_read(struct selector_key *key);
 
+// Gives up on the answers still pending and builds the target address
+// list from the ones that arrived
+void doh_client_settle(struct selector_key *key);
+
 int resolve_string(struct addrinfo ** addrinfo, const char * target, int port);
 
+// Closes the connection to the DoH server, keeping the resolved addresses
+void doh_disconnect(struct selector_key * key);
+
 void doh_kill(struct selector_key * key);
 
 #endif //PC_2021A_06_DOH_CLIENT_H
@@ -0,0 +1,105 @@
+#ifndef ENDPOINTS_H
+#define ENDPOINTS_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/**
+ * endpoints.c -- Per resolved address bookkeeping.
+ *
+ * Endpoints are identified by the address and port connects go to, so
+ * every origin replica has its own entry. The table has a fixed size,
+ * when it is full the endpoint used least recently gives its slot away.
+ *
+ * An address whose connects failed proxy_conf.breakerFailures times in a
+ * row is ejected, races leave it out for proxy_conf.breakerCooldown
+ * seconds. Then a single race may probe it, and one more failure ejects
+ * it again.
+ */
+
+#define ENDPOINT_TABLE_SIZE 256
+
+// Weight of the newest sample on the latency averages
+#define ENDPOINT_EWMA_WEIGHT 0.2
+
+// First byte times kept for percentiles, the oldest is overwritten
+#define ENDPOINT_SAMPLES 32
+
+typedef struct endpoint {
+    struct sockaddr_storage addr;       // AF_UNSPEC on free slots
+    time_t          last_used;
+
+    time_t          unreachable_until;  // connects are tried last until then
+    unsigned long   connect_failures;   // connects that failed or ran out of time
+
+    unsigned        consecutive_failures;
+    time_t          ejected_until;      // left out of races until then
+    unsigned long   ejections;          // times it was ejected
+
+    unsigned long   connects;           // connects timed
+    unsigned long   responses;          // responses whose first byte was timed
+    double          connect_ms;         // moving average of the connect time
+    double          first_byte_ms;      // moving average of the time to the first response byte
+    long            first_byte_samples[ENDPOINT_SAMPLES]; // latest first byte times, by responses count
+} endpoint;
+
+/*
+ * Returns the entry of `addr`, claiming a slot for it if it had none.
+ * Never fails, it evicts instead.
+ */
+endpoint * endpoint_get(const struct sockaddr * addr);
+
+/*
+ * Records a failed connect to `addr`, which is then considered
+ * unreachable for proxy_conf.unreachableTtl seconds, or ejected if it
+ * failed too many times in a row.
+ */
+void endpoint_failed(const struct sockaddr * addr);
+
+/*
+ * Feed the latency averages of `addr` with a connect that took `ms`, or
+ * a response whose first byte came `ms` after the request was ready.
+ * A connect that went through lifts any ejection.
+ */
+void endpoint_connected(const struct sockaddr * addr, long ms);
+void endpoint_first_byte(const struct sockaddr * addr, long ms);
+
+/*
+ * Expected milliseconds until a response from `addr` starts arriving,
+ * connect included, or -1 if it was never measured.
+ */
+double endpoint_latency(const struct sockaddr * addr);
+
+/*
+ * The `pct` percentile of the latest first byte times of `addr`, or -1
+ * if too few responses from it were timed to tell.
+ */
+long endpoint_first_byte_percentile(const struct sockaddr * addr, int pct);
+
+/*
+ * Whether a connect to `addr` failed recently. Unknown addresses are
+ * reachable, and looking them up does not claim a slot.
+ */
+bool endpoint_unreachable(const struct sockaddr * addr);
+
+/*
+ * Whether `addr` is ejected. Only looks, a half open address is not
+ * ejected until a race takes it as its probe.
+ */
+bool endpoint_ejected(const struct sockaddr * addr);
+
+/*
+ * Whether a connect to `addr` may start. False while it is ejected, once
+ * the ejection is over the first connect to ask takes it as its probe and
+ * the rest are kept out while the connect may last.
+ */
+bool endpoint_admit(const struct sockaddr * addr);
+
+/*
+ * Returns the entry at `index`, or NULL if the slot is free or out of
+ * range. Meant for walking the whole table.
+ */
+const endpoint * endpoint_at(size_t index);
+
+#endif
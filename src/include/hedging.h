@@ -0,0 +1,38 @@
+#ifndef HEDGING_H
+#define HEDGING_H
+
+#include <stdbool.h>
+
+/**
+ * hedging.c -- Budget and outcome of hedged requests.
+ *
+ * A GET whose response head is late goes out a second time to another
+ * address of the origin, and the first to answer wins. Hedges may take at
+ * most proxy_conf.hedgeMaxRate percent of the requests that could have
+ * been hedged, so a slow origin does not get twice the load.
+ */
+
+typedef struct hedge_stats {
+    unsigned long eligible;     // requests that armed a hedge
+    unsigned long sent;         // hedges that went out
+    unsigned long won;          // hedges that answered first
+    unsigned long lost;         // hedges called off, the first request answered
+    unsigned long failed;       // hedges that could not connect or were closed
+} hedge_stats;
+
+// Counts a request that armed a hedge
+void hedge_eligible(void);
+
+/*
+ * Takes a hedge from the budget, counting it as sent. False if hedges are
+ * over their share of the eligible requests.
+ */
+bool hedge_take(void);
+
+void hedge_won(void);
+void hedge_lost(void);
+void hedge_failed(void);
+
+hedge_stats * get_hedge_stats(hedge_stats * stats);
+
+#endif
@@ -2,6 +2,9 @@
 #define HTTP_H
 
 #include <buffer.h>
+#include <address.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /*---------------------- Size definitions ----------------------*/
 
@@ -20,15 +23,14 @@
 // Chosen arbitrarily (RFC 7230 - Section 3.2.5), larger headers are truncated
 #define HEADER_LENGTH 512
 
-// Chosen arbitrarily, larger bodies return 413 - Payload Too Large
-#define BODY_LENGTH (1024*1024)
-
 /*---------------------- Keywords definitions ----------------------*/
 
 typedef enum methods {GET=1, POST, PUT, DELETE, CONNECT, HEAD, OPTIONS, TRACE} methods;
 
 extern char * methods_strings[8];
 
+#define RESPONSE_CONTINUE 100
+#define SWITCHING_PROTOCOLS 101
 #define RESPONSE_OK 200
 #define BAD_REQUEST 400
 #define FORBIDDEN 403
@@ -39,15 +41,70 @@ extern char * methods_strings[8];
 #define INTERNAL_SERVER_ERROR 500
 #define NOT_IMPLEMENTED 501
 #define BAD_GATEWAY 502
+#define SERVICE_UNAVAILABLE 503
 #define GATEWAY_TIMEOUT 504
 
+// Interim responses come before the final one, a 101 ends HTTP on the connection instead
+#define HTTP_STATUS_INTERIM(status) ((status) / 100 == 1 && (status) != SWITCHING_PROTOCOLS)
+
+/*---------------------- Header definitions ----------------------*/
+
+// Headers whose semantics matter to the proxy, any other header is HEADER_OTHER
+typedef enum http_header_id {
+    HEADER_OTHER = 0,
+    HEADER_AUTHORIZATION,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_KEEP_ALIVE,
+    HEADER_PROXY_AUTHENTICATE,
+    HEADER_PROXY_AUTHORIZATION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_TE,
+    HEADER_TRAILER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_VIA,
+} http_header_id;
+
+// How a header is forwarded relative to the bytes it was received as
+typedef enum http_header_edit {
+    EDIT_KEEP = 0,      // Forwarded byte for byte from the raw head
+    EDIT_DELETE,        // Not forwarded
+    EDIT_REPLACE,       // Forwarded with the value stored in headers
+    EDIT_INSERT,        // Added by the proxy, there are no raw bytes
+} http_header_edit;
+
+// Received header line without its line break
+typedef struct http_header_raw {
+    char * line;
+    size_t length;
+} http_header_raw;
+
+/*---------------------- Body definitions ----------------------*/
+
+// How the end of a message body is found (RFC 7230 - Section 3.3.3)
+typedef enum http_body_framing {
+    FRAMING_NONE = 0,
+    FRAMING_LENGTH,
+    FRAMING_CHUNKED,
+    FRAMING_CLOSE,      // Response body delimited by the target closing the connection
+} http_body_framing;
+
 /*---------------------- Structs definitions ----------------------*/
 
 typedef struct http_message {
     char headers[MAX_HEADERS][2][HEADER_LENGTH];
+    http_header_id header_ids[MAX_HEADERS];
+    http_header_raw raw_headers[MAX_HEADERS];
+    http_header_edit edits[MAX_HEADERS];
     size_t header_count;
+    size_t head_length;         // Raw head bytes, kept in the read buffer until forwarded
     bool hasExpect;
+    bool close;                 // Connection: close, the connection ends with this message
 
+    http_body_framing framing;
     char * body;
     size_t body_length;
 } http_message;
@@ -56,6 +113,7 @@ typedef struct http_message {
 typedef struct http_request {
     methods method;
     char url[URL_LENGTH];
+    struct url parsed_url;      // Parsed once per request, spans refer to url
     char version[VERSION_LENGTH];
 
     http_message message;
@@ -71,10 +129,57 @@ typedef struct http_response {
 } http_response;
 
 
+// Scatter-gather view of a forwarded message head plus its buffered body prefix.
+// Spans point into the message, which must not change until it is sent.
+#define HTTP_WRITER_IOVECS (4 * MAX_HEADERS + 8)
+
+typedef struct http_writer {
+    struct iovec iov[HTTP_WRITER_IOVECS];
+    int iov_count;
+    int iov_current;            // First iovec not fully sent
+
+    char status[4];
+    size_t body_length;         // Body bytes included after the head
+} http_writer;
+
+
 /*---------------------- Methods definitions ----------------------*/
 
 int write_request(http_request * request, char * write_buffer, size_t space, bool write_body);
 
 int write_response(http_response * response, char * write_buffer, size_t space, bool write_body);
 
+/* Points the writer at the request head, no bytes are copied */
+void http_writer_request(http_writer * writer, http_request * request);
+
+/* Points the writer at the response head, no bytes are copied */
+void http_writer_response(http_writer * writer, http_response * response);
+
+/* Appends body bytes already buffered so they go out with the head */
+void http_writer_body(http_writer * writer, uint8_t * body, size_t length);
+
+/* Sends as much as the socket takes with a single writev, returns bytes sent or -1 */
+ssize_t http_writer_send(http_writer * writer, int fd);
+
+/* Returns true once every byte of the writer was sent */
+bool http_writer_done(const http_writer * writer);
+
+/* Returns the well-known id of a header name, matched case-insensitively */
+http_header_id http_header_lookup(const char * name, size_t length);
+
+/* Returns true if a comma separated header value lists the given token, ignoring case */
+bool http_list_contains(const char * list, const char * token);
+
+/* Returns true if the message was received with a header of the given id, deleted or not */
+bool http_has_header(const http_message * message, http_header_id id);
+
+/* Marks the header at the given position so that it is not forwarded */
+void http_edit_delete(http_message * message, size_t index);
+
+/* Replaces the value of the header at the given position */
+void http_edit_replace(http_message * message, size_t index, const char * value);
+
+/* Appends a header added by the proxy, returns false if there is no room for it */
+bool http_edit_insert(http_message * message, http_header_id id, const char * name, const char * value);
+
 #endif
@@ -0,0 +1,43 @@
+#ifndef HTTP_CHUNKED_PARSER_H
+#define HTTP_CHUNKED_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <parser.h>
+
+/**
+ * http_chunked_parser.c -- Incremental validator for chunked transfer coding
+ * (RFC 7230 - Section 4.1).
+ *
+ * The parser does not decode the body, it only finds where the chunked
+ * message ends so that the raw bytes can be relayed as they arrive.
+ * Chunk data is skipped in bulk, only the framing is fed byte by byte.
+ */
+
+// Chosen arbitrarily, larger trailer sections return 400 - Bad Request
+#define CHUNKED_TRAILER_LENGTH (8 * 1024)
+
+typedef struct http_chunked_parser {
+    struct parser * parser;
+
+    size_t chunk_size;
+    size_t chunk_remaining;
+    size_t trailer_length;
+} http_chunked_parser;
+
+void http_chunked_parser_init(http_chunked_parser * parser);
+
+/*
+ * Consumes at most `*nbytes` bytes from `data`. On return `*nbytes` holds
+ * how many of them belong to the chunked body, which is less than the given
+ * amount only when the body ended (SUCCESS) or it is malformed (FAILED).
+ */
+parse_state http_chunked_parser_parse(
+    http_chunked_parser * parser, const uint8_t * data, size_t * nbytes
+);
+
+void http_chunked_parser_reset(http_chunked_parser * parser);
+
+void http_chunked_parser_destroy(http_chunked_parser * parser);
+
+#endif
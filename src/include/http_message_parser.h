@@ -3,13 +3,19 @@
 
 #include <parser.h>
 #include <http.h>
+#include <http_chunked_parser.h>
 
 typedef struct http_message_parser {
     struct parser * parser;
     buffer parse_buffer;
+    char * line_start;              // Current header line in the parsed buffer
     
+    http_chunked_parser chunked_parser;
+
     int error_code;
-    size_t current_body_length;
+    size_t current_body_length;     // Body bytes scanned so far
+    size_t pending_body_length;     // Body bytes scanned but not yet forwarded
+    parse_state body_state;
 } http_message_parser;
 
 void http_message_parser_init(http_message_parser * parser);
@@ -19,6 +25,16 @@ parse_state http_message_parser_parse(
     http_message * message, bool ignore_content_length
 );
 
+/*
+ * Scans freshly received body bytes according to the message framing.
+ * On return `*nbytes` holds how many of them belong to the body, the rest
+ * (if any) is the start of the next message on the connection.
+ */
+parse_state http_message_parser_body(
+    http_message_parser * parser, http_message * message,
+    const uint8_t * data, size_t * nbytes
+);
+
 void http_message_parser_reset(http_message_parser * parser);
 
 void http_message_parser_destroy(http_message_parser * parser);
@@ -0,0 +1,162 @@
+#ifndef ORIGINS_H
+#define ORIGINS_H
+
+#include <time.h>
+#include <stdbool.h>
+
+#include <address.h>
+
+/**
+ * origins.c -- Per origin bookkeeping.
+ *
+ * Origins are identified by the host and port of the request URL. The
+ * table has a fixed size, when it is full the origin used least recently
+ * gives its slot away, so its counters start over if it comes back.
+ * Origins with connections in use, clients waiting or a breaker that is
+ * not closed are never evicted, clients hold on to their slot. While
+ * every slot is busy new origins go untracked: uncapped and without a
+ * breaker.
+ *
+ * Each origin takes at most proxy_conf.originMaxConns connections at a
+ * time, the requests over it wait for one in a FIFO queue of client
+ * sockets. Waiting is up to the caller, which is told who to wake up
+ * when a connection is given back. A hedge takes a connection of its own
+ * on top of the one its request holds, but only if one is free and
+ * nobody waits for it.
+ *
+ * The addresses each origin last resolved to are kept, so requests on
+ * pooled connections can be hedged to another one.
+ *
+ * A circuit breaker watches the outcome of the requests to each origin.
+ * It opens after proxy_conf.breakerFailures failures in a row, or when
+ * proxy_conf.breakerErrorRate percent of the requests of a window failed,
+ * and requests are refused while it is. After proxy_conf.breakerCooldown
+ * seconds it lets a single probe through, which closes it again on
+ * success.
+ */
+
+#define ORIGIN_TABLE_SIZE 128
+
+// Clients a single origin keeps waiting, the next ones are turned away
+#define ORIGIN_QUEUE_SIZE 32
+
+// Resolved addresses kept per origin
+#define ORIGIN_ADDRESSES 8
+
+// Outcomes of origin_acquire
+#define ORIGIN_ADMITTED 0
+#define ORIGIN_QUEUED   1
+#define ORIGIN_FULL     2
+
+// Circuit breaker states
+#define BREAKER_CLOSED    0
+#define BREAKER_OPEN      1
+#define BREAKER_HALF_OPEN 2
+
+// Error rates are taken over windows of this many seconds, on enough requests to mean something
+#define BREAKER_WINDOW 10
+#define BREAKER_MIN_REQUESTS 20
+
+typedef struct origin {
+    char            host[HOST_LENGTH];  // empty on free slots
+    int             port;
+    time_t          last_used;
+
+    unsigned long   tfo_accepted;       // fast open connects whose SYN data the origin took
+    unsigned long   tfo_fallback;       // fast open connects that went through a full handshake
+
+    struct sockaddr_storage addresses[ORIGIN_ADDRESSES]; // last ones the host resolved to
+    socklen_t       address_lengths[ORIGIN_ADDRESSES];
+    size_t          address_count;
+
+    unsigned        active;             // connections in use, capped by proxy_conf.originMaxConns
+    int             queue[ORIGIN_QUEUE_SIZE]; // client sockets waiting for a connection, a ring
+    size_t          queue_head;
+    size_t          queue_length;
+    unsigned long   waited;             // requests that had to wait for a connection
+    unsigned long   turned_away;        // requests that never got one, full queue or given up
+
+    int             breaker;            // BREAKER_CLOSED, BREAKER_OPEN or BREAKER_HALF_OPEN
+    time_t          opened_at;
+    int             probe;              // client whose request probes a half open breaker, 0 if none
+    unsigned        consecutive_failures;
+    time_t          window_start;
+    unsigned        window_requests;
+    unsigned        window_failures;
+    unsigned long   trips;              // times the breaker opened
+    unsigned long   fast_failed;        // requests refused by the breaker
+} origin;
+
+/*
+ * Returns the entry of `host`:`port`, claiming a slot for it if it had
+ * none. Returns NULL if it had none and every slot is busy.
+ */
+origin * origin_get(const char * host, int port);
+
+/*
+ * Returns the entry at `index`, or NULL if the slot is free or out of
+ * range. Meant for walking the whole table.
+ */
+const origin * origin_at(size_t index);
+
+/*
+ * Takes a connection of `host`:`port` for `client`, or puts it at the end
+ * of the wait queue if the origin is at its cap. Returns ORIGIN_ADMITTED,
+ * ORIGIN_QUEUED or ORIGIN_FULL if the queue had no room. `index` is set
+ * to the origin for the other calls, or to -1 if turned away or admitted
+ * untracked.
+ */
+int origin_acquire(const char * host, int port, int client, int * index);
+
+/*
+ * Takes the connection a queued `client` waits for, if it heads the queue
+ * and one is free.
+ */
+bool origin_admit(int index, int client);
+
+/*
+ * Gives back the connection `client` holds, or takes it out of the queue
+ * if it was still waiting. Returns the client that heads the queue when a
+ * connection is free for it, to be woken up, or -1.
+ */
+int origin_release(int index, int client);
+
+/*
+ * Takes one more connection of origin `index` for a request that holds
+ * one already, if one is free and no client waits. Untracked origins
+ * always have one.
+ */
+bool origin_take_extra(int index);
+
+/*
+ * Gives back a connection taken with origin_take_extra. Returns the
+ * client to wake up, as origin_release does.
+ */
+int origin_give_back(int index);
+
+/*
+ * Keeps the addresses the host of origin `index` resolved to, up to
+ * ORIGIN_ADDRESSES of them.
+ */
+void origin_resolved(int index, const struct addrinfo * addresses);
+
+/*
+ * Returns the `i`th address origin `index` last resolved to, setting
+ * `length`, or NULL past the last one.
+ */
+const struct sockaddr * origin_address(int index, size_t i, socklen_t * length);
+
+/*
+ * Whether the breaker of `host`:`port` lets a request from `client`
+ * through. Once an open breaker cooled down the request is taken as its
+ * probe, and the rest are refused until the probe is over.
+ */
+bool origin_allow(const char * host, int port, int client);
+
+/*
+ * Feed the breaker of origin `index` with the outcome of a request.
+ */
+void origin_succeeded(int index);
+void origin_failed(int index);
+
+#endif
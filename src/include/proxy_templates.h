@@ -0,0 +1,42 @@
+#ifndef PROXY_TEMPLATES_H
+#define PROXY_TEMPLATES_H
+
+#include <stddef.h>
+
+/**
+ * proxy_templates.c -- Prebuilt bytes for the responses the proxy generates
+ * itself and for the token it appends to Via headers.
+ *
+ * Templates are serialized once at startup, so sending an error or the
+ * CONNECT confirmation is a plain copy into the write buffer. The machine
+ * FQDN used for Via is resolved by a background thread, the event loop
+ * only ever reads the cached copy.
+ */
+
+// Seconds between FQDN resolutions done by the refresh thread
+#define VIA_REFRESH_INTERVAL 300
+
+typedef struct response_template {
+    const char *    data;
+    size_t          length;
+} response_template;
+
+void init_templates(void);
+
+/*
+ * Returns the canned response for the given status code, or NULL if the
+ * proxy never generates it.
+ */
+const response_template * template_for_status(int status);
+
+const response_template * template_connect_established(void);
+
+const response_template * template_continue(void);
+
+/*
+ * Copies the Via token (the configured name, or else the cached machine
+ * FQDN) into `out`, which must hold at least VIA_PROXY_NAME_SIZE bytes.
+ */
+void via_token(char * out);
+
+#endif
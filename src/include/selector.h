@@ -12,6 +12,8 @@
 #include "http_request_parser.h"
 #include "http_response_parser.h"
 #include "pop3_parser.h"
+#include "splice_pipe.h"
+#include "zerocopy.h"
 #include <doh_client.h>
 
 #define MASTER_SOCKET_SIZE 2
@@ -60,6 +62,22 @@
 
 #define SELECTOR_TIMEOUT_SECS 60
 
+/**
+ * Presupuesto de entrada/salida de cada conexión por pasada del selector.
+ * Una lectura nunca pide más bytes de los que le quedan a la conexión, y
+ * cada conexión corre a lo sumo SELECTOR_PASS_CALLS handlers de lectura o
+ * escritura. Lo que quedó sin leer espera a la pasada siguiente, en la que
+ * todas las conexiones vuelven a tener su turno.
+ */
+#define SELECTOR_PASS_BYTES (256 * 1024)
+#define SELECTOR_PASS_CALLS 2
+
+/**
+ * Cantidad de connects que una conexión puede tener en carrera a la vez,
+ * además de su target. Se vigilan para escritura junto con el target.
+ */
+#define SELECTOR_ATTEMPTS 4
+
 typedef struct fdselector * fd_selector;
 
 /** valores de retorno. */
@@ -183,6 +201,38 @@ selector_select(fd_selector s);
 int
 selector_fd_set_nio(const int fd);
 
+/**
+ * Acota `wanted' a los bytes que la conexión todavía puede leer en esta
+ * pasada. Se usa como tamaño de cada read(2) o splice(2) de entrada.
+ */
+size_t
+selector_read_quota(struct selector_key *key, size_t wanted);
+
+/**
+ * Descuenta del presupuesto los bytes leídos.
+ */
+void
+selector_charge_read(struct selector_key *key, ssize_t bytes);
+
+/**
+ * Arma el timer de la conexión para dentro de `ms' milisegundos. Al vencer
+ * se invoca el handler de timeout del estado actual. Un cambio de estado lo
+ * desarma, y volver a armarlo reemplaza el vencimiento anterior.
+ */
+void
+selector_set_timer(struct selector_key *key, long ms);
+
+/** desarma el timer de la conexión */
+void
+selector_clear_timer(struct selector_key *key);
+
+/**
+ * Dispara ya el timer de la conexión cuyo cliente es `fd'. Así se despierta
+ * a una conexión que espera algo que otra acaba de liberar.
+ */
+void
+selector_wake(fd_selector s, int fd);
+
 /** notifica que un trabajo bloqueante terminó */
 selector_status
 selector_notify_block(fd_selector s, const int   fd);
@@ -197,16 +247,46 @@ struct item {
     
     buffer              read_buffer;
     buffer              write_buffer;
+    buffer              pipeline_buffer;    // pipelined request bytes, stashed while a response is relayed
+    http_writer         writer;             // forwarded message head, sent straight from the parsers
     
     state_machine       stm;
     http_request_parser req_parser;
     http_response_parser res_parser;
     pop3_parser_data    pop3_parser;
+    splice_pipe         client_pipe;        // spliced tunnel or body bytes headed to the client
+    splice_pipe         target_pipe;        // spliced tunnel or body bytes headed to the target
+    zerocopy_state      client_zc;          // zero-copy sends to the client not yet released
+    zerocopy_state      target_zc;          // zero-copy sends to the target not yet released
+    bool                target_fastopen;    // target connected with fast open, outcome not yet counted
+    bool                target_pooled;      // target taken from the upstream pool, the origin may have closed it
+    bool                retried;            // request already resent once on a fresh connection
+    size_t              held_length;        // raw bytes of the sent request left unread until it is answered, 0 if none
+    bool                tunnel_dissect;     // tunnel bytes still go through the POP3 dissector
+    size_t              tunnel_inspected;   // tunnel bytes seen by the POP3 dissector
+    size_t              pass_bytes;         // bytes the connection may still read this pass
+    unsigned            pass_calls;         // I/O handler calls left this pass
+    int                 attempts[SELECTOR_ATTEMPTS]; // connects racing to become the target, -1 if unused
+    struct addrinfo *   attempt_addrs[SELECTOR_ATTEMPTS]; // address each racing connect goes to
+    long long           attempt_started[SELECTOR_ATTEMPTS]; // monotonic ms each racing connect started at
+    long long           next_attempt;       // monotonic ms the next racing connect may start at
+    int                 hedge_socket;       // second try of a late request at another address, -1 if unused
+    fd_interest         hedge_interest;
+    bool                hedge_sent;         // the whole request went out on the hedge
+    long long           hedge_ready;        // monotonic ms the request on the hedge was ready
+    struct sockaddr_storage hedge_addr;     // address of the origin the hedge goes to
+    socklen_t           hedge_addr_len;     // 0 if none was picked
+    struct timespec     timer;              // monotonic time the timer fires at
+    bool                timer_armed;
     struct sockaddr_in  client;
     struct doh_client   doh;
     
     time_t              last_activity;
     struct url          last_target_url;
+    long long           request_ready;      // monotonic ms the request to the target was ready, 0 once answered
+    int                 backend;            // upstream group member serving the request, -1 if none
+    int                 origin;             // origin whose connection the request holds or waits for, -1 if none
+    long long           queued_until;       // monotonic ms the wait for an origin connection gives up at
 
     int                 master_socket;
 
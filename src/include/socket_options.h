@@ -0,0 +1,77 @@
+#ifndef SOCKET_OPTIONS_H
+#define SOCKET_OPTIONS_H
+
+/**
+ * socket_options.c -- Per socket class TCP option policy.
+ *
+ * Every TCP socket the proxy creates belongs to a class, and each class
+ * carries its own value for every tunable option. Values live on
+ * proxy_conf so the monitor can change them at runtime. A change applies
+ * to sockets created from then on, sockets that are already open keep
+ * their options.
+ */
+
+typedef enum socket_class {
+    SOCKET_CLASS_LISTENER = 0,      // Master sockets, accepted clients inherit most options
+    SOCKET_CLASS_CLIENT,            // Accepted client connections
+    SOCKET_CLASS_TARGET,            // Connections to origin servers
+    SOCKET_CLASS_DOH,               // Connections to the DoH server
+    SOCKET_CLASS_COUNT
+} socket_class;
+
+typedef enum socket_option {
+    SOCKOPT_NODELAY = 0,            // TCP_NODELAY, 0 or 1
+    SOCKOPT_DEFER_ACCEPT,           // TCP_DEFER_ACCEPT seconds, only meaningful on listeners
+    SOCKOPT_NOTSENT_LOWAT,          // TCP_NOTSENT_LOWAT bytes
+    SOCKOPT_SNDBUF,                 // SO_SNDBUF bytes
+    SOCKOPT_RCVBUF,                 // SO_RCVBUF bytes
+    SOCKOPT_KEEPALIVE,              // Idle seconds before keepalive probes, 0 disables SO_KEEPALIVE
+    SOCKOPT_QUICKACK,               // TCP_QUICKACK, 0 or 1. The kernel may drop it later on
+    SOCKOPT_COUNT
+} socket_option;
+
+// Leaves the option as the kernel default
+#define SOCKOPT_UNSET (-1)
+
+/*
+ * Initializer for a class policy, in socket_option order.
+ */
+#define SOCKET_POLICY(nodelay, defer_accept, notsent_lowat, sndbuf, rcvbuf, keepalive, quickack) \
+    { nodelay, defer_accept, notsent_lowat, sndbuf, rcvbuf, keepalive, quickack }
+
+/*
+ * Applies the policy of `class` to `socket`. Options the kernel refuses
+ * are logged and skipped, the socket stays usable.
+ */
+void apply_socket_policy(int socket, socket_class class);
+
+/*
+ * Validates and stores a value on the runtime policy. Returns -1 if the
+ * class, option or value is out of range.
+ */
+int set_socket_policy(socket_class class, socket_option option, int value);
+
+/*
+ * Enables TCP Fast Open on a listener, keeping up to `queue` pending
+ * fast open handshakes.
+ */
+int socket_fastopen_listen(int socket, int queue);
+
+/*
+ * Enables TCP Fast Open on an outgoing socket. With a cookie cached for
+ * the peer, connect(2) then returns at once and the handshake waits for
+ * the first send, which rides on the SYN.
+ */
+int socket_fastopen_connect(int socket);
+
+/*
+ * Once the handshake is over, returns 1 if the peer acknowledged the data
+ * sent on the SYN, 0 if it did not, and -1 if it could not tell.
+ */
+int socket_fastopen_accepted(int socket);
+
+const char * socket_class_name(socket_class class);
+
+const char * socket_option_name(socket_option option);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef SPLICE_PIPE_H
+#define SPLICE_PIPE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * splice_pipe.c -- Kernel pipes used to relay bytes between two sockets
+ * with splice(2), so they never get copied into user space.
+ *
+ * Bytes go socket -> pipe -> socket. A pipe keeps track of how many bytes
+ * it holds, since they can only leave through the same pipe. Empty pipes
+ * are returned to a small pool instead of being closed, tunnels come and
+ * go much faster than pipes are worth recreating.
+ */
+
+// Idle pipes kept open for reuse, the rest are closed on release
+#define SPLICE_POOL_SIZE 64
+
+// Bytes moved per splice call, the default pipe capacity on Linux
+#define SPLICE_CHUNK (64 * 1024)
+
+typedef struct splice_pipe {
+    int     fds[2];     // read and write ends, -1 when not acquired
+    size_t  pending;    // bytes spliced in and not yet spliced out
+} splice_pipe;
+
+void splice_pipe_init(splice_pipe * pipe);
+
+/*
+ * Takes a pipe from the pool, or creates one if the pool is empty.
+ * Returns -1 on failure, leaving the pipe unacquired.
+ */
+int splice_pipe_acquire(splice_pipe * pipe);
+
+// Pools the pipe if it is empty, otherwise closes it
+void splice_pipe_release(splice_pipe * pipe);
+
+static inline bool splice_pipe_acquired(const splice_pipe * pipe) {
+    return pipe->fds[0] >= 0;
+}
+
+/*
+ * Moves up to `max` bytes (never more than SPLICE_CHUNK) from the socket
+ * into the pipe. Returns the amount moved, 0 on end of stream, or -1 with
+ * errno set.
+ */
+ssize_t splice_pipe_fill(splice_pipe * pipe, int socket, size_t max);
+
+/*
+ * Moves the pending bytes from the pipe into the socket. Returns the
+ * amount moved or -1 with errno set.
+ */
+ssize_t splice_pipe_drain(splice_pipe * pipe, int socket);
+
+#endif
@@ -69,6 +69,9 @@ struct state_definition {
     
     /** ejecutado cuando hay un trabajo bloqueante listo */
     unsigned (*on_block_ready) (struct selector_key *selector_key);
+
+    /** ejecutado cuando vence el timer armado en este estado */
+    unsigned (*on_timeout)     (unsigned int state, struct selector_key *selector_key);
 };
 
 
@@ -90,6 +93,9 @@ stm_handler_write(struct state_machine *stm, struct selector_key *selector_key);
 /** indica que ocurrió el evento block. retorna nuevo id de nuevo estado. */
 unsigned stm_handler_block(struct state_machine *stm, struct selector_key *selector_key);
 
+/** indica que venció el timer. Los estados sin handler lo ignoran. */
+unsigned stm_handler_timeout(struct state_machine *stm, struct selector_key *selector_key);
+
 /** indica que ocurrió el evento close. retorna nuevo id de nuevo estado. */
 void stm_handler_close(struct state_machine *stm, struct selector_key *selector_key);
 
@@ -0,0 +1,57 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <time.h>
+
+#include <address.h>
+
+/**
+ * upstream_pool.c -- Idle connections to origin servers, shared by all clients.
+ *
+ * Once a response is over the target connection may be parked here
+ * instead of being closed, and the next request to the same origin takes
+ * it back skipping resolution and the handshake. Parked sockets are not
+ * watched by the selector, so they are checked for a close or stray
+ * bytes from the origin before they are handed out.
+ *
+ * Limits and the idle timeout come from proxy_conf.
+ */
+
+// Hard cap on the pool size, proxy_conf.upstreamPoolSize is clamped to it
+#define UPSTREAM_POOL_MAX 256
+
+typedef struct upstream_pool_stats {
+    unsigned long reused;       // requests served on a pooled connection
+    unsigned long parked;       // connections parked after a response
+    unsigned long discarded;    // pooled connections closed as dead, expired or evicted
+    unsigned long retried;      // requests resent after their pooled connection was closed under them
+} upstream_pool_stats;
+
+/*
+ * Takes an idle connection to `host`:`port` out of the pool, or returns
+ * -1 if there is none alive. `family` may be AF_UNSPEC to accept any.
+ */
+int upstream_pool_get(const char * host, int port, int family);
+
+/*
+ * Parks `socket` as an idle connection to `host`:`port`. The oldest idle
+ * connection of the origin, or of the whole pool, is closed to make room.
+ * The socket is closed instead if pooling is disabled.
+ */
+void upstream_pool_put(int socket, const char * host, int port);
+
+/*
+ * Closes idle connections that expired or were closed by their origin.
+ * Calls within the same second after the first are no-ops.
+ */
+void upstream_pool_reap(void);
+
+/*
+ * Counts a request resent on a fresh connection because the pooled one
+ * it went out on had been closed by the origin.
+ */
+void upstream_pool_retried(void);
+
+upstream_pool_stats * get_upstream_pool_stats(upstream_pool_stats * stats);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * zerocopy.c -- Opt-in MSG_ZEROCOPY sends for large buffered payloads.
+ *
+ * A zero-copy send pins the buffer pages instead of copying them, so the
+ * bytes must not be overwritten until the kernel reports the send as
+ * completed through the socket error queue. Callers keep sent regions out
+ * of reuse while `zerocopy_pending` holds. The selector reaps completions
+ * every pass, waking up at least every ZEROCOPY_REAP_MS while any are due,
+ * without watching the socket for reads.
+ */
+
+// Smaller sends are copied, pinning pages costs more than copying them
+#define ZEROCOPY_THRESHOLD (64 * 1024)
+
+// Longest the selector sleeps while completions are due
+#define ZEROCOPY_REAP_MS 1
+
+typedef struct zerocopy_state {
+    int         enabled;        // 1 once SO_ZEROCOPY was set, -1 if refused, 0 if untried
+    uint32_t    sent;           // zero-copy sends issued on the socket
+    uint32_t    completed;      // zero-copy sends released by the kernel
+} zerocopy_state;
+
+typedef struct zerocopy_stats {
+    unsigned long sends;        // sends issued with MSG_ZEROCOPY
+    unsigned long copies;       // of those, sends the kernel fell back to copying
+} zerocopy_stats;
+
+void zerocopy_init(zerocopy_state * zc);
+
+/*
+ * Sends like write(2), with MSG_ZEROCOPY when enabled and `size` is at
+ * least ZEROCOPY_THRESHOLD.
+ */
+ssize_t zerocopy_send(zerocopy_state * zc, int socket, const void * data, size_t size, bool enabled);
+
+static inline bool zerocopy_pending(const zerocopy_state * zc) {
+    return zc->sent != zc->completed;
+}
+
+/*
+ * Drains completion notifications from the socket error queue. Returns
+ * how many sends were released.
+ */
+uint32_t zerocopy_reap(zerocopy_state * zc, int socket);
+
+zerocopy_stats * get_zerocopy_stats(zerocopy_stats * stats);
+
+#endif
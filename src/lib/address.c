@@ -8,6 +8,8 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <ctype.h>
+#include <strings.h>
 
 
 
@@ -77,11 +79,8 @@ int get_machine_fqdn(char * fqdn) {
 	hints.ai_flags = AI_CANONNAME;
 
 	struct addrinfo * info;
-	int gai_result;
-	if ((gai_result = getaddrinfo(hostname, "http", &hints, &info)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai_result));
+	if (getaddrinfo(hostname, "http", &hints, &info) != 0)
 		return -1;
-	}
 
 	strcpy(fqdn, info->ai_canonname);
 
@@ -91,87 +90,111 @@ int get_machine_fqdn(char * fqdn) {
 }
 
 
-int is_number(const char * str) {
-    int i = 0;
-    while(*str != '\0') {
-        if (*str > '9' || *str < '0') return 0;
-        str++;
-        i++;
-    }
-    return i > 0 ? 1 : 0;
+#define SCHEME_CHAR(c) (isalnum(c) || (c) == '+' || (c) == '-' || (c) == '.')
+
+static struct url_span make_span(const char * text, const char * begin, const char * end) {
+	struct url_span span = { .offset = (size_t) (begin - text), .length = (size_t) (end - begin) };
+	return span;
 }
 
-int parse_url(char * text, struct url * url) {
-	char * aux = malloc(strlen(text)+1);
-	if (aux == NULL)
+int parse_url(const char * text, struct url * url) {
+	memset(url, 0, sizeof(*url));
+	url->port = 80;
+
+	const char * p = text;
+
+	// origin-form and asterisk-form only carry a path
+
+	if (*p == '/' || *p == '*') {
+		url->path = make_span(text, p, p + strlen(p));
+		return 0;
+	}
+
+	// absolute-form starts with a scheme, authority-form goes straight to the host
+
+	const char * q = p;
+	while (SCHEME_CHAR((unsigned char) *q))
+		q++;
+
+	if (q != p && q[0] == ':' && q[1] == '/' && q[2] == '/') {
+		url->scheme = make_span(text, p, q);
+		if (q - p == 5 && strncasecmp(p, "https", 5) == 0)
+			url->port = 443;
+		p = q + 3;
+
+		// Userinfo ends at the last '@' of the authority (RFC 3986 - Section 3.2.1)
+
+		const char * at = NULL;
+		for (q = p; *q != '\0' && *q != '/' && *q != '?' && *q != '#'; q++)
+			if (*q == '@')
+				at = q;
+
+		if (at != NULL) {
+			url->userinfo = make_span(text, p, at);
+			p = at + 1;
+		}
+	}
+
+	// Host, IPv6 literals come between brackets
+
+	const char * host_begin, * host_end;
+
+	if (*p == '[') {
+		host_begin = ++p;
+		while (*p != '\0' && *p != ']')
+			p++;
+		if (*p != ']')
+			return -1;
+		host_end = p++;
+	} else {
+		host_begin = p;
+		while (*p != '\0' && *p != ':' && *p != '/' && *p != '?' && *p != '#')
+			p++;
+		host_end = p;
+	}
+
+	if (host_end == host_begin || (size_t) (host_end - host_begin) >= HOST_LENGTH)
 		return -1;
-		
-	strcpy(aux, text);
-
-    memset(url, 0, sizeof(*url));
-    char * token = NULL;
-    char * rest = aux;
-    url->port = 0;
-    int flag = 0, num_flag;
-
-    if (rest[0] == '/') { // esta en formato origin
-        strcpy(url->path, rest);
-		free(aux);
-        return 0;
-    }
 
-    while (strchr(rest, ':') != NULL && (token = strtok_r(rest, ":", &rest))) {
-        num_flag = is_number(token);
-        if (!num_flag && !flag) {
-            if (strcmp(token, "http") == 0 || strcmp(token, "https") == 0) {
-                strcpy(url->protocol, token);
-                rest += 2; // por ://
-            } else {
-                strcpy(url->hostname, token);
-                flag = 1;
-            }
-        } else if (num_flag) {
-            url->port = atoi(token);
-        } else break;
-    }
+	url->host = make_span(text, host_begin, host_end);
+	memcpy(url->hostname, host_begin, url->host.length);
+	url->hostname[url->host.length] = '\0';
 
-    token = NULL;
-    while (rest!=NULL && strchr(rest, '/') != NULL &&(token = strtok_r(rest, "/", &rest))) {
-        num_flag = is_number(token);
-        if (!num_flag) {
-            if (!flag) {
-                strcpy(url->hostname, token);
-                flag = 1;
-            } else {
-                if (rest != NULL){
-                    snprintf(url->path, PATH_LENGTH, "/%s/%s", token, rest);
-                    rest = NULL;
-                } else {
-                    snprintf(url->path, PATH_LENGTH, "/%s", token);
-                }
-            }
-        } else {
-            url->port = atoi(token);
-        }
-    }
+	// Optional port
 
-    if (rest != NULL) {
-        num_flag = is_number(rest);
-        if (!num_flag) {
-            if (flag) {
-                snprintf(url->path, PATH_LENGTH, "/%s", rest);
-            } else {
-                strcpy(url->hostname, rest);
-            }
-        } else {
-            url->port = atoi(rest);
-        }
-    }
+	if (*p == ':') {
+		const char * port_begin = ++p;
+		int port = 0;
+		while (isdigit((unsigned char) *p) && port <= 0xFFFF)
+			port = port * 10 + (*p++ - '0');
+
+		if (p == port_begin || port == 0 || port > 0xFFFF)
+			return -1;
+
+		url->port = port;
+	}
+
+	// Whatever follows is path and query
+
+	if (*p != '\0' && *p != '/' && *p != '?' && *p != '#')
+		return -1;
+
+	url->path = make_span(text, p, p + strlen(p));
+
+	return 0;
+}
+
+void url_drop_userinfo(char * text, struct url * url) {
+	if (url->userinfo.offset == 0)
+		return;
 
-    if (url->port == 0) url->port = 80;
+	size_t cut = url->userinfo.length + 1;
+	char * begin = text + url->userinfo.offset;
+	memmove(begin, begin + cut, strlen(begin + cut) + 1);
 
-	free(aux);
-    return 0;
+	url->host.offset -= cut;
+	url->path.offset -= cut;
+	memset(&url->userinfo, 0, sizeof(url->userinfo));
 }
 
 /* returns 1 if it shares the ip with some interface of the proxy if not return 0*/
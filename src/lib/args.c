@@ -17,23 +17,29 @@ version(void) {
 }
 
 
-static unsigned short
-port(const char *s) {
+static long
+bounded(const char *s, long min, long max, const char *error) {
      char *end     = 0;
+     errno         = 0;
      const long sl = strtol(s, &end, 10);
 
     if (
         end == s
         || *end != '\0'
         || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno)
-        || sl < 0 || sl > USHRT_MAX
+        || sl < min || sl > max
     ) {
-         fprintf(stderr, "Port should be in the range of 1-65536: %s\n", s);
+         fprintf(stderr, "%s: %s\n", error, s);
          exit(1);
-         return 1;
      }
 
-     return (unsigned short) sl;
+     return sl;
+}
+
+
+static unsigned short
+port(const char *s) {
+     return (unsigned short) bounded(s, 0, USHRT_MAX, "Port should be in the range of 1-65536");
 }
 
 
@@ -55,6 +61,18 @@ usage(const char *progname) {
         "   --doh-port  <port>  Puerto del servidor DoH\n"
         "   --doh-host  <host>  Host del servidor DoH\n"
         "   --doh-path  <host>  Path del servidor DoH\n"
+        "\n"
+        "   --zerocopy          Envía cuerpos y ráfagas grandes con MSG_ZEROCOPY\n"
+        "   --fastopen          Usa TCP Fast Open con clientes y servidores destino\n"
+        "   --hedge             Repite en otra dirección del destino los GET cuya\n"
+        "                       respuesta se demora, y usa la que llegue primero\n"
+        "   --connect-timeout <ms>  Tiempo máximo de conexión a cada dirección del destino\n"
+        "   --origin-max-conns <n>  Conexiones simultáneas a cada servidor destino. Los\n"
+        "                           pedidos de más esperan su turno en una cola.\n"
+        "   --origin-queue-timeout <ms>  Espera máxima en esa cola antes de responder 503\n"
+        "\n"
+        "   --upstream <host:port>  Funciona como proxy reverso hacia este servidor. Se\n"
+        "                           puede repetir, y los pedidos se reparten entre todos.\n"
         "\n",
         progname
     );
@@ -88,6 +106,13 @@ parse_args(const int argc, char **argv, struct proxy_args *args) {
             { "doh-port",  required_argument, 0, 0xD002 },
             { "doh-host",  required_argument, 0, 0xD003 },
             { "doh-path",  required_argument, 0, 0xD004 },
+            { "zerocopy",  no_argument,       0, 0xD005 },
+            { "fastopen",  no_argument,       0, 0xD006 },
+            { "hedge",     no_argument,       0, 0xD00B },
+            { "connect-timeout", required_argument, 0, 0xD007 },
+            { "upstream",  required_argument, 0, 0xD008 },
+            { "origin-max-conns", required_argument, 0, 0xD009 },
+            { "origin-queue-timeout", required_argument, 0, 0xD00A },
             { 0,           0,                 0, 0 }
         };
 
@@ -130,6 +155,31 @@ parse_args(const int argc, char **argv, struct proxy_args *args) {
             case 0xD004:
                 args->doh.path = optarg;
                 break;
+            case 0xD005:
+                args->zerocopy = true;
+                break;
+            case 0xD006:
+                args->fastopen = true;
+                break;
+            case 0xD007:
+                args->connect_timeout = (int) bounded(optarg, 1, INT_MAX, "Milliseconds should be a positive number");
+                break;
+            case 0xD008:
+                if (args->upstream_count == MAX_UPSTREAMS) {
+                    fprintf(stderr, "At most %d upstreams are supported\n", MAX_UPSTREAMS);
+                    exit(1);
+                }
+                args->upstreams[args->upstream_count++] = optarg;
+                break;
+            case 0xD009:
+                args->origin_max_conns = (int) bounded(optarg, 1, INT_MAX, "Connections should be a positive number");
+                break;
+            case 0xD00A:
+                args->origin_queue_timeout = (int) bounded(optarg, 1, INT_MAX, "Milliseconds should be a positive number");
+                break;
+            case 0xD00B:
+                args->hedge = true;
+                break;
             default:
                 fprintf(stderr, "unknown argument %d.\n", c);
                 exit(1);
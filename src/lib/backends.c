@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <args.h>
+#include <backends.h>
+
+static backend group[MAX_UPSTREAMS];
+static int group_size = 0;
+
+
+int backends_init(char ** specs, int count) {
+    if (count > MAX_UPSTREAMS)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        struct url url;
+
+        // Only an authority, scheme and path make no sense for a member
+
+        if (parse_url(specs[i], &url) < 0 || url.host.length == 0 || url.scheme.length > 0 || url.path.length > 0)
+            return -1;
+
+        memset(&group[i], 0, sizeof(group[i]));
+        strcpy(group[i].host, url.hostname);
+        group[i].port = url.port;
+    }
+
+    group_size = count;
+    return 0;
+}
+
+
+int backend_count(void) {
+    return group_size;
+}
+
+
+int backend_pick(void) {
+    if (group_size == 0)
+        return -1;
+
+    int pick = rand() % group_size;
+
+    if (group_size > 1) {
+        int other = (pick + 1 + rand() % (group_size - 1)) % group_size;
+        if (group[other].in_flight < group[pick].in_flight)
+            pick = other;
+    }
+
+    group[pick].in_flight++;
+    group[pick].requests++;
+    return pick;
+}
+
+
+void backend_done(int index) {
+    if (index >= 0 && index < group_size && group[index].in_flight > 0)
+        group[index].in_flight--;
+}
+
+
+const backend * backend_at(int index) {
+    if (index < 0 || index >= group_size)
+        return NULL;
+    return &group[index];
+}
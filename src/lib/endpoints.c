@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <endpoints.h>
+#include <config.h>
+
+static endpoint table[ENDPOINT_TABLE_SIZE];
+
+
+static bool same_endpoint(const struct sockaddr_storage * entry, const struct sockaddr * addr) {
+    if (entry->ss_family != addr->sa_family)
+        return false;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in * a = (const struct sockaddr_in *) entry;
+        const struct sockaddr_in * b = (const struct sockaddr_in *) addr;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 * a = (const struct sockaddr_in6 *) entry;
+        const struct sockaddr_in6 * b = (const struct sockaddr_in6 *) addr;
+        return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+
+    return false;
+}
+
+
+static endpoint * endpoint_find(const struct sockaddr * addr) {
+    for (size_t i = 0; i < ENDPOINT_TABLE_SIZE; i++) {
+        if (table[i].addr.ss_family != AF_UNSPEC && same_endpoint(&table[i].addr, addr))
+            return &table[i];
+    }
+    return NULL;
+}
+
+
+endpoint * endpoint_get(const struct sockaddr * addr) {
+    endpoint * entry = endpoint_find(addr);
+    if (entry != NULL) {
+        entry->last_used = time(NULL);
+        return entry;
+    }
+
+    endpoint * victim = &table[0];
+
+    for (size_t i = 0; i < ENDPOINT_TABLE_SIZE && victim->addr.ss_family != AF_UNSPEC; i++) {
+        if (table[i].addr.ss_family == AF_UNSPEC || table[i].last_used < victim->last_used)
+            victim = &table[i];
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    memcpy(&victim->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    victim->last_used = time(NULL);
+
+    return victim;
+}
+
+
+void endpoint_failed(const struct sockaddr * addr) {
+    endpoint * entry = endpoint_get(addr);
+
+    entry->connect_failures++;
+    entry->unreachable_until = time(NULL) + proxy_conf.unreachableTtl;
+
+    entry->consecutive_failures++;
+    if (proxy_conf.breakerFailures > 0 && entry->consecutive_failures >= (unsigned) proxy_conf.breakerFailures) {
+        if (entry->ejected_until <= time(NULL))
+            entry->ejections++;
+        entry->ejected_until = time(NULL) + proxy_conf.breakerCooldown;
+    }
+}
+
+
+static double ewma(double average, unsigned long samples, long ms) {
+    if (samples == 0)
+        return ms;
+    return average + ENDPOINT_EWMA_WEIGHT * (ms - average);
+}
+
+
+void endpoint_connected(const struct sockaddr * addr, long ms) {
+    endpoint * entry = endpoint_get(addr);
+
+    entry->connect_ms = ewma(entry->connect_ms, entry->connects, ms);
+    entry->connects++;
+
+    entry->consecutive_failures = 0;
+    entry->ejected_until = 0;
+}
+
+
+void endpoint_first_byte(const struct sockaddr * addr, long ms) {
+    endpoint * entry = endpoint_get(addr);
+
+    entry->first_byte_ms = ewma(entry->first_byte_ms, entry->responses, ms);
+    entry->first_byte_samples[entry->responses % ENDPOINT_SAMPLES] = ms;
+    entry->responses++;
+}
+
+
+double endpoint_latency(const struct sockaddr * addr) {
+    const endpoint * entry = endpoint_find(addr);
+    if (entry == NULL || entry->connects + entry->responses == 0)
+        return -1;
+
+    return entry->connect_ms + entry->first_byte_ms;
+}
+
+
+static int compare_samples(const void * a, const void * b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+
+long endpoint_first_byte_percentile(const struct sockaddr * addr, int pct) {
+    const endpoint * entry = endpoint_find(addr);
+    if (entry == NULL || entry->responses < ENDPOINT_SAMPLES / 2)
+        return -1;
+
+    long samples[ENDPOINT_SAMPLES];
+    size_t count = entry->responses < ENDPOINT_SAMPLES ? entry->responses : ENDPOINT_SAMPLES;
+
+    memcpy(samples, entry->first_byte_samples, count * sizeof(long));
+    qsort(samples, count, sizeof(long), compare_samples);
+
+    size_t rank = (count * pct + 99) / 100;
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+
+bool endpoint_unreachable(const struct sockaddr * addr) {
+    const endpoint * entry = endpoint_find(addr);
+    return entry != NULL && entry->unreachable_until > time(NULL);
+}
+
+
+bool endpoint_ejected(const struct sockaddr * addr) {
+    endpoint * entry = endpoint_find(addr);
+    return entry != NULL && proxy_conf.breakerFailures > 0 && entry->ejected_until > time(NULL);
+}
+
+
+bool endpoint_admit(const struct sockaddr * addr) {
+    endpoint * entry = endpoint_find(addr);
+    if (entry == NULL || proxy_conf.breakerFailures <= 0)
+        return true;
+
+    time_t now = time(NULL);
+    if (entry->ejected_until > now)
+        return false;
+
+    // Half open, hold the rest back until the probe connect is over
+
+    if (entry->consecutive_failures >= (unsigned) proxy_conf.breakerFailures)
+        entry->ejected_until = now + proxy_conf.connectTimeout / 1000 + 1;
+
+    return true;
+}
+
+
+const endpoint * endpoint_at(size_t index) {
+    if (index >= ENDPOINT_TABLE_SIZE || table[index].addr.ss_family == AF_UNSPEC)
+        return NULL;
+    return &table[index];
+}
@@ -0,0 +1,39 @@
+#include <config.h>
+#include <hedging.h>
+
+static hedge_stats stats;
+
+
+void hedge_eligible(void) {
+    stats.eligible++;
+}
+
+
+bool hedge_take(void) {
+    if (proxy_conf.hedgeMaxRate <= 0 || (stats.sent + 1) * 100 > stats.eligible * (unsigned long) proxy_conf.hedgeMaxRate)
+        return false;
+
+    stats.sent++;
+    return true;
+}
+
+
+void hedge_won(void) {
+    stats.won++;
+}
+
+
+void hedge_lost(void) {
+    stats.lost++;
+}
+
+
+void hedge_failed(void) {
+    stats.failed++;
+}
+
+
+hedge_stats * get_hedge_stats(hedge_stats * out) {
+    *out = stats;
+    return out;
+}
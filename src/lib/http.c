@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
 
 #define HTTP_VERSION "HTTP/1.1"
 
@@ -13,6 +16,136 @@ char * methods_strings[8] = {"GET", "POST", "PUT", "DELETE", "CONNECT", "HEAD",
 
 #define min(x,y) (x) < (y) ? (x) : (y)
 
+/*-----------------------------------------
+ *          WELL-KNOWN HEADERS
+ *-----------------------------------------
+ *  Perfect hash over the headers the proxy cares about, generated offline
+ *  in the style of gperf: (length + lowercase first char) mod 32 yields no
+ *  collisions for this set. Adding a header requires checking that its
+ *  slot is still free.
+ */
+
+#define HEADER_HASH_SIZE 32
+
+struct header_slot {
+    const char *    name;
+    size_t          length;
+    http_header_id  id;
+};
+
+#define SLOT(_name, _id) { .name = _name, .length = sizeof(_name) - 1, .id = _id }
+
+static const struct header_slot header_slots[HEADER_HASH_SIZE] = {
+    [0]  = SLOT("Proxy-Connection",    HEADER_PROXY_CONNECTION),
+    [2]  = SLOT("Proxy-Authenticate",  HEADER_PROXY_AUTHENTICATE),
+    [3]  = SLOT("Proxy-Authorization", HEADER_PROXY_AUTHORIZATION),
+    [5]  = SLOT("Transfer-Encoding",   HEADER_TRANSFER_ENCODING),
+    [11] = SLOT("Expect",              HEADER_EXPECT),
+    [12] = SLOT("Host",                HEADER_HOST),
+    [13] = SLOT("Connection",          HEADER_CONNECTION),
+    [14] = SLOT("Authorization",       HEADER_AUTHORIZATION),
+    [17] = SLOT("Content-Length",      HEADER_CONTENT_LENGTH),
+    [21] = SLOT("Keep-Alive",          HEADER_KEEP_ALIVE),
+    [22] = SLOT("TE",                  HEADER_TE),
+    [25] = SLOT("Via",                 HEADER_VIA),
+    [27] = SLOT("Trailer",             HEADER_TRAILER),
+    [28] = SLOT("Upgrade",             HEADER_UPGRADE),
+};
+
+http_header_id http_header_lookup(const char * name, size_t length) {
+    if (length == 0)
+        return HEADER_OTHER;
+
+    const struct header_slot * slot =
+        &header_slots[(length + tolower((unsigned char) name[0])) % HEADER_HASH_SIZE];
+
+    if (slot->name == NULL || slot->length != length || strncasecmp(slot->name, name, length) != 0)
+        return HEADER_OTHER;
+
+    return slot->id;
+}
+
+
+bool http_list_contains(const char * list, const char * token) {
+    size_t length = strlen(token);
+
+    while (*list != 0) {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+            list++;
+
+        const char * end = list;
+        while (*end != 0 && *end != ',')
+            end++;
+
+        const char * back = end;
+        while (back > list && (back[-1] == ' ' || back[-1] == '\t'))
+            back--;
+
+        if ((size_t) (back - list) == length && length > 0 && strncasecmp(list, token, length) == 0)
+            return true;
+
+        list = end;
+    }
+
+    return false;
+}
+
+
+bool http_has_header(const http_message * message, http_header_id id) {
+    for (size_t i = 0; i < message->header_count; i++) {
+        if (message->header_ids[i] == id && message->edits[i] != EDIT_INSERT)
+            return true;
+    }
+    return false;
+}
+
+
+/*-----------------------------------------
+ *          HEADER EDITS
+ *-----------------------------------------
+ *  Edits are recorded against the received header lines instead of
+ *  rebuilding the head, so untouched headers keep their bytes, casing
+ *  and order when forwarded.
+ */
+
+void http_edit_delete(http_message * message, size_t index) {
+    if (index < message->header_count)
+        message->edits[index] = EDIT_DELETE;
+}
+
+
+void http_edit_replace(http_message * message, size_t index, const char * value) {
+    if (index >= message->header_count)
+        return;
+
+    strncpy(message->headers[index][1], value, HEADER_LENGTH - 1);
+    message->headers[index][1][HEADER_LENGTH - 1] = '\0';
+
+    if (message->edits[index] == EDIT_KEEP)
+        message->edits[index] = EDIT_REPLACE;
+}
+
+
+bool http_edit_insert(http_message * message, http_header_id id, const char * name, const char * value) {
+    if (message->header_count >= MAX_HEADERS)
+        return false;
+
+    size_t index = message->header_count++;
+
+    strncpy(message->headers[index][0], name, HEADER_LENGTH - 1);
+    message->headers[index][0][HEADER_LENGTH - 1] = '\0';
+    strncpy(message->headers[index][1], value, HEADER_LENGTH - 1);
+    message->headers[index][1][HEADER_LENGTH - 1] = '\0';
+
+    message->header_ids[index] = id;
+    message->raw_headers[index].line = NULL;
+    message->raw_headers[index].length = 0;
+    message->edits[index] = EDIT_INSERT;
+
+    return true;
+}
+
+
 /*-----------------------------------------
  *          REQUEST SYNTAX
  *-----------------------------------------
@@ -28,7 +161,9 @@ int write_request(http_request * request, char * buffer, size_t space, bool writ
     print("%s %s %s\r\n", methods_strings[request->method - 1], request->url, HTTP_VERSION)
 
     for (size_t i = 0; i < request->message.header_count; i++) {
-        print("%s:%s\r\n", request->message.headers[i][0], request->message.headers[i][1])
+        if (request->message.edits[i] != EDIT_DELETE) {
+            print("%s:%s\r\n", request->message.headers[i][0], request->message.headers[i][1])
+        }
     }
     print("\r\n")
 
@@ -61,9 +196,11 @@ int write_response(http_response * response, char * buffer, size_t space, bool w
         case METHOD_NOT_ALLOWED: default_reason = "Method Not Allowed"; break;
         case CONFLICT: default_reason = "Conflict"; break;
         case PAYLOAD_TOO_LARGE: default_reason = "Payload Too Large"; break;
+        case URI_TOO_LONG: default_reason = "URI Too Long"; break;
         case INTERNAL_SERVER_ERROR: default_reason = "Internal Server Error"; break;
         case NOT_IMPLEMENTED: default_reason = "Not Implemented"; break;
         case BAD_GATEWAY: default_reason = "Bad Gateway"; break;
+        case SERVICE_UNAVAILABLE: default_reason = "Service Unavailable"; break;
         case GATEWAY_TIMEOUT: default_reason = "Gateway Timeout"; break;
     }
 
@@ -72,14 +209,16 @@ int write_response(http_response * response, char * buffer, size_t space, bool w
     
     print("%s %d %s\r\n", HTTP_VERSION, response->status, response->reason)
 
-    bool hasContentLength = false;
     for (size_t i = 0; i < response->message.header_count; i++) {
-        print("%s:%s\r\n", response->message.headers[i][0], response->message.headers[i][1])
-        if (strcmp(response->message.headers[i][0], "Content-Length") == 0)
-            hasContentLength = true;
+        if (response->message.edits[i] != EDIT_DELETE) {
+            print("%s:%s\r\n", response->message.headers[i][0], response->message.headers[i][1])
+        }
     }
 
-    if (!hasContentLength) {
+    // Responses generated by the proxy have no headers and an empty body,
+    // forwarded responses keep the framing chosen by the target
+
+    if (response->message.header_count == 0) {
         print("Content-Length: 0\r\n")
     }
 
@@ -91,3 +230,117 @@ int write_response(http_response * response, char * buffer, size_t space, bool w
     }
     return position;
 }
+
+
+/*-----------------------------------------
+ *          SCATTER-GATHER WRITER
+ *-----------------------------------------
+ *  Same syntax as write_request and write_response, but the head is sent
+ *  straight from the parsed message with writev instead of being copied
+ *  into a buffer first.
+ */
+
+static void writer_add(http_writer * writer, char * base, size_t length) {
+    if (length == 0 || writer->iov_count >= HTTP_WRITER_IOVECS)
+        return;
+
+    writer->iov[writer->iov_count].iov_base = base;
+    writer->iov[writer->iov_count].iov_len = length;
+    writer->iov_count++;
+}
+
+static void writer_add_headers(http_writer * writer, http_message * message) {
+    for (size_t i = 0; i < message->header_count; i++) {
+        http_header_raw * raw = &(message->raw_headers[i]);
+
+        if (message->edits[i] == EDIT_DELETE)
+            continue;
+
+        if (message->edits[i] == EDIT_KEEP && raw->line != NULL) {
+            // Untouched header, forward the received bytes
+            writer_add(writer, raw->line, raw->length);
+        } else {
+            writer_add(writer, message->headers[i][0], strlen(message->headers[i][0]));
+            writer_add(writer, ":", 1);
+            writer_add(writer, message->headers[i][1], strlen(message->headers[i][1]));
+        }
+        writer_add(writer, "\r\n", 2);
+    }
+
+    writer_add(writer, "\r\n", 2);
+}
+
+
+void http_writer_request(http_writer * writer, http_request * request) {
+    writer->iov_count = 0;
+    writer->iov_current = 0;
+    writer->body_length = 0;
+
+    char * method = methods_strings[request->method - 1];
+
+    writer_add(writer, method, strlen(method));
+    writer_add(writer, " ", 1);
+    writer_add(writer, request->url, strlen(request->url));
+    writer_add(writer, " " HTTP_VERSION "\r\n", sizeof(HTTP_VERSION) + 2);
+
+    writer_add_headers(writer, &(request->message));
+}
+
+
+void http_writer_response(http_writer * writer, http_response * response) {
+    writer->iov_count = 0;
+    writer->iov_current = 0;
+    writer->body_length = 0;
+
+    snprintf(writer->status, sizeof(writer->status), "%03u", (unsigned) response->status % 1000);
+
+    writer_add(writer, HTTP_VERSION " ", sizeof(HTTP_VERSION));
+    writer_add(writer, writer->status, 3);
+    writer_add(writer, " ", 1);
+    writer_add(writer, response->reason, strlen(response->reason));
+    writer_add(writer, "\r\n", 2);
+
+    writer_add_headers(writer, &(response->message));
+}
+
+
+void http_writer_body(http_writer * writer, uint8_t * body, size_t length) {
+    size_t count = writer->iov_count;
+    writer_add(writer, (char *) body, length);
+
+    if ((size_t) writer->iov_count > count)
+        writer->body_length += length;
+}
+
+
+ssize_t http_writer_send(http_writer * writer, int fd) {
+    if (http_writer_done(writer))
+        return 0;
+
+    ssize_t sent = writev(fd, writer->iov + writer->iov_current, writer->iov_count - writer->iov_current);
+    if (sent <= 0)
+        return sent;
+
+    // Skip fully sent iovecs and trim the partially sent one
+
+    size_t remaining = sent;
+    while (remaining > 0 && writer->iov_current < writer->iov_count) {
+        struct iovec * iov = &(writer->iov[writer->iov_current]);
+
+        if (remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            writer->iov_current++;
+        } else {
+            iov->iov_base = (char *) iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+            remaining = 0;
+        }
+    }
+
+    return sent;
+}
+
+
+bool http_writer_done(const http_writer * writer) {
+    return writer->iov_current >= writer->iov_count;
+}
@@ -0,0 +1,285 @@
+#include <string.h>
+#include <strings.h>
+
+#include <config.h>
+#include <logger.h>
+#include <origins.h>
+
+static origin table[ORIGIN_TABLE_SIZE];
+
+
+static bool busy(const origin * entry) {
+    return entry->active > 0 || entry->queue_length > 0 || entry->breaker != BREAKER_CLOSED;
+}
+
+
+static bool at_cap(const origin * entry) {
+    return proxy_conf.originMaxConns > 0 && entry->active >= (unsigned) proxy_conf.originMaxConns;
+}
+
+
+// Client a free connection should go to, or -1
+static int next_waiting(const origin * entry) {
+    if (entry->queue_length == 0 || at_cap(entry))
+        return -1;
+    return entry->queue[entry->queue_head];
+}
+
+
+origin * origin_get(const char * host, int port) {
+    origin * victim = NULL;
+
+    for (size_t i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        origin * entry = &table[i];
+
+        // Host names are case insensitive
+
+        if (entry->host[0] != '\0' && entry->port == port && strcasecmp(entry->host, host) == 0) {
+            entry->last_used = time(NULL);
+            return entry;
+        }
+
+        // Clients of a busy origin hold its index, the slot is not given away
+
+        if (entry->host[0] != '\0' && busy(entry))
+            continue;
+
+        if (victim == NULL || (victim->host[0] != '\0'
+            && (entry->host[0] == '\0' || entry->last_used < victim->last_used)))
+            victim = entry;
+    }
+
+    if (victim == NULL)
+        return NULL;
+
+    memset(victim, 0, sizeof(*victim));
+    strncpy(victim->host, host, HOST_LENGTH - 1);
+    victim->port = port;
+    victim->last_used = time(NULL);
+
+    return victim;
+}
+
+
+const origin * origin_at(size_t index) {
+    if (index >= ORIGIN_TABLE_SIZE || table[index].host[0] == '\0')
+        return NULL;
+    return &table[index];
+}
+
+
+int origin_acquire(const char * host, int port, int client, int * index) {
+    origin * entry = origin_get(host, port);
+
+    if (entry == NULL) {
+        log(DEBUG, "Origin table full, %s:%d goes untracked", host, port);
+        *index = -1;
+        return ORIGIN_ADMITTED;
+    }
+
+    *index = (int) (entry - table);
+
+    // Nobody takes a connection ahead of the clients already waiting
+
+    if (entry->queue_length == 0 && !at_cap(entry)) {
+        entry->active++;
+        return ORIGIN_ADMITTED;
+    }
+
+    if (entry->queue_length == ORIGIN_QUEUE_SIZE) {
+        entry->turned_away++;
+        if (entry->probe == client)
+            entry->probe = 0;
+        *index = -1;
+        return ORIGIN_FULL;
+    }
+
+    entry->queue[(entry->queue_head + entry->queue_length) % ORIGIN_QUEUE_SIZE] = client;
+    entry->queue_length++;
+    entry->waited++;
+
+    return ORIGIN_QUEUED;
+}
+
+
+bool origin_admit(int index, int client) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return false;
+
+    origin * entry = &table[index];
+    if (next_waiting(entry) != client)
+        return false;
+
+    entry->queue_head = (entry->queue_head + 1) % ORIGIN_QUEUE_SIZE;
+    entry->queue_length--;
+    entry->active++;
+
+    return true;
+}
+
+
+int origin_release(int index, int client) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return -1;
+
+    origin * entry = &table[index];
+
+    // A probe that ended without an outcome leaves room for another
+
+    if (entry->probe == client)
+        entry->probe = 0;
+
+    // A waiting client leaves the queue, the ones behind it move up
+
+    for (size_t i = 0; i < entry->queue_length; i++) {
+        size_t at = (entry->queue_head + i) % ORIGIN_QUEUE_SIZE;
+        if (entry->queue[at] != client)
+            continue;
+
+        for (size_t j = i; j + 1 < entry->queue_length; j++)
+            entry->queue[(entry->queue_head + j) % ORIGIN_QUEUE_SIZE] = entry->queue[(entry->queue_head + j + 1) % ORIGIN_QUEUE_SIZE];
+
+        entry->queue_length--;
+        entry->turned_away++;
+        return next_waiting(entry);
+    }
+
+    return origin_give_back(index);
+}
+
+
+bool origin_take_extra(int index) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return true;
+
+    origin * entry = &table[index];
+    if (entry->queue_length > 0 || at_cap(entry))
+        return false;
+
+    entry->active++;
+    return true;
+}
+
+
+int origin_give_back(int index) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return -1;
+
+    origin * entry = &table[index];
+    if (entry->active > 0)
+        entry->active--;
+
+    return next_waiting(entry);
+}
+
+
+void origin_resolved(int index, const struct addrinfo * addresses) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return;
+
+    origin * entry = &table[index];
+    entry->address_count = 0;
+
+    for (const struct addrinfo * addr = addresses; addr != NULL && entry->address_count < ORIGIN_ADDRESSES; addr = addr->ai_next) {
+        if (addr->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        memcpy(&(entry->addresses[entry->address_count]), addr->ai_addr, addr->ai_addrlen);
+        entry->address_lengths[entry->address_count] = addr->ai_addrlen;
+        entry->address_count++;
+    }
+}
+
+
+const struct sockaddr * origin_address(int index, size_t i, socklen_t * length) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE || i >= table[index].address_count)
+        return NULL;
+
+    *length = table[index].address_lengths[i];
+    return (const struct sockaddr *) &(table[index].addresses[i]);
+}
+
+
+bool origin_allow(const char * host, int port, int client) {
+    if (proxy_conf.breakerFailures <= 0)
+        return true;
+
+    origin * entry = origin_get(host, port);
+
+    if (entry == NULL || entry->breaker == BREAKER_CLOSED)
+        return true;
+
+    if (entry->breaker == BREAKER_OPEN && time(NULL) >= entry->opened_at + proxy_conf.breakerCooldown) {
+        log(INFO, "Circuit to %s:%d half open", entry->host, entry->port);
+        entry->breaker = BREAKER_HALF_OPEN;
+        entry->probe = 0;
+    }
+
+    if (entry->breaker == BREAKER_HALF_OPEN && entry->probe == 0) {
+        entry->probe = client;
+        return true;
+    }
+
+    entry->fast_failed++;
+    return false;
+}
+
+
+static void count_outcome(origin * entry, bool failed) {
+    time_t now = time(NULL);
+
+    if (now - entry->window_start >= BREAKER_WINDOW) {
+        entry->window_start = now;
+        entry->window_requests = 0;
+        entry->window_failures = 0;
+    }
+
+    entry->window_requests++;
+    if (failed)
+        entry->window_failures++;
+}
+
+
+void origin_succeeded(int index) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return;
+
+    origin * entry = &table[index];
+    entry->consecutive_failures = 0;
+    count_outcome(entry, false);
+
+    if (entry->breaker != BREAKER_CLOSED) {
+        log(INFO, "Circuit to %s:%d closed", entry->host, entry->port);
+        entry->breaker = BREAKER_CLOSED;
+        entry->probe = 0;
+    }
+}
+
+
+void origin_failed(int index) {
+    if (index < 0 || index >= ORIGIN_TABLE_SIZE)
+        return;
+
+    origin * entry = &table[index];
+    entry->consecutive_failures++;
+    count_outcome(entry, true);
+
+    if (proxy_conf.breakerFailures <= 0)
+        return;
+
+    bool tripped = entry->breaker == BREAKER_HALF_OPEN
+        || entry->consecutive_failures >= (unsigned) proxy_conf.breakerFailures
+        || (proxy_conf.breakerErrorRate > 0 && entry->window_requests >= BREAKER_MIN_REQUESTS
+            && entry->window_failures * 100 >= entry->window_requests * (unsigned) proxy_conf.breakerErrorRate);
+
+    if (! tripped)
+        return;
+
+    if (entry->breaker != BREAKER_OPEN) {
+        log(INFO, "Circuit to %s:%d open after %u failures in a row", entry->host, entry->port, entry->consecutive_failures);
+        entry->trips++;
+    }
+
+    entry->breaker = BREAKER_OPEN;
+    entry->opened_at = time(NULL);
+    entry->probe = 0;
+}
@@ -33,6 +33,11 @@ init_char_class(void) {
             class |= TOKEN_HEXDIG;
         }
 
+        // 'a' - 'f', ABNF strings are case-insensitive (RFC 5234 - Section 2.3)
+        if(i >= 0x61 && i <= 0x66) {
+            class |= TOKEN_HEXDIG;
+        }
+
         // '0' - '9'
         if(i >= 0x30 && i <= 0x39) {
             class |= TOKEN_DIGIT;
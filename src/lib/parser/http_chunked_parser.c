@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include <abnf_chars.h>
+#include <parser.h>
+#include <logger.h>
+#include <http_chunked_parser.h>
+
+#pragma GCC diagnostic ignored "-Wunused-variable"
+
+///////////////////////////////////////////////////////////////////////////////
+// STATES AND EVENTS
+
+static char state_names[12][24] = {
+    "CHUNK_SIZE_BEGIN", "CHUNK_SIZE", "CHUNK_EXT", "CHUNK_SIZE_CR", "CHUNK_DATA", "CHUNK_DATA_CR",
+    "TRAILER_BEGIN", "TRAILER", "TRAILER_CR", "TRAILERS_END_CR", "CHUNKED_DONE", "UNEXPECTED"
+};
+
+enum states {
+    CHUNK_SIZE_BEGIN,
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_CR,
+
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+
+    TRAILER_BEGIN,
+    TRAILER,
+    TRAILER_CR,
+    TRAILERS_END_CR,
+
+    CHUNKED_DONE,
+
+    UNEXPECTED
+};
+
+
+static char event_names[6][24] = {
+    "CHUNK_SIZE_VAL", "CHUNK_SIZE_END", "TRAILER_VAL", "CHUNKED_END", "WAIT_MSG", "UNEXPECTED_VALUE"
+};
+
+enum event_type {
+    CHUNK_SIZE_VAL,
+    CHUNK_SIZE_END,
+
+    TRAILER_VAL,
+
+    CHUNKED_END,
+
+    WAIT_MSG,
+    UNEXPECTED_VALUE
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ACTIONS
+
+static void chunk_size(struct parser_event *ret, const uint8_t c) {
+    ret->type    = CHUNK_SIZE_VAL;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+static void chunk_size_end(struct parser_event *ret, const uint8_t c) {
+    ret->type    = CHUNK_SIZE_END;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+static void trailer(struct parser_event *ret, const uint8_t c) {
+    ret->type    = TRAILER_VAL;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+static void chunked_end(struct parser_event *ret, const uint8_t c) {
+    ret->type    = CHUNKED_END;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+static void wait_msg(struct parser_event *ret, const uint8_t c) {
+    ret->type    = WAIT_MSG;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+static void error(struct parser_event *ret, const uint8_t c) {
+    ret->type    = UNEXPECTED_VALUE;
+    ret->n       = 1;
+    ret->data[0] = c;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TRANSITIONS
+
+static const struct parser_state_transition ST_CHUNK_SIZE_BEGIN [] =  {
+    {.when = TOKEN_HEXDIG,          .dest = CHUNK_SIZE,                   .act1 = chunk_size,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_CHUNK_SIZE [] =  {
+    {.when = TOKEN_HEXDIG,          .dest = CHUNK_SIZE,                   .act1 = chunk_size,},
+    {.when = ';',                   .dest = CHUNK_EXT,                    .act1 = wait_msg,},
+    {.when = TOKEN_WSP,             .dest = CHUNK_EXT,                    .act1 = wait_msg,},
+    {.when = TOKEN_CR,              .dest = CHUNK_SIZE_CR,                .act1 = wait_msg,},
+    {.when = TOKEN_LF,              .dest = CHUNK_DATA,                   .act1 = chunk_size_end,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_CHUNK_EXT [] =  {
+    {.when = TOKEN_CR,              .dest = CHUNK_SIZE_CR,                .act1 = wait_msg,},
+    {.when = TOKEN_LF,              .dest = CHUNK_DATA,                   .act1 = chunk_size_end,},
+    {.when = TOKEN_VCHAR,           .dest = CHUNK_EXT,                    .act1 = wait_msg,},
+    {.when = TOKEN_WSP,             .dest = CHUNK_EXT,                    .act1 = wait_msg,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_CHUNK_SIZE_CR [] =  {
+    {.when = TOKEN_LF,              .dest = CHUNK_DATA,                   .act1 = chunk_size_end,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+// Chunk data is skipped without feeding the parser, so only its CRLF gets here
+static const struct parser_state_transition ST_CHUNK_DATA [] =  {
+    {.when = TOKEN_CR,              .dest = CHUNK_DATA_CR,                .act1 = wait_msg,},
+    {.when = TOKEN_LF,              .dest = CHUNK_SIZE_BEGIN,             .act1 = wait_msg,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_CHUNK_DATA_CR [] =  {
+    {.when = TOKEN_LF,              .dest = CHUNK_SIZE_BEGIN,             .act1 = wait_msg,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_TRAILER_BEGIN [] =  {
+    {.when = TOKEN_CR,              .dest = TRAILERS_END_CR,              .act1 = wait_msg,},
+    {.when = TOKEN_LF,              .dest = CHUNKED_DONE,                 .act1 = chunked_end,},
+    {.when = TOKEN_VCHAR,           .dest = TRAILER,                      .act1 = trailer,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_TRAILER [] =  {
+    {.when = TOKEN_VCHAR,           .dest = TRAILER,                      .act1 = trailer,},
+    {.when = TOKEN_WSP,             .dest = TRAILER,                      .act1 = trailer,},
+    {.when = TOKEN_CR,              .dest = TRAILER_CR,                   .act1 = trailer,},
+    {.when = TOKEN_LF,              .dest = TRAILER_BEGIN,                .act1 = trailer,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_TRAILER_CR [] =  {
+    {.when = TOKEN_LF,              .dest = TRAILER_BEGIN,                .act1 = trailer,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_TRAILERS_END_CR [] =  {
+    {.when = TOKEN_LF,              .dest = CHUNKED_DONE,                 .act1 = chunked_end,},
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+static const struct parser_state_transition ST_CHUNKED_DONE [] =  {
+    {.when = ANY,                   .dest = CHUNKED_DONE,                 .act1 = chunked_end,},
+};
+
+static const struct parser_state_transition ST_UNEXPECTED [] =  {
+    {.when = ANY,                   .dest = UNEXPECTED,                   .act1 = error,},
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FORMAL DECLARATION
+
+static const struct parser_state_transition *states [] = {
+    ST_CHUNK_SIZE_BEGIN,
+    ST_CHUNK_SIZE,
+    ST_CHUNK_EXT,
+    ST_CHUNK_SIZE_CR,
+    ST_CHUNK_DATA,
+    ST_CHUNK_DATA_CR,
+    ST_TRAILER_BEGIN,
+    ST_TRAILER,
+    ST_TRAILER_CR,
+    ST_TRAILERS_END_CR,
+    ST_CHUNKED_DONE,
+    ST_UNEXPECTED,
+};
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+static const size_t states_n [] = {
+    N(ST_CHUNK_SIZE_BEGIN),
+    N(ST_CHUNK_SIZE),
+    N(ST_CHUNK_EXT),
+    N(ST_CHUNK_SIZE_CR),
+    N(ST_CHUNK_DATA),
+    N(ST_CHUNK_DATA_CR),
+    N(ST_TRAILER_BEGIN),
+    N(ST_TRAILER),
+    N(ST_TRAILER_CR),
+    N(ST_TRAILERS_END_CR),
+    N(ST_CHUNKED_DONE),
+    N(ST_UNEXPECTED),
+};
+
+static struct parser_definition definition = {
+    .states_count = N(states),
+    .states       = states,
+    .states_n     = states_n,
+    .start_state  = CHUNK_SIZE_BEGIN,
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// AUXILIAR FUNCTIONS
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+static int accumulate_size(http_chunked_parser * parser, const uint8_t c) {
+    unsigned digit = isdigit(c) ? (unsigned) (c - '0') : (unsigned) (tolower(c) - 'a' + 10);
+
+    // Reject chunk sizes that do not fit in a size_t
+    if (parser->chunk_size > (SIZE_MAX >> 4))
+        return -1;
+
+    parser->chunk_size = (parser->chunk_size << 4) | digit;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// PARSER FUNCTIONS
+
+void http_chunked_parser_init(http_chunked_parser * parser) {
+    if(parser != NULL){
+        parser->parser = parser_init(init_char_class(), &definition);
+        parser->chunk_size = 0;
+        parser->chunk_remaining = 0;
+        parser->trailer_length = 0;
+    }
+}
+
+
+void http_chunked_parser_reset(http_chunked_parser * parser) {
+    parser_reset(parser->parser);
+    parser->chunk_size = 0;
+    parser->chunk_remaining = 0;
+    parser->trailer_length = 0;
+}
+
+
+void http_chunked_parser_destroy(http_chunked_parser * parser) {
+    parser_destroy(parser->parser);
+}
+
+
+parse_state http_chunked_parser_parse(
+    http_chunked_parser * parser, const uint8_t * data, size_t * nbytes
+) {
+
+    size_t i = 0;
+
+    while(i < *nbytes) {
+
+        // Skip chunk data in bulk, only the framing goes through the parser
+
+        if (parser->parser->state == CHUNK_DATA && parser->chunk_remaining > 0) {
+            size_t skip = MIN(parser->chunk_remaining, *nbytes - i);
+            parser->chunk_remaining -= skip;
+            i += skip;
+            continue;
+        }
+
+        const struct parser_event * e = parser_feed(parser->parser, data[i++]);
+
+        // log(DEBUG, "STATE %s", state_names[parser->parser->state]);
+        // log(DEBUG, "%s %c", event_names[e->type], e->data[0]);
+
+        switch(e->type) {
+            case CHUNK_SIZE_VAL:
+                if (accumulate_size(parser, e->data[0]) < 0) {
+                    log(DEBUG, "Chunk size overflow");
+                    *nbytes = i;
+                    return FAILED;
+                }
+                break;
+
+            case CHUNK_SIZE_END:
+                // The last chunk has size zero and is followed by the trailer section
+                if (parser->chunk_size == 0)
+                    parser->parser->state = TRAILER_BEGIN;
+
+                parser->chunk_remaining = parser->chunk_size;
+                parser->chunk_size = 0;
+                break;
+
+            case TRAILER_VAL:
+                if (++(parser->trailer_length) > CHUNKED_TRAILER_LENGTH) {
+                    *nbytes = i;
+                    return FAILED;
+                }
+                break;
+
+            case CHUNKED_END:
+                *nbytes = i;
+                return SUCCESS;
+
+            case WAIT_MSG:
+                break;
+
+            case UNEXPECTED_VALUE:
+                *nbytes = i;
+                return FAILED;
+
+            default:
+                log(ERROR, "Unexpected event type %u", e->type);
+                *nbytes = i;
+                return FAILED;
+        }
+
+    }
+
+    return PENDING;
+
+}
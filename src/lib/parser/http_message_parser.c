@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 #include <abnf_chars.h>
@@ -219,6 +220,31 @@ static void assign_header_name(http_message * message, http_message_parser * par
     COPY(message->headers[message->header_count][0], ptr, size);
 }
 
+// Whether the last coding of a Transfer-Encoding list is chunked
+static bool chunked_last(const char * value){
+    const char * last = strrchr(value, ',');
+    last = last == NULL ? value : last + 1;
+
+    while (*last == ' ' || *last == '\t') last++;
+
+    size_t length = strlen(last);
+    while (length > 0 && (last[length - 1] == ' ' || last[length - 1] == '\t')) length--;
+
+    return length == strlen("chunked") && strncasecmp(last, "chunked", length) == 0;
+}
+
+// Parses a Content-Length value, -1 if it is not a plain number
+static long long content_length(const char * value){
+    char * end;
+    long long length = strtoll(value, &end, 10);
+
+    if (end == value || length < 0)
+        return -1;
+
+    while (*end == ' ' || *end == '\t') end++;
+    return *end == '\0' ? length : -1;
+}
+
 static int assign_header_value(http_message * message, http_message_parser * parser, bool ignore_length){
     size_t size;
     char * ptr = (char *) buffer_read_ptr(&(parser->parse_buffer), &size);
@@ -228,25 +254,57 @@ static int assign_header_value(http_message * message, http_message_parser * par
 
     COPY(message->headers[message->header_count][1], ptr, size);
 
-    if (!ignore_length
-        && strncmp(message->headers[message->header_count][0], "Content-Length", HEADER_LENGTH) == 0
-    ) {
-        message->body_length = atoi(message->headers[message->header_count][1]);
-        log(DEBUG, "Found Content-Length: %lu", message->body_length);
-    }
+    // Tag the header once so that later stages switch on its id
 
-    if (strncmp(message->headers[message->header_count][0], "Expect", HEADER_LENGTH) == 0) {
-        message->hasExpect = true;
-        log(DEBUG, "Found Expect header");
-    }
+    char * name = message->headers[message->header_count][0];
+    char * value = message->headers[message->header_count][1];
+
+    char * name_end = memchr(name, 0, HEADER_LENGTH);
+    http_header_id id = http_header_lookup(name, name_end != NULL ? (size_t) (name_end - name) : HEADER_LENGTH);
+    message->header_ids[message->header_count] = id;
+
+    switch (id) {
+        case HEADER_CONTENT_LENGTH:
+            // Transfer-Encoding overrides Content-Length (RFC 7230 - Section 3.3.3)
+            if (!ignore_length && message->framing != FRAMING_CHUNKED && message->framing != FRAMING_CLOSE) {
+                long long length = content_length(value);
+                if (length < 0)
+                    return BAD_REQUEST;
 
-    if (strncmp(message->headers[message->header_count][0], "Transfer-Encoding", HEADER_LENGTH) == 0) {
-        char * value = message->headers[message->header_count][1];
-        while(*value == ' ') value++;
-        log(DEBUG, "Found Transfer-Encoding: %s", value);
-        
-        if (strcmp(value, "chunked") == 0)
-            return NOT_IMPLEMENTED;
+                // Repeated values must agree, a mismatch can't be framed
+
+                for (size_t i = 0; i < message->header_count; i++) {
+                    if (message->header_ids[i] == HEADER_CONTENT_LENGTH && content_length(message->headers[i][1]) != length)
+                        return BAD_REQUEST;
+                }
+
+                message->body_length = (size_t) length;
+                message->framing = length > 0 ? FRAMING_LENGTH : FRAMING_NONE;
+                log(DEBUG, "Found Content-Length: %lu", message->body_length);
+            }
+            break;
+
+        case HEADER_EXPECT:
+            message->hasExpect = true;
+            log(DEBUG, "Found Expect header");
+            break;
+
+        case HEADER_TRANSFER_ENCODING:
+            while(*value == ' ') value++;
+            log(DEBUG, "Found Transfer-Encoding: %s", value);
+
+            // Without chunked as the final coding the body lasts until the
+            // connection closes (RFC 7230 - Section 3.3.3), which only a
+            // response may do
+
+            if (!ignore_length) {
+                message->body_length = 0;
+                message->framing = chunked_last(value) ? FRAMING_CHUNKED : FRAMING_CLOSE;
+            }
+            break;
+
+        default:
+            break;
     }
 
     message->header_count += 1;
@@ -262,7 +320,10 @@ void http_message_parser_init(http_message_parser * parser){
     if(parser != NULL){
         parser->parser = parser_init(init_char_class(), &definition);
         buffer_init(&(parser->parse_buffer), PARSE_BUFF_SIZE, malloc(PARSE_BUFF_SIZE));
+        http_chunked_parser_init(&(parser->chunked_parser));
         parser->current_body_length = 0;
+        parser->pending_body_length = 0;
+        parser->body_state = PENDING;
     }
 }
 
@@ -270,14 +331,17 @@ void http_message_parser_init(http_message_parser * parser){
 void http_message_parser_reset(http_message_parser * parser){
     parser_reset(parser->parser);
     buffer_reset(&(parser->parse_buffer));
+    http_chunked_parser_reset(&(parser->chunked_parser));
     parser->current_body_length = 0;
+    parser->pending_body_length = 0;
+    parser->body_state = PENDING;
 }
 
 
 void http_message_parser_destroy(http_message_parser * parser){
     parser_destroy(parser->parser);
+    http_chunked_parser_destroy(&(parser->chunked_parser));
     free(parser->parse_buffer.data);
-    free(parser);
 }
 
 
@@ -298,6 +362,8 @@ parse_state http_message_parser_parse(
 
         switch(e->type) {
             case HEADER_NAME_VAL:
+                if (! buffer_can_read(&(parser->parse_buffer)))
+                    parser->line_start = pointer;
                 buffer_write(&(parser->parse_buffer), e->data[0]);
                 break;
 
@@ -311,6 +377,12 @@ parse_state http_message_parser_parse(
                 break;
             
             case HEADER_VALUE_END:
+                // Keep where the received line is, so it can be forwarded untouched
+                if (message->header_count < N(message->headers)) {
+                    message->raw_headers[message->header_count].line = parser->line_start;
+                    message->raw_headers[message->header_count].length = pointer - parser->line_start;
+                    message->edits[message->header_count] = EDIT_KEEP;
+                }
                 res = assign_header_value(message, parser, ignore_content_length);
                 buffer_reset(&(parser->parse_buffer));
                 if (res > 0) {
@@ -346,3 +418,48 @@ parse_state http_message_parser_parse(
     return PENDING;
 
 }
+
+
+parse_state http_message_parser_body(
+    http_message_parser * parser, http_message * message, const uint8_t * data, size_t * nbytes
+) {
+
+    // Bytes after a complete body belong to the next message
+
+    if (parser->body_state != PENDING) {
+        *nbytes = 0;
+        return parser->body_state;
+    }
+
+    switch (message->framing) {
+        case FRAMING_LENGTH: {
+            size_t remaining = message->body_length - parser->current_body_length;
+            *nbytes = MIN(*nbytes, remaining);
+            parser->body_state = *nbytes == remaining ? SUCCESS : PENDING;
+            break;
+        }
+
+        case FRAMING_CHUNKED:
+            parser->body_state = http_chunked_parser_parse(&(parser->chunked_parser), data, nbytes);
+            if (parser->body_state == FAILED) {
+                log(DEBUG, "Malformed chunked body");
+                parser->error_code = BAD_REQUEST;
+            }
+            break;
+
+        case FRAMING_CLOSE:
+            // Everything is body until the connection is closed
+            break;
+
+        default:
+            *nbytes = 0;
+            parser->body_state = SUCCESS;
+            break;
+    }
+
+    parser->current_body_length += *nbytes;
+    parser->pending_body_length += *nbytes;
+
+    return parser->body_state;
+
+}
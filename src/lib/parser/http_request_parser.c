@@ -313,6 +313,13 @@ parse_state http_request_parser_parse(http_request_parser * parser, buffer * rea
             if (result == FAILED)
                 parser->error_code = parser->message_parser.error_code;
 
+            // A request body can't last until the connection closes
+
+            if (result == SUCCESS && parser->request.message.framing == FRAMING_CLOSE) {
+                parser->error_code = BAD_REQUEST;
+                return FAILED;
+            }
+
             return result;
 
         }
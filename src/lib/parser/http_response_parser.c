@@ -202,6 +202,33 @@ static void assign_reason(http_response_parser * parser){
 }
 
 
+// Decides how the response body ends (RFC 7230 - Section 3.3.3)
+static void assign_framing(http_response_parser * parser, bool ignore_length){
+    http_message * message = &(parser->response.message);
+    int status = parser->response.status;
+
+    // Responses to HEAD and 1xx, 204 and 304 responses never have a body
+
+    if (ignore_length || status / 100 == 1 || status == 204 || status == 304) {
+        message->framing = FRAMING_NONE;
+        message->body_length = 0;
+        return;
+    }
+
+    if (message->framing != FRAMING_NONE)
+        return;
+
+    // Without Content-Length nor Transfer-Encoding the body lasts until the target closes
+
+    for (size_t i = 0; i < message->header_count; i++) {
+        if (message->header_ids[i] == HEADER_CONTENT_LENGTH)
+            return;
+    }
+
+    message->framing = FRAMING_CLOSE;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 // PARSER FUNCTIONS
 
@@ -298,6 +325,9 @@ parse_state http_response_parser_parse(
             if (result == FAILED)
                 parser->error_code = parser->message_parser.error_code;
 
+            if (result == SUCCESS)
+                assign_framing(parser, ignore_length);
+
             return result;
 
         }
@@ -14,11 +14,14 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <time.h>
 #include <selector.h>
 #include <logger.h>
 #include <config.h>
 #include <statistics.h>
 #include <monitor.h>
+#include <backends.h>
+#include <origins.h>
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -151,6 +154,9 @@ static size_t next_capacity(const size_t n) {
 static inline void item_init(struct item *item) {
     item->client_socket = FD_UNUSED;
     item->target_socket = FD_UNUSED;
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++)
+        item->attempts[i] = FD_UNUSED;
+    item->hedge_socket = FD_UNUSED;
 }
 
 /**
@@ -193,8 +199,47 @@ void item_kill(fd_selector s, struct item * item) {
 
         free_buffer(&item->read_buffer);
         free_buffer(&item->write_buffer);
+        free_buffer(&item->pipeline_buffer);
         free_buffer(&item->req_parser.parse_buffer);
 
+        splice_pipe_release(&item->client_pipe);
+        splice_pipe_release(&item->target_pipe);
+
+        // The request in flight, if any, is over for its upstream
+
+        backend_done(item->backend);
+        item->backend = -1;
+
+        // So is its origin connection, or its place in the wait queue,
+        // along with the one a running hedge took
+
+        if (item->hedge_socket != FD_UNUSED) {
+            int waiting = origin_give_back(item->origin);
+            if (waiting > 0)
+                selector_wake(s, waiting);
+        }
+
+        int waiting = origin_release(item->origin, item->client_socket);
+        item->origin = -1;
+        if (waiting > 0)
+            selector_wake(s, waiting);
+
+        for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+            if (item->attempts[i] == FD_UNUSED)
+                continue;
+            FD_CLR(item->attempts[i], &s->master_r);
+            FD_CLR(item->attempts[i], &s->master_w);
+            close(item->attempts[i]);
+            item->attempts[i] = FD_UNUSED;
+        }
+
+        if (item->hedge_socket != FD_UNUSED) {
+            FD_CLR(item->hedge_socket, &s->master_r);
+            FD_CLR(item->hedge_socket, &s->master_w);
+            close(item->hedge_socket);
+            item->hedge_socket = FD_UNUSED;
+        }
+
        
         // Marks item as unused
         FD_CLR(item->target_socket, &s->master_r);
@@ -211,6 +256,7 @@ void item_kill(fd_selector s, struct item * item) {
 
     item->client_socket = FD_UNUSED;
     item->target_socket = FD_UNUSED;
+    item->timer_armed = false;
     
 }
 
@@ -330,7 +376,7 @@ void selector_update_fdset(fd_selector s, const struct item * item) {
 
         // Check that client socket is set
 
-        if (item->client_socket != 0) {
+        if (item->client_socket > 0) {
             // log(DEBUG, "Updating fd_sets for client %d", item->client_socket)
 
             FD_CLR(item->client_socket, &(s->master_r));
@@ -345,7 +391,7 @@ void selector_update_fdset(fd_selector s, const struct item * item) {
 
         // Check that target socket is set
 
-        if (item->target_socket != 0) {
+        if (item->target_socket > 0) {
             // log(DEBUG, "Updating fd_sets for target %d", item->target_socket)
 
             FD_CLR(item->target_socket, &(s->master_w));
@@ -358,6 +404,32 @@ void selector_update_fdset(fd_selector s, const struct item * item) {
                 FD_SET(item->target_socket, &(s->master_w));   
         }
 
+        // Racing connects share the target interests, they only ever write
+
+        for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+            if (item->attempts[i] == FD_UNUSED)
+                continue;
+
+            FD_CLR(item->attempts[i], &(s->master_r));
+            FD_CLR(item->attempts[i], &(s->master_w));
+
+            if(item->target_interest & OP_WRITE)
+                FD_SET(item->attempts[i], &(s->master_w));
+        }
+
+        // A hedged request has interests of its own
+
+        if (item->hedge_socket != FD_UNUSED) {
+            FD_CLR(item->hedge_socket, &(s->master_r));
+            FD_CLR(item->hedge_socket, &(s->master_w));
+
+            if(item->hedge_interest & OP_READ)
+                FD_SET(item->hedge_socket, &(s->master_r));
+
+            if(item->hedge_interest & OP_WRITE)
+                FD_SET(item->hedge_socket, &(s->master_w));
+        }
+
         // log(DEBUG, "New sets: read_fd[0] = %d | read_fd[4] = %d | read_fd[5] = %d",
         //     FD_ISSET(0, &(s->master_r)), FD_ISSET(4, &(s->master_r)), FD_ISSET(5, &(s->master_r)));
         // log(DEBUG, "New sets: write_fd[0] = %d | write_fd[4] = %d | write_fd[5] = %d",
@@ -497,6 +569,157 @@ finally:
 
 }
 
+/***************************************************************
+  Drains zero-copy completions of the connection sockets
+****************************************************************/
+static bool reap_zerocopy(struct item * item) {
+    uint32_t released = 0;
+
+    if (zerocopy_pending(&item->client_zc))
+        released += zerocopy_reap(&item->client_zc, item->client_socket);
+
+    if (zerocopy_pending(&item->target_zc))
+        released += zerocopy_reap(&item->target_zc, item->target_socket);
+
+    return released > 0;
+}
+
+
+/***************************************************************
+  Per pass I/O budget of the connection being served
+****************************************************************/
+static void refill_budget(struct item * item) {
+    item->pass_bytes = SELECTOR_PASS_BYTES;
+    item->pass_calls = SELECTOR_PASS_CALLS;
+}
+
+
+size_t selector_read_quota(struct selector_key * key, size_t wanted) {
+    return wanted < key->item->pass_bytes ? wanted : key->item->pass_bytes;
+}
+
+
+void selector_charge_read(struct selector_key * key, ssize_t bytes) {
+    struct item * item = key->item;
+
+    if (bytes <= 0)
+        return;
+
+    item->pass_bytes -= (size_t) bytes < item->pass_bytes ? (size_t) bytes : item->pass_bytes;
+}
+
+
+/***************************************************************
+  Serves the reads/writes of a single connection
+****************************************************************/
+static void handle_item(fd_selector s, struct item * item) {
+
+    struct selector_key key = { .s = s, .item = item };
+
+    refill_budget(item);
+
+    // Zero-copy completions are polled every pass, not selected on: the
+    // error queue flags a socket as readable whether or not data waits.
+    // Handlers wait for the next pass and get a block event once all
+    // pages are back.
+
+    if (reap_zerocopy(item)) {
+        if (!zerocopy_pending(&item->client_zc) && !zerocopy_pending(&item->target_zc)
+            && item->stm.current != NULL && item->stm.current->on_block_ready != NULL)
+            stm_handler_block(&(item->stm), &key);
+        return;
+    }
+
+    // Check read operations
+
+    unsigned state = stm_state(&(item->stm));
+    bool did_read = false;
+
+    if(FD_ISSET(item->client_socket, &s->slave_r)) {
+        log(DEBUG, "Client %d has read available", item->client_socket)
+        if(OP_READ & item->client_interest) {
+            key.active_fd = item->client_socket;
+            item->pass_calls--;
+            stm_handler_read(&(item->stm), &key);
+            did_read = true;
+        }
+    }
+
+    if(!did_read && item->target_socket > 0 && FD_ISSET(item->target_socket, &s->slave_r)) {
+        log(DEBUG, "Target %d has read available", item->target_socket)
+        if(OP_READ & item->target_interest) {
+            key.active_fd = item->target_socket;
+            item->pass_calls--;
+            stm_handler_read(&(item->stm), &key);
+            did_read = true;
+        }
+    }
+
+    if(!did_read && item->hedge_socket != FD_UNUSED && FD_ISSET(item->hedge_socket, &s->slave_r)) {
+        log(DEBUG, "Hedge %d has read available", item->hedge_socket)
+        if(OP_READ & item->hedge_interest) {
+            key.active_fd = item->hedge_socket;
+            item->pass_calls--;
+            stm_handler_read(&(item->stm), &key);
+            did_read = true;
+        }
+    }
+
+    // A state relaying in both directions also gets its write in
+    // this pass, so a busy reader does not starve its peer. After
+    // a transition the readiness sets may refer to other sockets.
+
+    if(did_read && (!ITEM_USED(item) || stm_state(&(item->stm)) != state))
+        return;
+
+    if (item->pass_calls == 0)
+        return;
+
+    // Check write operations
+
+    if(FD_ISSET(item->client_socket, &s->slave_w)) {
+        log(DEBUG, "Client %d has write available", item->client_socket)
+        if(OP_WRITE & item->client_interest) {
+            key.active_fd = item->client_socket;
+            item->pass_calls--;
+            stm_handler_write(&(item->stm), &key);
+            return;
+        }
+    }
+
+    if(item->target_socket > 0 && FD_ISSET(item->target_socket, &s->slave_w)) {
+        log(DEBUG, "Target %d has write available", item->target_socket)
+        if(OP_WRITE & item->target_interest) {
+            key.active_fd = item->target_socket;
+            item->pass_calls--;
+            stm_handler_write(&(item->stm), &key);
+            return;
+        }
+    }
+
+    // A racing connect that completed, or failed, turns writable
+
+    for (int i = 0; i < SELECTOR_ATTEMPTS; i++) {
+        int attempt = item->attempts[i];
+        if(attempt != FD_UNUSED && FD_ISSET(attempt, &s->slave_w) && (OP_WRITE & item->target_interest)) {
+            log(DEBUG, "Attempt %d has write available", attempt)
+            key.active_fd = attempt;
+            item->pass_calls--;
+            stm_handler_write(&(item->stm), &key);
+            return;
+        }
+    }
+
+    if(item->hedge_socket != FD_UNUSED && FD_ISSET(item->hedge_socket, &s->slave_w) && (OP_WRITE & item->hedge_interest)) {
+        log(DEBUG, "Hedge %d has write available", item->hedge_socket)
+        key.active_fd = item->hedge_socket;
+        item->pass_calls--;
+        stm_handler_write(&(item->stm), &key);
+    }
+
+}
+
+
 /***************************************************************
   Handles the result of pselect, ie. availables reads/writes
 ****************************************************************/
@@ -533,6 +756,7 @@ static void handle_iteration(fd_selector s) {
 
                 key.item = item;
                 item->master_socket = master_socket;
+                refill_budget(item);
 
                 s->handlers.handle_create(&key);
 
@@ -557,62 +781,101 @@ static void handle_iteration(fd_selector s) {
 
     if (!flag) {
 
-        // A client/target demands attention
+        // A client/target demands attention. Bulk connections leave what
+        // their budget did not cover for the next pass, behind the rest.
 
         for (int i = MASTER_SOCKET_SIZE + UDP_SOCKET_SIZE; i <= n; i++) {
             struct item *item = s->fds + i;
-            key.item = item;
+            if (ITEM_USED(item))
+                handle_item(s, item);
+        }
+    }
 
-            if (ITEM_USED(item)) {
-                
-                // There is an initialized connection on this item
+}
 
-                key.s = s;
 
-                // Check read operations
+/***************************************************************
+  Connection timers
+****************************************************************/
+static long ms_until(const struct timespec * when, const struct timespec * now) {
+    return (when->tv_sec - now->tv_sec) * 1000 + (when->tv_nsec - now->tv_nsec) / 1000000;
+}
 
-                if(FD_ISSET(item->client_socket, &s->slave_r)) {
-                    log(DEBUG, "Client %d has read available", item->client_socket)
-                    if(OP_READ & item->client_interest) {
-                        key.active_fd = item->client_socket;
-                        stm_handler_read(&(item->stm), &key);
-                        continue;
-                    }
-                }
 
-                if(FD_ISSET(item->target_socket, &s->slave_r)) {
-                    log(DEBUG, "Target %d has read available", item->target_socket)
-                    if(OP_READ & item->target_interest) {
-                        key.active_fd = item->target_socket;
-                        stm_handler_read(&(item->stm), &key);
-                        continue;
-                    }
-                }
+void selector_set_timer(struct selector_key * key, long ms) {
+    struct timespec * timer = &(key->item->timer);
 
-                // Check write operations
+    clock_gettime(CLOCK_MONOTONIC, timer);
+    timer->tv_sec += ms / 1000;
+    timer->tv_nsec += (ms % 1000) * 1000000;
+    if (timer->tv_nsec >= 1000000000) {
+        timer->tv_sec++;
+        timer->tv_nsec -= 1000000000;
+    }
 
-                if(FD_ISSET(item->client_socket, &s->slave_w)) {
-                    log(DEBUG, "Client %d has write available", item->client_socket)
-                    if(OP_WRITE & item->client_interest) {
-                        key.active_fd = item->client_socket;
-                        stm_handler_write(&(item->stm), &key);
-                        continue;
-                    }
-                }
+    key->item->timer_armed = true;
+}
 
-                if(FD_ISSET(item->target_socket, &s->slave_w)) {
-                    log(DEBUG, "Target %d has write available", item->target_socket)
-                    if(OP_WRITE & item->target_interest) {
-                        key.active_fd = item->target_socket;
-                        stm_handler_write(&(item->stm), &key);
-                        continue;
-                    }
-                }
 
-            }
+void selector_clear_timer(struct selector_key * key) {
+    key->item->timer_armed = false;
+}
+
+
+void selector_wake(fd_selector s, int fd) {
+    for (size_t i = MASTER_SOCKET_SIZE + UDP_SOCKET_SIZE; i < proxy_conf.maxClients; i++) {
+        struct item * item = s->fds + i;
+        if (item->client_socket != fd)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &item->timer);
+        item->timer_armed = true;
+        return;
+    }
+}
+
+
+/** acorta el timeout de pselect al timer más próximo */
+static void next_timer(fd_selector s, struct timespec * timeout) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long wait = timeout->tv_sec * 1000;
+
+    for (size_t i = MASTER_SOCKET_SIZE + UDP_SOCKET_SIZE; i < proxy_conf.maxClients; i++) {
+        struct item * item = s->fds + i;
+        if (ITEM_USED(item) && item->timer_armed) {
+            long left = ms_until(&item->timer, &now);
+            wait = left < wait ? left : wait;
         }
+
+        if (ITEM_USED(item) && (zerocopy_pending(&item->client_zc) || zerocopy_pending(&item->target_zc)))
+            wait = ZEROCOPY_REAP_MS < wait ? ZEROCOPY_REAP_MS : wait;
     }
 
+    // Round up, waking up a hair early would only loop back here
+
+    wait = wait < 0 ? 0 : wait + 1;
+    timeout->tv_sec = wait / 1000;
+    timeout->tv_nsec = (wait % 1000) * 1000000;
+}
+
+
+static void handle_timers(fd_selector s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (size_t i = MASTER_SOCKET_SIZE + UDP_SOCKET_SIZE; i < proxy_conf.maxClients; i++) {
+        struct item * item = s->fds + i;
+
+        if (!ITEM_USED(item) || !item->timer_armed || ms_until(&item->timer, &now) > 0)
+            continue;
+
+        struct selector_key key = { .s = s, .item = item, .active_fd = -1 };
+        item->timer_armed = false;
+        refill_budget(item);
+        stm_handler_timeout(&(item->stm), &key);
+    }
 }
 
 
@@ -632,6 +895,7 @@ static void handle_block_notifications(fd_selector s) {
 
         if(ITEM_USED(item)) {
             key.item = item;
+            refill_budget(item);
             stm_handler_block(&(item->stm), &key);
         }
         struct blocking_job * aux = j->next;
@@ -691,12 +955,16 @@ selector_status selector_select(fd_selector s) {
             continue;
 
         int localMax = item->client_socket > item->target_socket ? item->client_socket : item->target_socket;
+        for (int j = 0; j < SELECTOR_ATTEMPTS; j++)
+            localMax = item->attempts[j] > localMax ? item->attempts[j] : localMax;
+        localMax = item->hedge_socket > localMax ? item->hedge_socket : localMax;
         maxSocket = localMax > maxSocket ? localMax : maxSocket;
     }
 
     s->max_fd = maxSocket;
         
     struct timespec t = { .tv_sec = SELECTOR_TIMEOUT_SECS };
+    next_timer(s, &t);
 
     s->selector_thread = pthread_self();
     int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &t, &emptyset); // sacar el NULL despues
@@ -719,6 +987,8 @@ selector_status selector_select(fd_selector s) {
         log(DEBUG, "Handling iteration")
         handle_iteration(s);
     }
+
+    handle_timers(s);
     
     handle_block_notifications(s);
 
@@ -0,0 +1,120 @@
+// TCP_DEFER_ACCEPT, TCP_QUICKACK and friends are Linux extensions
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <config.h>
+#include <logger.h>
+#include <socket_options.h>
+
+struct option_spec {
+    const char *    name;
+    int             level;
+    int             name_id;
+    int             max;
+};
+
+static const struct option_spec specs[SOCKOPT_COUNT] = {
+    [SOCKOPT_NODELAY]       = { "TCP_NODELAY",       IPPROTO_TCP, TCP_NODELAY,       1 },
+    [SOCKOPT_DEFER_ACCEPT]  = { "TCP_DEFER_ACCEPT",  IPPROTO_TCP, TCP_DEFER_ACCEPT,  3600 },
+    [SOCKOPT_NOTSENT_LOWAT] = { "TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT, 64 * 1024 * 1024 },
+    [SOCKOPT_SNDBUF]        = { "SO_SNDBUF",         SOL_SOCKET,  SO_SNDBUF,         64 * 1024 * 1024 },
+    [SOCKOPT_RCVBUF]        = { "SO_RCVBUF",         SOL_SOCKET,  SO_RCVBUF,         64 * 1024 * 1024 },
+    [SOCKOPT_KEEPALIVE]     = { "SO_KEEPALIVE",      SOL_SOCKET,  SO_KEEPALIVE,      32767 },
+    [SOCKOPT_QUICKACK]      = { "TCP_QUICKACK",      IPPROTO_TCP, TCP_QUICKACK,      1 },
+};
+
+static const char * class_names[SOCKET_CLASS_COUNT] = {
+    [SOCKET_CLASS_LISTENER] = "listener",
+    [SOCKET_CLASS_CLIENT]   = "client",
+    [SOCKET_CLASS_TARGET]   = "target",
+    [SOCKET_CLASS_DOH]      = "doh",
+};
+
+
+static void set_option(int socket, socket_class class, int level, int name, const char * label, int value) {
+    if (setsockopt(socket, level, name, &value, sizeof(value)) < 0) {
+        log(DEBUG, "Setting %s=%d on %s socket %d failed: %s", label, value, class_names[class], socket, strerror(errno));
+    }
+}
+
+
+void apply_socket_policy(int socket, socket_class class) {
+    if (socket < 0 || class >= SOCKET_CLASS_COUNT)
+        return;
+
+    const int * policy = proxy_conf.socketPolicy[class];
+
+    for (int option = 0; option < SOCKOPT_COUNT; option++) {
+        int value = policy[option];
+        if (value == SOCKOPT_UNSET)
+            continue;
+
+        const struct option_spec * spec = &specs[option];
+
+        if (option == SOCKOPT_KEEPALIVE) {
+            // The value is the idle time, SO_KEEPALIVE itself is a flag
+            set_option(socket, class, SOL_SOCKET, SO_KEEPALIVE, spec->name, value > 0);
+            if (value > 0)
+                set_option(socket, class, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", value);
+            continue;
+        }
+
+        set_option(socket, class, spec->level, spec->name_id, spec->name, value);
+    }
+}
+
+
+int set_socket_policy(socket_class class, socket_option option, int value) {
+    if (class >= SOCKET_CLASS_COUNT || option >= SOCKOPT_COUNT)
+        return -1;
+
+    if (value != SOCKOPT_UNSET && (value < 0 || value > specs[option].max))
+        return -1;
+
+    proxy_conf.socketPolicy[class][option] = value;
+    log(INFO, "Socket policy %s %s set to %d", class_names[class], specs[option].name, value);
+    return 0;
+}
+
+
+int socket_fastopen_listen(int socket, int queue) {
+    if (setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0) {
+        log(ERROR, "Setting TCP_FASTOPEN on socket %d failed: %s", socket, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int socket_fastopen_connect(int socket) {
+    int one = 1;
+    if (setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0) {
+        log(DEBUG, "Setting TCP_FASTOPEN_CONNECT on socket %d failed: %s", socket, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int socket_fastopen_accepted(int socket) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+        return -1;
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+
+const char * socket_class_name(socket_class class) {
+    return class < SOCKET_CLASS_COUNT ? class_names[class] : "unknown";
+}
+
+
+const char * socket_option_name(socket_option option) {
+    return option < SOCKOPT_COUNT ? specs[option].name : "unknown";
+}
@@ -0,0 +1,81 @@
+// splice(2) is a Linux extension, this is the only file that needs it
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <logger.h>
+#include <splice_pipe.h>
+
+static int pool[SPLICE_POOL_SIZE][2];
+static size_t pool_size = 0;
+
+
+void splice_pipe_init(splice_pipe * pipe) {
+    pipe->fds[0] = -1;
+    pipe->fds[1] = -1;
+    pipe->pending = 0;
+}
+
+
+int splice_pipe_acquire(splice_pipe * p) {
+    p->pending = 0;
+
+    if (pool_size > 0) {
+        pool_size--;
+        p->fds[0] = pool[pool_size][0];
+        p->fds[1] = pool[pool_size][1];
+        return 0;
+    }
+
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log(ERROR, "Creating splice pipe");
+        splice_pipe_init(p);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void splice_pipe_release(splice_pipe * p) {
+    if (!splice_pipe_acquired(p))
+        return;
+
+    // A pipe with bytes left would leak them into the next tunnel
+
+    if (p->pending == 0 && pool_size < SPLICE_POOL_SIZE) {
+        pool[pool_size][0] = p->fds[0];
+        pool[pool_size][1] = p->fds[1];
+        pool_size++;
+    } else {
+        close(p->fds[0]);
+        close(p->fds[1]);
+    }
+
+    splice_pipe_init(p);
+}
+
+
+ssize_t splice_pipe_fill(splice_pipe * p, int socket, size_t max) {
+    if (max > SPLICE_CHUNK)
+        max = SPLICE_CHUNK;
+
+    ssize_t moved = splice(socket, NULL, p->fds[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (moved > 0)
+        p->pending += moved;
+
+    return moved;
+}
+
+
+ssize_t splice_pipe_drain(splice_pipe * p, int socket) {
+    ssize_t moved = splice(p->fds[0], NULL, socket, NULL, p->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (moved > 0)
+        p->pending -= moved;
+
+    return moved;
+}
@@ -12,6 +12,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <zerocopy.h>
+#include <origins.h>
+#include <upstream_pool.h>
+#include <endpoints.h>
+#include <backends.h>
+#include <hedging.h>
+#include <address.h>
   
 long global_total_connections=0;
 int global_concurent_connections=0;
@@ -81,7 +88,62 @@ void update(int signal_recv){
     fprintf(fptr,"Number of total connections since server start: %lu\n",global_total_connections);
     fprintf(fptr,"Number of current concurrent connections: %d\n",global_concurent_connections);
     fprintf(fptr,"Number of total bytes sent since server start: %lu\n",total_bytes_sent);
-    fprintf(fptr,"Number of total bytes recieved since server start: %lu\n\n",total_bytes_recieved);
+    fprintf(fptr,"Number of total bytes recieved since server start: %lu\n",total_bytes_recieved);
+
+    zerocopy_stats zc;
+    get_zerocopy_stats(&zc);
+    fprintf(fptr,"Number of zero-copy sends since server start: %lu\n",zc.sends);
+    fprintf(fptr,"Number of zero-copy sends the kernel copied since server start: %lu\n",zc.copies);
+
+    upstream_pool_stats pool;
+    get_upstream_pool_stats(&pool);
+    fprintf(fptr,"Number of requests served on pooled origin connections: %lu\n",pool.reused);
+    fprintf(fptr,"Number of origin connections parked for reuse: %lu\n",pool.parked);
+    fprintf(fptr,"Number of idle origin connections closed: %lu\n",pool.discarded);
+    fprintf(fptr,"Number of requests retried after a pooled connection went stale: %lu\n",pool.retried);
+
+    hedge_stats hedges;
+    get_hedge_stats(&hedges);
+    fprintf(fptr,"Number of requests that could have been hedged: %lu\n",hedges.eligible);
+    fprintf(fptr,"Hedged requests: %lu sent, %lu won, %lu lost, %lu failed\n",hedges.sent,hedges.won,hedges.lost,hedges.failed);
+
+    for (size_t i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        const origin * o = origin_at(i);
+        if (o == NULL || o->tfo_accepted + o->tfo_fallback == 0)
+            continue;
+        fprintf(fptr,"Fast open connects to %s:%d: %lu accepted, %lu fallback\n",o->host,o->port,o->tfo_accepted,o->tfo_fallback);
+    }
+
+    for (size_t i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        const origin * o = origin_at(i);
+        if (o == NULL || o->waited + o->turned_away == 0)
+            continue;
+        fprintf(fptr,"Connections to %s:%d: %u in use, %zu waiting, %lu waited, %lu turned away\n",o->host,o->port,o->active,o->queue_length,o->waited,o->turned_away);
+    }
+
+    static const char * breaker_states[] = { "closed", "open", "half open" };
+    for (size_t i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        const origin * o = origin_at(i);
+        if (o == NULL || o->trips == 0)
+            continue;
+        fprintf(fptr,"Circuit to %s:%d: %s, opened %lu times, %lu requests refused\n",o->host,o->port,breaker_states[o->breaker],o->trips,o->fast_failed);
+    }
+
+    char address[INET6_ADDRSTRLEN + 8];
+    for (size_t i = 0; i < ENDPOINT_TABLE_SIZE; i++) {
+        const endpoint * e = endpoint_at(i);
+        if (e == NULL)
+            continue;
+        sockaddr_print((const struct sockaddr *) &e->addr, address);
+        fprintf(fptr,"Connects to %s: %lu, %lu failed%s, %.1f ms to connect, %.1f ms to first byte, ejected %lu times\n",address,e->connects,e->connect_failures,
+            e->ejected_until > time(NULL) ? " (ejected)" : e->unreachable_until > time(NULL) ? " (unreachable)" : "",e->connect_ms,e->first_byte_ms,e->ejections);
+    }
+
+    for (int i = 0; i < backend_count(); i++) {
+        const backend * b = backend_at(i);
+        fprintf(fptr,"Requests to upstream %s:%d: %lu, %u in flight\n",b->host,b->port,b->requests,b->in_flight);
+    }
+    fprintf(fptr,"\n");
     fclose(fptr);
 
     alarm(proxy_conf.statisticsFrequency);
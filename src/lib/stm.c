@@ -51,6 +51,9 @@ void jump(struct state_machine *stm, unsigned next, struct selector_key *key) {
         }
         stm->current = stm->states + next;
 
+        // Timers belong to the state that armed them
+        key->item->timer_armed = false;
+
         key->item->client_interest = stm->current->client_interest;
         key->item->target_interest = stm->current->target_interest;
         selector_update_fdset(key->s, key->item);
@@ -111,6 +114,18 @@ stm_handler_block(struct state_machine *stm, struct selector_key *key) {
     return ret;
 }
 
+unsigned
+stm_handler_timeout(struct state_machine *stm, struct selector_key *key) {
+    handle_first(stm, key);
+    if(stm->current->on_timeout == 0) {
+        return stm->current->state;
+    }
+    const unsigned int ret = stm->current->on_timeout(stm->current->state, key);
+    jump(stm, ret, key);
+
+    return ret;
+}
+
 void
 stm_handler_close(struct state_machine *stm, struct selector_key *key) {
     if(stm->current != NULL && stm->current->on_departure != NULL) {
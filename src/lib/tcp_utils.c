@@ -9,9 +9,12 @@
 #include <doh_client.h>
 #include <arpa/inet.h>
 #include <tcp_utils.h>
+#include <socket_options.h>
+#include <upstream_pool.h>
 
 #define MAX_PENDING_CONN 5
 #define ADDR_BUFFER_SIZE 128
+#define FASTOPEN_QUEUE 256
 
 void handle_close(struct selector_key * key);
 
@@ -52,14 +55,18 @@ int create_tcp_server(const char *ip, const char *port) {
     }
     log(DEBUG, "IPv4 socket %d created", servSock);
 
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    int one = 1;
 
-    if (setsockopt(servSock, SOL_SOCKET, SO_REUSEADDR, (char *)&timeout, sizeof(int)) < 0) {
+    if (setsockopt(servSock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
         log(ERROR, "set IPv4 socket options SO_REUSEADDR failed %s ", strerror(errno));
     }
 
+    // Buffer sizes must be set before listen to affect the window scale
+    apply_socket_policy(servSock, SOCKET_CLASS_LISTENER);
+
+    if (proxy_conf.proxyArgs.fastopen)
+        socket_fastopen_listen(servSock, FASTOPEN_QUEUE);
+
     struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
@@ -105,17 +112,20 @@ int create_tcp6_server(const char *ip, const char *port) {
     }
     log(DEBUG, "IPv6 socket %d created", servSock);
 
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    int one = 1;
 
-    if (setsockopt(servSock, SOL_SOCKET, SO_REUSEADDR, (char *)&timeout, sizeof(int)) < 0) {
+    if (setsockopt(servSock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
         log(ERROR, "set IPv6 socket options SO_REUSEADDR failed for %s ", strerror(errno));
     }
-    if (setsockopt(servSock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&timeout, sizeof(int)) < 0) {
+    if (setsockopt(servSock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) < 0) {
         log(ERROR, "set IPv6 socket options IPV6_V6ONLY failed %s ", strerror(errno));
     }
 
+    apply_socket_policy(servSock, SOCKET_CLASS_LISTENER);
+
+    if (proxy_conf.proxyArgs.fastopen)
+        socket_fastopen_listen(servSock, FASTOPEN_QUEUE);
+
     struct sockaddr_in6 address;
 
     memset(&address, 0, sizeof(address));
@@ -230,6 +240,10 @@ int handle_connections(int master_sockets[MASTER_SOCKET_SIZE], int udp_sockets[M
             selector_close();
             return -1;
         }
+
+        // Parked origin connections are not watched, check them between passes
+
+        upstream_pool_reap();
     }
 
 }
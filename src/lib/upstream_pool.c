@@ -0,0 +1,191 @@
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <config.h>
+#include <logger.h>
+#include <upstream_pool.h>
+
+struct idle_conn {
+    bool        used;
+    int         socket;
+    char        host[HOST_LENGTH];
+    int         port;
+    int         family;
+    time_t      since;          // when it was parked
+};
+
+static struct idle_conn pool[UPSTREAM_POOL_MAX];
+static upstream_pool_stats stats;
+static time_t last_reap;
+
+
+static size_t pool_size(void) {
+    if (proxy_conf.upstreamPoolSize <= 0)
+        return 0;
+    return proxy_conf.upstreamPoolSize < UPSTREAM_POOL_MAX ? (size_t) proxy_conf.upstreamPoolSize : UPSTREAM_POOL_MAX;
+}
+
+
+static void discard(struct idle_conn * conn, const char * reason) {
+    log(DEBUG, "Closing idle connection %d to %s:%d, %s", conn->socket, conn->host, conn->port, reason);
+    close(conn->socket);
+    conn->used = false;
+    stats.discarded++;
+}
+
+
+static bool expired(const struct idle_conn * conn, time_t now) {
+    return now - conn->since >= proxy_conf.upstreamIdleTimeout;
+}
+
+
+/*
+ * An idle connection has nothing to say. A close or bytes nobody asked
+ * for mean the origin is done with it.
+ */
+static bool alive(const struct idle_conn * conn) {
+    char c;
+    ssize_t peeked = recv(conn->socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+static bool same_origin(const struct idle_conn * conn, const char * host, int port) {
+    return conn->used && conn->port == port && strcasecmp(conn->host, host) == 0;
+}
+
+
+int upstream_pool_get(const char * host, int port, int family) {
+    time_t now = time(NULL);
+
+    // The most recently parked connection is the least likely to be stale
+
+    while (true) {
+        struct idle_conn * newest = NULL;
+
+        for (size_t i = 0; i < UPSTREAM_POOL_MAX; i++) {
+            struct idle_conn * conn = &pool[i];
+            if (!same_origin(conn, host, port) || (family != AF_UNSPEC && conn->family != family))
+                continue;
+            if (newest == NULL || conn->since > newest->since)
+                newest = conn;
+        }
+
+        if (newest == NULL)
+            return -1;
+
+        if (expired(newest, now)) {
+            discard(newest, "expired");
+        } else if (!alive(newest)) {
+            discard(newest, "closed by origin");
+        } else {
+            newest->used = false;
+            stats.reused++;
+            log(DEBUG, "Reusing idle connection %d to %s:%d", newest->socket, host, port);
+            return newest->socket;
+        }
+    }
+}
+
+
+void upstream_pool_put(int socket, const char * host, int port) {
+    size_t size = pool_size();
+
+    if (size == 0 || proxy_conf.upstreamPoolPerOrigin <= 0) {
+        close(socket);
+        return;
+    }
+
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    if (getpeername(socket, (struct sockaddr *) &peer, &length) < 0) {
+        close(socket);
+        return;
+    }
+
+    struct idle_conn * free_slot = NULL, * oldest = NULL, * oldest_origin = NULL;
+    size_t total = 0, per_origin = 0;
+
+    for (size_t i = 0; i < UPSTREAM_POOL_MAX; i++) {
+        struct idle_conn * conn = &pool[i];
+
+        if (!conn->used) {
+            if (free_slot == NULL && i < size)
+                free_slot = conn;
+            continue;
+        }
+
+        total++;
+        if (oldest == NULL || conn->since < oldest->since)
+            oldest = conn;
+
+        if (same_origin(conn, host, port)) {
+            per_origin++;
+            if (oldest_origin == NULL || conn->since < oldest_origin->since)
+                oldest_origin = conn;
+        }
+    }
+
+    // Make room, the newest connection is the one worth keeping
+
+    if (per_origin >= (size_t) proxy_conf.upstreamPoolPerOrigin) {
+        discard(oldest_origin, "origin limit reached");
+        free_slot = oldest_origin;
+    } else if (total >= size || free_slot == NULL) {
+        discard(oldest, "pool limit reached");
+        free_slot = oldest;
+    }
+
+    free_slot->used = true;
+    free_slot->socket = socket;
+    strncpy(free_slot->host, host, HOST_LENGTH - 1);
+    free_slot->host[HOST_LENGTH - 1] = '\0';
+    free_slot->port = port;
+    free_slot->family = peer.ss_family;
+    free_slot->since = time(NULL);
+
+    stats.parked++;
+    log(DEBUG, "Parked idle connection %d to %s:%d", socket, host, port);
+}
+
+
+void upstream_pool_reap(void) {
+    time_t now = time(NULL);
+    size_t size = pool_size();
+
+    // Runs after every selector pass, a sweep per second is plenty
+
+    if (now == last_reap)
+        return;
+    last_reap = now;
+
+    for (size_t i = 0; i < UPSTREAM_POOL_MAX; i++) {
+        struct idle_conn * conn = &pool[i];
+
+        if (!conn->used)
+            continue;
+
+        // Pooling may have been turned down since it was parked
+
+        if (i >= size)
+            discard(conn, "pool shrunk");
+        else if (expired(conn, now))
+            discard(conn, "expired");
+        else if (!alive(conn))
+            discard(conn, "closed by origin");
+    }
+}
+
+
+void upstream_pool_retried(void) {
+    stats.retried++;
+}
+
+
+upstream_pool_stats * get_upstream_pool_stats(upstream_pool_stats * out) {
+    *out = stats;
+    return out;
+}
@@ -0,0 +1,93 @@
+// SO_ZEROCOPY and the error queue are Linux extensions
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include <logger.h>
+#include <zerocopy.h>
+
+static zerocopy_stats stats;
+
+
+void zerocopy_init(zerocopy_state * zc) {
+    memset(zc, 0, sizeof(*zc));
+}
+
+
+static bool zerocopy_enable(zerocopy_state * zc, int socket) {
+    if (zc->enabled == 0) {
+        int one = 1;
+        if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            log(DEBUG, "SO_ZEROCOPY refused on socket %d: %s", socket, strerror(errno));
+            zc->enabled = -1;
+        } else {
+            zc->enabled = 1;
+        }
+    }
+    return zc->enabled > 0;
+}
+
+
+ssize_t zerocopy_send(zerocopy_state * zc, int socket, const void * data, size_t size, bool enabled) {
+    if (!enabled || size < ZEROCOPY_THRESHOLD || !zerocopy_enable(zc, socket))
+        return write(socket, data, size);
+
+    ssize_t sent = send(socket, data, size, MSG_ZEROCOPY);
+
+    // Every successful call gets a completion, even if it sent a part only
+
+    if (sent >= 0) {
+        zc->sent++;
+        stats.sends++;
+    } else if (errno == ENOBUFS) {
+        // Out of optmem for pinned pages, copy this one instead
+        return write(socket, data, size);
+    }
+
+    return sent;
+}
+
+
+uint32_t zerocopy_reap(zerocopy_state * zc, int socket) {
+    uint32_t released = 0;
+
+    while (zerocopy_pending(zc)) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err * err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Notifications cover the inclusive range of send ids [ee_info, ee_data]
+
+            uint32_t count = err->ee_data - err->ee_info + 1;
+            zc->completed += count;
+            released += count;
+
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats.copies += count;
+        }
+    }
+
+    return released;
+}
+
+
+zerocopy_stats * get_zerocopy_stats(zerocopy_stats * out) {
+    *out = stats;
+    return out;
+}